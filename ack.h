@@ -0,0 +1,197 @@
+#ifndef ACK_H
+#define ACK_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <arpa/inet.h>
+#include "data_types.h"
+#include "stats.h"
+#include "packet.h"
+#include "route.h"
+#include "flow.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Senders waiting for an ack before every one of them is acked at once */
+#define ACK_PENDING			4096
+/* Sequence numbers from the cumulative ack that the bitmap covers */
+#define ACK_WINDOW			64
+/* Packets of one flow acknowledged together unless changed with -a */
+#define ACK_EVERY			32
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* Keeps the ack state of every sender in its entry of the flow table */
+DATA_acks *createAcks(DATA_flowTable *flows, unsigned every,
+	DATA_statsSlot **counters)
+{
+	DATA_acks *acks = calloc(1, sizeof(DATA_acks));
+	if (acks == NULL ||
+		(acks->pending = malloc(ACK_PENDING*sizeof(uint64_t))) == NULL ||
+		(acks->packets = malloc(FORWARDBATCH*sizeof(DATA_ackPacket)))
+		== NULL ||
+		(acks->addrs = malloc(FORWARDBATCH*sizeof(struct sockaddr_in)))
+		== NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	flowTrackAcks(flows);
+	acks->flows 	= flows;
+	acks->every 	= every;
+	acks->counters 	= counters;
+	/* Acks leave from the port socket - the batch's own one is not needed */
+	acks->out 		= createForward(FORWARDBATCH);
+	close(acks->out->fd);
+	acks->out->fd 	= -1;
+	return acks;
+}
+
+/* Writes a flow's current state into an ack packet */
+void buildAck(DATA_ackPacket *ack, const DATA_ackState *state)
+{
+	initHeader(&ack->header, PKT_ACK_MSGID, sizeof(DATA_ackPacket));
+	stampHeader(&ack->header, state->cum, state->echo);
+	ack->payload.bitmap 	= htobe64(state->bitmap);
+	ack->payload.received 	= htonl(state->received);
+	ack->payload.missed 	= htonl(state->missed);
+}
+
+/* Queues the flow's ack on the batch of its port socket */
+void queueAck(DATA_acks *acks, const DATA_flowEntry *flow,
+	DATA_ackState *state, int sock, int fds[])
+{
+	/* One sendmmsg() goes out of one socket */
+	if (acks->out->fd != fds[sock] || acks->out->count == acks->out->size)
+	{
+		flushForward(acks->out);
+		acks->out->fd = fds[sock];
+	}
+	unsigned n = acks->out->count;
+	buildAck(&acks->packets[n], state);
+	acks->addrs[n] = flow->addr;
+	queueForward(acks->out, (const char *) &acks->packets[n],
+		sizeof(DATA_ackPacket), &acks->addrs[n]);
+	statAdd(acks->counters[sock], STAT_CONFIRMS, 1);
+	state->pending = 0;
+}
+
+/* Orders flow keys by router port */
+int compareAckPorts(const void *a, const void *b)
+{
+	unsigned x = *(const uint64_t *) a & FLOW_SOCKMASK;
+	unsigned y = *(const uint64_t *) b & FLOW_SOCKMASK;
+	return (x > y) - (x < y);
+}
+
+/*
+** Acknowledges every flow with at least threshold packets pending. The
+** receive loops pass 1 at the end of each pass, so no packet waits for
+** its ack past the pass it arrived in; flows that reach -a packets are
+** acked by recordAck() as they do. Flows are taken in port order, so the
+** acks of each port leave together in one sendmmsg() however the ports'
+** packets were interleaved.
+*/
+void flushAcks(DATA_acks *acks, int fds[], unsigned threshold)
+{
+	qsort(acks->pending, acks->numPending, sizeof(uint64_t),
+		compareAckPorts);
+	unsigned kept = 0;
+	for (unsigned i = 0; i < acks->numPending; i++)
+	{
+		uint64_t key = acks->pending[i];
+		DATA_flowEntry *flow = flowFind(acks->flows, key);
+		/* Gone from the table since - there is no state left to ack */
+		if (flow == NULL)
+		{
+			continue;
+		}
+		DATA_ackState *state = flowAcks(acks->flows, flow);
+		if (state->pending >= threshold && state->pending > 0)
+		{
+			queueAck(acks, flow, state, key & FLOW_SOCKMASK, fds);
+		}
+		if (state->pending > 0)
+		{
+			acks->pending[kept++] = key;
+		}
+		else
+		{
+			state->queued = false;
+		}
+	}
+	acks->numPending = kept;
+	flushForward(acks->out);
+}
+
+/*
+** Records a valid packet of the sender whose flow entry is given, NULL
+** for a sender the full flow table does not track and which is not
+** acknowledged. The window slides over a hole only when a packet arrives
+** more than ACK_WINDOW past it; the sequence numbers passed over are
+** counted as missed.
+*/
+void recordAck(DATA_acks *acks, int fds[], int sock, DATA_flowEntry *flow,
+	const DATA_packetHeader *packet)
+{
+	if (flow == NULL)
+	{
+		return;
+	}
+	DATA_ackState *state = flowAcks(acks->flows, flow);
+	uint32_t seq = packetSeq(packet);
+	/* A new or expired flow starts its window at its first packet */
+	if (!state->active)
+	{
+		state->active 	= true;
+		state->cum 		= seq;
+	}
+	uint32_t offset = seq - state->cum;
+	/* Late duplicates and packets already given up on change nothing */
+	if ((int32_t) offset >= 0)
+	{
+		if (offset >= ACK_WINDOW)
+		{
+			unsigned shift = offset - (ACK_WINDOW - 1);
+			uint64_t passed = (shift >= 64) ? ~0ULL : (1ULL << shift) - 1;
+			state->missed += shift - 
+				__builtin_popcountll(state->bitmap & passed);
+			state->bitmap = (shift >= 64) ? 0 : state->bitmap >> shift;
+			state->cum += shift;
+			offset = ACK_WINDOW - 1;
+		}
+		if (!(state->bitmap & (1ULL << offset)))
+		{
+			state->bitmap |= 1ULL << offset;
+			state->received += 1;
+			/* Move the cumulative ack over the run that is now complete */
+			unsigned run = (~state->bitmap == 0) ? 64 :
+				__builtin_ctzll(~state->bitmap);
+			state->bitmap = (run == 64) ? 0 : state->bitmap >> run;
+			state->cum += run;
+		}
+	}
+	state->echo = packetSendNsec(packet);
+	state->pending += 1;
+	/* -a packets waiting - ack this flow now, without a pass over the list;
+	   a listed flow stays listed until the end of the pass */
+	if (state->pending >= acks->every)
+	{
+		queueAck(acks, flow, state, sock, fds);
+	}
+	if (!state->queued && state->pending > 0)
+	{
+		/* A full list is acknowledged whole to make room */
+		if (acks->numPending == ACK_PENDING)
+		{
+			flushAcks(acks, fds, 1);
+		}
+		state->queued = true;
+		acks->pending[acks->numPending++] = flowKey(&flow->addr, sock);
+	}
+}
+
+#endif
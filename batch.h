@@ -0,0 +1,198 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <errno.h>
+#include <sys/uio.h>
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Datagrams per recvmmsg()/sendmmsg() when batching is enabled */
+#define BATCHSIZE			32
+/* Upper bound accepted for -b */
+#define MAXBATCH			1024
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* 
+** Allocates receive slots, reply headers and the fill histogram for a 
+** batch of up to size datagrams. Each message header points at its own
+** packet and address slot so recvmmsg() fills them in place.
+*/
+DATA_batch *createBatch(unsigned size, const char *reply)
+{
+	DATA_batch *batch = calloc(1, sizeof(DATA_batch));
+	if (batch == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	batch->size 	= size;
+	batch->msgs 	= calloc(size, sizeof(struct mmsghdr));
+	batch->iovs 	= calloc(size, sizeof(struct iovec));
+	batch->packets 	= calloc(size, sizeof(DATA_stdPacket));
+	batch->addrs 	= calloc(size, sizeof(struct sockaddr_in));
+	batch->replies 	= calloc(size, sizeof(struct mmsghdr));
+	batch->fill 	= calloc(size + 1, sizeof(unsigned long));
+	batch->controls = calloc(size, BATCH_CONTROLLEN);
+	if (batch->msgs == NULL || batch->iovs == NULL || 
+		batch->packets == NULL || batch->addrs == NULL || 
+		batch->replies == NULL || batch->fill == NULL || 
+		batch->controls == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	/* Every reply carries the same confirmation string */
+	batch->replyIov.iov_base 	= (void *) reply;
+	batch->replyIov.iov_len 	= strlen(reply);
+	for (unsigned i = 0; i < size; i++)
+	{
+		batch->iovs[i].iov_base 			= &batch->packets[i];
+		batch->iovs[i].iov_len 				= sizeof(DATA_stdPacket);
+		batch->msgs[i].msg_hdr.msg_iov 		= &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen 	= 1;
+		batch->msgs[i].msg_hdr.msg_name 	= &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_control 	= batch->controls[i];
+		batch->replies[i].msg_hdr.msg_iov 	= &batch->replyIov;
+		batch->replies[i].msg_hdr.msg_iovlen = 1;
+		batch->replies[i].msg_hdr.msg_name 	= &batch->addrs[i];
+		batch->replies[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	return batch;
+}
+
+void freeBatch(DATA_batch *batch)
+{
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->packets);
+	free(batch->addrs);
+	free(batch->replies);
+	free(batch->fill);
+	free(batch->controls);
+	free(batch);
+}
+
+/* Points receive slot i at caller-owned memory instead of batch->packets */
+void attachBatchSlot(DATA_batch *batch, unsigned i, void *buf, size_t len, 
+	struct sockaddr_in *addr)
+{
+	batch->iovs[i].iov_base 		= buf;
+	batch->iovs[i].iov_len 			= len;
+	batch->msgs[i].msg_hdr.msg_name = addr;
+	batch->replies[i].msg_hdr.msg_name = addr;
+}
+
+/*
+** Receives up to batch->size datagrams with one recvmmsg(). Blocks for the
+** first datagram on a blocking socket, returns 0 once a non-blocking socket
+** has been drained.
+*/
+int recvBatch(int fd, DATA_batch *batch)
+{
+	/* Kernel overwrites the address and control lengths of filled slots */
+	for (unsigned i = 0; i < batch->size; i++)
+	{
+		batch->msgs[i].msg_hdr.msg_namelen 		= sizeof(struct sockaddr_in);
+		batch->msgs[i].msg_hdr.msg_controllen 	= BATCH_CONTROLLEN;
+	}
+	int n = recvmmsg(fd, batch->msgs, batch->size, MSG_WAITFORONE, NULL);
+	if (n <= 0)
+	{
+		return 0;
+	}
+	/* The drop count is cumulative - the last datagram has the latest */
+	struct msghdr *last = &batch->msgs[n - 1].msg_hdr;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(last); cmsg != NULL; 
+		cmsg = CMSG_NXTHDR(last, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+		{
+			memcpy(&batch->kernelDrops, CMSG_DATA(cmsg), sizeof(uint32_t));
+		}
+	}
+	batch->calls += 1;
+	batch->received += n;
+	batch->fill[n] += 1;
+	return n;
+}
+
+/*
+** Asks the kernel to report with every datagram how many it has dropped
+** on the socket because the receive buffer was full (SO_RXQ_OVFL).
+*/
+void enableKernelDrops(int fd)
+{
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1)
+	{
+		perror("SO_RXQ_OVFL failed");
+	}
+}
+
+/*
+** Sets the socket receive buffer, above net.core.rmem_max when the process
+** may (SO_RCVBUFFORCE), and returns the size the kernel actually uses.
+*/
+int setReceiveBuffer(int fd, int bytes)
+{
+	int size;
+	socklen_t len = sizeof(size);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) 
+		== -1 && 
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == -1)
+	{
+		perror("SO_RCVBUF failed");
+	}
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+	return size;
+}
+
+/* Sends the confirmation to the sender of each of the first n datagrams */
+int sendConfirmations(int fd, DATA_batch *batch, int n)
+{
+	int sent = 0, ret;
+	/* sendmmsg() may stop early, carry on from where it stopped */
+	while (sent < n)
+	{
+		ret = sendmmsg(fd, &batch->replies[sent], n - sent, 0);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("sendmmsg failed");
+			break;
+		}
+		batch->sendCalls += 1;
+		sent += ret;
+	}
+	batch->sent += sent;
+	return sent;
+}
+
+/* Prints call counts, mean fill and the non-empty fill histogram buckets */
+void printBatchStats(DATA_batch *batch, const char *name)
+{
+	printf("%s: %lu datagrams in %lu recvmmsg calls (mean fill %.2f/%u), "
+		"%lu confirmations in %lu sendmmsg calls\n", name,
+		batch->received, batch->calls, 
+		batch->calls ? (double) batch->received/batch->calls : 0.0,
+		batch->size, batch->sent, batch->sendCalls);
+	for (unsigned k = 1; k <= batch->size; k++)
+	{
+		if (batch->fill[k] != 0)
+		{
+			printf("\tfill %4u: %lu\n", k, batch->fill[k]);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*==========================================================================
+** File Name:  	checksum.c
+**
+** Title: 		Trailer Checksum Benchmark
+**
+** Purpose:  	Measures the rate at which packet trailers are verified, in
+** 				GB/s of packet data, with the table-driven CRC32C, the
+** 				SSE4.2 kernel one packet at a time and the SSE4.2 kernel
+** 				over a whole batch, for small to full-size datagrams. Every
+** 				kernel is checked against the others and a known value
+** 				first.
+**
+** Functions Defined:
+**		nowNsec			- 	Monotonic clock in nanoseconds
+**		runSingle		- 	Times one kernel called per packet
+**		runBatch		- 	Times one kernel called per batch
+**		checkKernels	- 	Compares every kernel on random data
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../router.h"
+#include "../checksum.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets verified per run */
+#define BENCH_PACKETS		4000000
+/* Distinct packets cycled through - 12 MB at the largest size */
+#define BENCH_WINDOW		(1 << 13)
+/* Packets per batch call, as in verifyTrailers() */
+#define BENCH_BATCH			CRC32C_BATCH
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+const char *data[BENCH_WINDOW];
+unsigned lens[BENCH_WINDOW];
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+long long nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+double runSingle(crc32cFunc kernel, unsigned size)
+{
+	uint32_t sum = 0;
+	long long start = nowNsec();
+	for (long i = 0; i < BENCH_PACKETS; i++)
+	{
+		unsigned p = i & (BENCH_WINDOW - 1);
+		sum ^= kernel(0, data[p], lens[p]);
+	}
+	double ns = (double) (nowNsec() - start);
+	/* Keeps the loop from being optimised away */
+	if (sum == 1)
+	{
+		printf("#\n");
+	}
+	return (double) BENCH_PACKETS*size/ns;
+}
+
+double runBatch(crc32cBatchFunc kernel, unsigned size)
+{
+	uint32_t crc[BENCH_BATCH], sum = 0;
+	long long start = nowNsec();
+	for (long i = 0; i < BENCH_PACKETS; i += BENCH_BATCH)
+	{
+		unsigned p = i & (BENCH_WINDOW - 1);
+		kernel(&data[p], &lens[p], crc, BENCH_BATCH);
+		sum ^= crc[0] ^ crc[BENCH_BATCH - 1];
+	}
+	double ns = (double) (nowNsec() - start);
+	if (sum == 1)
+	{
+		printf("#\n");
+	}
+	return (double) BENCH_PACKETS*size/ns;
+}
+
+/* Every kernel must give the same CRC for every length and alignment */
+void checkKernels(void)
+{
+	if (crc32cSlice(0, "123456789", 9) != 0xE3069283U ||
+		crc32c(0, "123456789", 9) != 0xE3069283U)
+	{
+		fprintf(stderr, "CRC32C of the check string is wrong\n");
+		exit(EXIT_FAILURE);
+	}
+	const char *ptrs[BENCH_BATCH];
+	unsigned lengths[BENCH_BATCH];
+	uint32_t crc[BENCH_BATCH];
+	for (unsigned i = 0; i < BENCH_BATCH; i++)
+	{
+		ptrs[i] 	= data[i] + (i & 7);
+		lengths[i] 	= (i*37) % (PKT_MAXSIZE - 8);
+	}
+	crc32cBatch(ptrs, lengths, crc, BENCH_BATCH);
+	for (unsigned i = 0; i < BENCH_BATCH; i++)
+	{
+		if (crc[i] != crc32cSlice(0, ptrs[i], lengths[i]) ||
+			crc[i] != crc32c(0, ptrs[i], lengths[i]))
+		{
+			fprintf(stderr, "CRC32C kernels differ at length %u\n",
+				lengths[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(void)
+{
+	unsigned sizes[] = {64, 256, 1472};
+	initChecksum();
+	char *buffer = malloc((size_t) BENCH_WINDOW*PKT_MAXSIZE);
+	if (buffer == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	unsigned seed = 12345;
+	for (size_t i = 0; i < (size_t) BENCH_WINDOW*PKT_MAXSIZE; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+	for (unsigned i = 0; i < BENCH_WINDOW; i++)
+	{
+		data[i] = buffer + (size_t) i*PKT_MAXSIZE;
+	}
+	checkKernels();
+	printf("engine,size,gb_per_s\n");
+	for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		/* The trailer itself is not covered */
+		for (unsigned i = 0; i < BENCH_WINDOW; i++)
+		{
+			lens[i] = sizes[s] - PKT_TRAILERSIZE;
+		}
+		printf("table,%u,%.2f\n", sizes[s], runSingle(crc32cSlice, 
+			sizes[s]));
+		if (crc32cBatch != crc32cBatchSlice)
+		{
+			printf("%s,%u,%.2f\n", checksumEngine, sizes[s],
+				runSingle(crc32c, sizes[s]));
+			printf("%s-batch,%u,%.2f\n", checksumEngine, sizes[s],
+				runBatch(crc32cBatch, sizes[s]));
+		}
+	}
+	free(buffer);
+	exit(EXIT_SUCCESS);
+}
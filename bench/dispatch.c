@@ -0,0 +1,222 @@
+/*==========================================================================
+** File Name:  	dispatch.c
+**
+** Title: 		Receive Engine Dispatch Benchmark
+**
+** Purpose:  	Measures the per-packet cost of finding and reading the
+** 				ready socket with the select() and edge-triggered epoll
+** 				engines used by router.c, for a growing number of bound
+** 				loopback ports. Packets are sent to a random port and the
+** 				time from the wait call to the end of the read is recorded.
+**
+** Functions Defined:
+**		openPorts		- 	Creates and binds non-blocking loopback sockets
+**		dispatchSelect	- 	Rebuilds the fd_set, selects and scans all fds
+**		dispatchEpoll	- 	Waits on epoll and drains only ready fds
+**		nowNsec			- 	Monotonic clock in nanoseconds
+**		setNonBlocking	- 	Sets O_NONBLOCK so engines can drain sockets
+**		raiseFdLimit	- 	Raises RLIMIT_NOFILE to fit every socket
+**		getMax			- 	Global utility function to get max integer from 
+** 							array of integers
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../router.h"
+#include <time.h>
+#include <arpa/inet.h>
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets timed for each engine and port count */
+#define BENCH_PACKETS		200000
+/* Port counts to compare - select() is limited to FD_SETSIZE */
+#define BENCH_STEPS			6
+static const int benchPorts[BENCH_STEPS] = {2, 8, 32, 128, 256, 512};
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+long long nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void openPorts(int fds[], struct sockaddr_in addrs[], int numSock)
+{
+	socklen_t len = sizeof(struct sockaddr_in);
+	for (int i = 0; i < numSock; i++)
+	{
+		/* Let the kernel pick a free loopback port */
+		memset(&addrs[i], 0, sizeof(struct sockaddr_in));
+		addrs[i].sin_family 		= AF_INET;
+		addrs[i].sin_addr.s_addr 	= htonl(INADDR_LOOPBACK);
+		if ((fds[i] = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+			bind(fds[i], (struct sockaddr *) &addrs[i], len) == -1 ||
+			getsockname(fds[i], (struct sockaddr *) &addrs[i], &len) == -1)
+		{
+			perror("socket setup failed");
+			exit(EXIT_FAILURE);
+		}
+		setNonBlocking(fds[i]);
+	}
+}
+
+void setNonBlocking(int fd)
+{
+	/* Keep existing flags and add O_NONBLOCK */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		perror("fcntl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void raiseFdLimit(int numSock)
+{
+	struct rlimit limit;
+	/* Leave room for stdio and the epoll descriptor */
+	rlim_t needed = numSock + 16;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed)
+	{
+		return;
+	}
+	/* Soft limit can only be raised as far as the hard limit */
+	limit.rlim_cur = (needed < limit.rlim_max) ? needed : limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+	{
+		perror("setrlimit failed");
+	}
+}
+
+int getMax(int array[], int nums)
+{
+	/* Init max it to store result */
+	int max = 0;
+	/* Loop through each num and compare to max */
+	for (int i = 0; i < nums; i++)
+	{
+		if (array[i] > max)
+		{
+			max = array[i];
+		}
+	}
+	return max;
+}
+
+long long dispatchSelect(int fds[], int numSock, int maxfd)
+{
+	DATA_stdPacket packet;
+	fd_set readfds;
+	long long start = nowNsec();
+	/* Same work per iteration as runSelect() in router.c */
+	FD_ZERO(&readfds);
+	for (int fd = 0; fd < numSock; fd++)
+	{
+		FD_SET(fds[fd], &readfds);
+	}
+	if (select(maxfd + 1, &readfds, NULL, NULL, NULL) == -1)
+	{
+		perror("select failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int fd = 0; fd < numSock; fd++)
+	{
+		if (FD_ISSET(fds[fd], &readfds))
+		{
+			recv(fds[fd], &packet, sizeof(DATA_stdPacket), 0);
+		}
+	}
+	return nowNsec() - start;
+}
+
+long long dispatchEpoll(int epfd, int fds[])
+{
+	DATA_stdPacket packet;
+	struct epoll_event events[MAXEVENTS];
+	long long start = nowNsec();
+	/* Same work per iteration as runEpoll() in router.c */
+	int ready = epoll_wait(epfd, events, MAXEVENTS, -1);
+	if (ready == -1)
+	{
+		perror("epoll_wait failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < ready; i++)
+	{
+		while (recv(fds[events[i].data.u32], &packet, 
+			sizeof(DATA_stdPacket), 0) != -1)
+		{
+			continue;
+		}
+	}
+	return nowNsec() - start;
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(void)
+{
+	int maxPorts = benchPorts[BENCH_STEPS - 1];
+	raiseFdLimit(maxPorts);
+	int *fds = malloc(maxPorts*sizeof(int));
+	struct sockaddr_in *addrs = malloc(maxPorts*sizeof(struct sockaddr_in));
+	DATA_stdPacket packet = {'B', 'M', 1, 2};
+	/* One sender drives every port */
+	int sender = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fds == NULL || addrs == NULL || sender == -1)
+	{
+		perror("setup failed");
+		exit(EXIT_FAILURE);
+	}
+	srand(1);
+	printf("ports,select_ns_per_pkt,epoll_ns_per_pkt\n");
+	for (int step = 0; step < BENCH_STEPS; step++)
+	{
+		int numSock = benchPorts[step];
+		openPorts(fds, addrs, numSock);
+		int maxfd = getMax(fds, numSock);
+		/* Register every port once with the epoll engine */
+		int epfd = epoll_create1(0);
+		struct epoll_event event;
+		for (int fd = 0; fd < numSock; fd++)
+		{
+			event.events 	= EPOLLIN | EPOLLET;
+			event.data.u32 	= fd;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, fds[fd], &event);
+		}
+		long long selectNs = 0, epollNs = 0;
+		for (int i = 0; i < BENCH_PACKETS; i++)
+		{
+			/* Loopback delivery completes before sendto() returns */
+			int port = rand() % numSock;
+			sendto(sender, &packet, sizeof(packet), 0, 
+				(struct sockaddr *) &addrs[port], sizeof(addrs[port]));
+			selectNs += dispatchSelect(fds, numSock, maxfd);
+			port = rand() % numSock;
+			sendto(sender, &packet, sizeof(packet), 0, 
+				(struct sockaddr *) &addrs[port], sizeof(addrs[port]));
+			epollNs += dispatchEpoll(epfd, fds);
+		}
+		printf("%d,%.1f,%.1f\n", numSock, 
+			(double) selectNs/BENCH_PACKETS, (double) epollNs/BENCH_PACKETS);
+		fflush(stdout);
+		close(epfd);
+		for (int fd = 0; fd < numSock; fd++)
+		{
+			close(fds[fd]);
+		}
+	}
+	close(sender);
+	free(fds);
+	free(addrs);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,123 @@
+/*==========================================================================
+** File Name:  	flow.c
+**
+** Title: 		Flow Table Benchmark
+**
+** Purpose:  	Measures the cost per packet of finding and updating the
+** 				sender's entry in the flow table, for 1K to 1M concurrent
+** 				senders in random order, and under full churn, where every
+** 				packet comes from a new sender and old ones expire.
+**
+** Functions Defined:
+**		nowNsec			- 	Monotonic clock in nanoseconds
+**		runFlows		- 	Times flowTouch() over a set of senders
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../router.h"
+#include "../flow.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets looked up per run */
+#define BENCH_PACKETS		10000000
+/* Distinct packets cycled through, each from a random sender */
+#define BENCH_WINDOW		(1 << 20)
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+long long nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/*
+** Sends BENCH_PACKETS packets from numFlows senders through a table with 
+** the given number of slots. With churn set every packet comes from a new
+** sender and time advances so that numFlows senders are live at once.
+*/
+double runFlows(unsigned numFlows, unsigned capacity, bool churn, 
+	DATA_statsSlot *counters, unsigned *maxProbe)
+{
+	DATA_flowTable *table = createFlows(capacity, 1);
+	struct sockaddr_in *srcs = malloc(BENCH_WINDOW*sizeof(struct sockaddr_in));
+	if (srcs == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	unsigned seed = 12345;
+	for (unsigned i = 0; i < BENCH_WINDOW; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		unsigned flow = (seed >> 4) % numFlows;
+		memset(&srcs[i], 0, sizeof(struct sockaddr_in));
+		srcs[i].sin_family 		= AF_INET;
+		srcs[i].sin_addr.s_addr = htonl(0x0A000000 + flow/16);
+		srcs[i].sin_port 		= htons(10000 + flow % 16);
+	}
+	DATA_packetHeader packet;
+	initHeader(&packet, 1, PKT_HDRSIZE);
+	/* With churn a sender is idle once numFlows newer ones have sent */
+	uint64_t now = 0, step = churn ? 1000000000ULL/numFlows + 1 : 0;
+	unsigned long tracked = 0;
+	long long start = nowNsec();
+	for (long i = 0; i < BENCH_PACKETS; i++)
+	{
+		struct sockaddr_in *src = &srcs[i & (BENCH_WINDOW - 1)];
+		if (churn)
+		{
+			/* Move the sender to an address not used before */
+			src->sin_addr.s_addr = htonl(ntohl(src->sin_addr.s_addr) + 
+				numFlows/16);
+		}
+		now += step;
+		stampHeader(&packet, i, 0);
+		tracked += (flowTouch(table, src, 0, &packet, PKT_HDRSIZE, now, 
+			counters) != NULL);
+	}
+	double ns = (double) (nowNsec() - start)/BENCH_PACKETS;
+	if (!churn && tracked != BENCH_PACKETS)
+	{
+		fprintf(stderr, "Tracked %lu packets, expected %d\n", tracked, 
+			BENCH_PACKETS);
+	}
+	*maxProbe = table->maxProbe;
+	free(srcs);
+	free(table->keys);
+	free(table->entries);
+	free(table);
+	return ns;
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(void)
+{
+	unsigned sizes[] = {1024, 16384, 131072, 1048576};
+	DATA_stats *stats = createStats(1, 0);
+	DATA_statsSlot *counters = statsSlot(stats, "bench", 0, 0);
+	unsigned maxProbe;
+	double ns;
+	printf("flows,slots,churn,ns_per_pkt,longest_probe\n");
+	for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		/* Half full, well below the three quarter limit */
+		ns = runFlows(sizes[s], 2*sizes[s], false, counters, &maxProbe);
+		printf("%u,%u,0,%.1f,%u\n", sizes[s], 2*sizes[s], ns, maxProbe);
+		ns = runFlows(sizes[s], 2*sizes[s], true, counters, &maxProbe);
+		printf("%u,%u,1,%.1f,%u\n", sizes[s], 2*sizes[s], ns, maxProbe);
+	}
+	printf("untracked,%lu\n", (unsigned long) statRead(counters, 
+		STAT_UNTRACKED));
+	exit(EXIT_SUCCESS);
+}
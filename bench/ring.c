@@ -0,0 +1,145 @@
+/*==========================================================================
+** File Name:  	ring.c
+**
+** Title: 		Reader to Processor Handoff Benchmark
+**
+** Purpose:  	Measures the cost per packet of handing packets from a
+** 				producer thread to a consumer thread through the lock-free
+** 				packetQueue ring of pool slot indices, one at a time and in bulk, against the
+** 				semaphore plus mutex handoff the multithreaded router used
+** 				before the ring.
+**
+** Functions Defined:
+**		nowNsec			- 	Monotonic clock in nanoseconds
+**		ringProducer	- 	Enqueues packets one at a time or in bulk
+**		lockedProducer	- 	Semaphore/mutex protected enqueue
+**		runRing			- 	Times a ring producer/consumer pair
+**		runLocked		- 	Times a locked producer/consumer pair
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../router.h"
+#include <sched.h>
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets handed over per run */
+#define BENCH_PACKETS		10000000
+/* Packets per enqueue_n/dequeue_n call in bulk mode */
+#define BENCH_BULK			32
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+packetQueue *ring;
+unsigned bulk;
+/* Baseline - the old mutex/semaphore handoff around a plain array */
+uint32_t lockedArray[MAXBUFFER];
+int lockedFront, lockedRear;
+MUTEX lockedMutex;
+SEM lockedFree, lockedUsed;
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+long long nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void *ringProducer(void *args)
+{
+	uint32_t slots[BENCH_BULK];
+	memset(slots, 0, sizeof(slots));
+	for (long sent = 0; sent < BENCH_PACKETS; )
+	{
+		unsigned n = enqueue_n(ring, slots, bulk);
+		if (n == 0)
+		{
+			sched_yield();
+		}
+		sent += n;
+	}
+	return NULL;
+}
+
+void *lockedProducer(void *args)
+{
+	uint32_t slot = 0;
+	for (long sent = 0; sent < BENCH_PACKETS; sent++)
+	{
+		sem_wait(&lockedFree);
+		pthread_mutex_lock(&lockedMutex);
+		lockedArray[lockedRear] = slot++;
+		lockedRear = (lockedRear + 1) % MAXBUFFER;
+		pthread_mutex_unlock(&lockedMutex);
+		sem_post(&lockedUsed);
+	}
+	return NULL;
+}
+
+double runRing(unsigned n)
+{
+	pthread_t tid;
+	uint32_t slots[BENCH_BULK];
+	ring = createQueue(MAXBUFFER);
+	bulk = n;
+	long long start = nowNsec();
+	pthread_create(&tid, NULL, ringProducer, NULL);
+	for (long got = 0; got < BENCH_PACKETS; )
+	{
+		unsigned k = dequeue_n(ring, slots, bulk);
+		if (k == 0)
+		{
+			sched_yield();
+		}
+		got += k;
+	}
+	pthread_join(tid, NULL);
+	double ns = (double) (nowNsec() - start)/BENCH_PACKETS;
+	free(ring->array);
+	free(ring);
+	return ns;
+}
+
+double runLocked(void)
+{
+	pthread_t tid;
+	uint32_t slot;
+	pthread_mutex_init(&lockedMutex, NULL);
+	sem_init(&lockedFree, 0, MAXBUFFER);
+	sem_init(&lockedUsed, 0, 0);
+	long long start = nowNsec();
+	pthread_create(&tid, NULL, lockedProducer, NULL);
+	for (long got = 0; got < BENCH_PACKETS; got++)
+	{
+		sem_wait(&lockedUsed);
+		pthread_mutex_lock(&lockedMutex);
+		slot = lockedArray[lockedFront];
+		lockedFront = (lockedFront + 1) % MAXBUFFER;
+		pthread_mutex_unlock(&lockedMutex);
+		sem_post(&lockedFree);
+	}
+	pthread_join(tid, NULL);
+	(void) slot;
+	return (double) (nowNsec() - start)/BENCH_PACKETS;
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(void)
+{
+	printf("handoff,ns_per_pkt\n");
+	printf("mutex+sem,%.1f\n", runLocked());
+	printf("spsc,%.1f\n", runRing(1));
+	printf("spsc_bulk%d,%.1f\n", BENCH_BULK, runRing(BENCH_BULK));
+	exit(EXIT_SUCCESS);
+}
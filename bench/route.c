@@ -0,0 +1,137 @@
+/*==========================================================================
+** File Name:  	route.c
+**
+** Title: 		Route Lookup Benchmark
+**
+** Purpose:  	Measures the cost per packet of looking up the message ID
+** 				in the direct-indexed route table and running its local
+** 				destinations, for route tables of a few to all 64K message
+** 				IDs and for fan-outs of one and four destinations. Local
+** 				handlers run once per FORWARDBATCH packets, as in the
+** 				routers.
+**
+** Functions Defined:
+**		nowNsec			- 	Monotonic clock in nanoseconds
+**		runRoutes		- 	Times routePacket() over a table of routes
+**		createSocket	- 	Calls to socket() for the unused forward batch
+**		processPacket	- 	Required by the print handler, never routed to
+**		processSpacePacket	- Likewise
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../router.h"
+#include "../route.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets routed per run */
+#define BENCH_PACKETS		10000000
+/* Distinct packets cycled through, spread over the routed IDs */
+#define BENCH_WINDOW		(1 << 20)
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+long long nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+double runRoutes(unsigned numRoutes, unsigned fanOut, DATA_forward *fwd,
+	DATA_statsSlot *counters)
+{
+	DATA_routeDest *list = NULL;
+	unsigned count = 0, capacity = 0;
+	char line[256];
+	/* Spread the routed IDs over the whole table */
+	unsigned stride = ROUTE_IDS/numRoutes;
+	for (unsigned r = 0; r < numRoutes; r++)
+	{
+		int used = snprintf(line, sizeof(line), "%u", r*stride);
+		for (unsigned d = 0; d < fanOut; d++)
+		{
+			used += snprintf(line + used, sizeof(line) - used, 
+				" local:discard");
+		}
+		parseRouteLine(line, r + 1, &list, &count, &capacity);
+	}
+	DATA_routeTable *table = buildRouteTable(list, count);
+	/* Random routed IDs so lookups hit the whole table */
+	DATA_packetHeader *packets = malloc(BENCH_WINDOW*PKT_HDRSIZE);
+	if (packets == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	unsigned seed = 12345;
+	for (unsigned i = 0; i < BENCH_WINDOW; i++)
+	{
+		seed = seed*1103515245 + 12345;
+		initHeader(&packets[i], ((seed >> 8) % numRoutes)*stride, 
+			PKT_HDRSIZE);
+	}
+	unsigned long total = 0;
+	long long start = nowNsec();
+	for (long i = 0; i < BENCH_PACKETS; i++)
+	{
+		total += routePacket(table, fwd, &packets[i & (BENCH_WINDOW - 1)], 
+			0, counters);
+	}
+	flushForward(fwd);
+	double ns = (double) (nowNsec() - start)/BENCH_PACKETS;
+	if (total != (unsigned long) BENCH_PACKETS*fanOut)
+	{
+		fprintf(stderr, "Routed %lu destinations, expected %lu\n", total,
+			(unsigned long) BENCH_PACKETS*fanOut);
+	}
+	free(packets);
+	free(list);
+	freeRoutes(table);
+	return ns;
+}
+
+int createSocket()
+{
+	int fd;
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+void processPacket(DATA_stdPacket *packet)
+{
+	(void) packet;
+}
+
+void processSpacePacket(const DATA_spaceHeader *space)
+{
+	(void) space;
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(void)
+{
+	unsigned sizes[] = {16, 1024, 4096, 16384, 65536};
+	DATA_forward *fwd = createForward(FORWARDBATCH);
+	DATA_stats *stats = createStats(1, 0);
+	DATA_statsSlot *counters = statsSlot(stats, "bench", 0, 0);
+	printf("routes,fan_out,ns_per_pkt\n");
+	for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		printf("%u,1,%.1f\n", sizes[s], runRoutes(sizes[s], 1, fwd, counters));
+		printf("%u,4,%.1f\n", sizes[s], runRoutes(sizes[s], 4, fwd, counters));
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,161 @@
+#!/bin/bash
+#==========================================================================
+# File Name:  	run.sh
+#
+# Title: 		End-to-End Router Benchmark Suite
+#
+# Purpose:  	Starts each router variant on loopback, drives it with the
+# 				load generator at stepped offered loads and records the
+# 				achieved rate, drop rate, router CPU usage and latency
+# 				percentiles. Results are written as CSV (one row per step)
+# 				and JSON (steps plus the max sustainable rate per variant).
+# 				With BENCH_BASELINE set to an earlier JSON file the run
+# 				fails if a variant's max sustainable rate dropped by more
+# 				than BENCH_TOLERANCE percent.
+#
+# Usage:		make bench, or bench/run.sh from the repository root
+#
+# Environment:
+#		BENCH_VARIANTS	- 	router variants (select epoll uring multithreaded)
+#		BENCH_RATES		- 	offered loads in packets/s, 0 = open loop
+#		BENCH_DURATION	- 	seconds per step
+#		BENCH_THREADS	- 	load generator sender threads
+#		BENCH_PORT		- 	first router port, two ports are used
+#		BENCH_MAXDROP	- 	drop percentage still counted as sustained
+#		BENCH_OUT		- 	output directory
+#		BENCH_BASELINE	- 	JSON results to compare against
+#		BENCH_TOLERANCE	- 	allowed max rate regression in percent
+#		BENCH_LOGLEVEL	- 	router log level (error warn info debug)
+#
+#==========================================================================
+
+set -u
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+VARIANTS="${BENCH_VARIANTS:-select epoll uring multithreaded}"
+RATES="${BENCH_RATES:-10000 25000 50000 100000 200000 0}"
+DURATION="${BENCH_DURATION:-2}"
+THREADS="${BENCH_THREADS:-2}"
+PORT="${BENCH_PORT:-23400}"
+MAXDROP="${BENCH_MAXDROP:-0.1}"
+OUT="${BENCH_OUT:-$ROOT/bench/results}"
+BASELINE="${BENCH_BASELINE:-}"
+TOLERANCE="${BENCH_TOLERANCE:-10}"
+LOGLEVEL="${BENCH_LOGLEVEL:-warn}"
+STAMP="$(date +%Y%m%d-%H%M%S)"
+CSV="$OUT/bench-$STAMP.csv"
+JSON="$OUT/bench-$STAMP.json"
+TICKS="$(getconf CLK_TCK)"
+
+mkdir -p "$OUT"
+
+# Prints utime + stime of a process in clock ticks
+cpuTicks()
+{
+	awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+# Starts one router variant in the background, sets ROUTER_PID
+startRouter()
+{
+	local variant="$1" log="$2"
+	if [ "$variant" = "multithreaded" ]; then
+		"$ROOT/multithreaded/router" -p "$PORT" -n 2 -b 32 -L "$LOGLEVEL" \
+			> "$log" 2>&1 &
+	else
+		"$ROOT/router" -e "$variant" -p "$PORT" -n 2 -c 0 -b 32 \
+			-L "$LOGLEVEL" > "$log" 2>&1 &
+	fi
+	ROUTER_PID=$!
+	sleep 0.5
+}
+
+# Packets the router reports having processed, from its exit output
+routerPackets()
+{
+	local variant="$1" log="$2"
+	if [ "$variant" = "multithreaded" ]; then
+		grep -a "Packets processed" "$log" | tail -1 | awk '{ print $1 }'
+	else
+		grep -a "^Engine " "$log" | awk '{ print $3 }'
+	fi
+}
+
+echo "variant,offered_pps,sent,processed,achieved_pps,drop_pct,cpu_pct,p50_us,p99_us,p999_us" > "$CSV"
+STEPS=""
+SUMMARY=""
+for variant in $VARIANTS; do
+	best=0
+	for rate in $RATES; do
+		log="$(mktemp)"
+		startRouter "$variant" "$log"
+		if ! kill -0 "$ROUTER_PID" 2>/dev/null; then
+			echo "$variant: router did not start, skipping" >&2
+			cat "$log" >&2
+			rm -f "$log"
+			continue 2
+		fi
+		ackFlag=""
+		if [ "$variant" = "multithreaded" ]; then
+			# The multithreaded router sends no acknowledgements
+			ackFlag="-N"
+		fi
+		cpu0="$(cpuTicks "$ROUTER_PID")"
+		result="$("$ROOT/client" -t "$THREADS" -p "$PORT" -n 2 -r "$rate" \
+			-d "$DURATION" $ackFlag -o csv | tail -1)"
+		cpu1="$(cpuTicks "$ROUTER_PID")"
+		kill -INT "$ROUTER_PID"
+		wait "$ROUTER_PID" 2>/dev/null
+		processed="$(routerPackets "$variant" "$log")"
+		rm -f "$log"
+		# threads,ports,size,rate,sent,confirmed,lost,loss_pct,pps,p50,p99,p999,max,acks
+		row="$(echo "$result" | awk -F, -v v="$variant" -v r="$rate" \
+			-v p="${processed:-0}" -v c0="$cpu0" -v c1="$cpu1" \
+			-v t="$TICKS" -v d="$DURATION" '{
+				drop = ($5 > 0) ? 100.0*($5 - p)/$5 : 0;
+				if (drop < 0) drop = 0;
+				printf "%s,%d,%d,%d,%.0f,%.4f,%.1f,%s,%s,%s",
+					v, r, $5, p, p/d, drop, 100.0*(c1 - c0)/t/d,
+					$10, $11, $12 }')"
+		echo "$row" | tee -a "$CSV"
+		achieved="$(echo "$row" | cut -d, -f5)"
+		drop="$(echo "$row" | cut -d, -f6)"
+		if awk -v d="$drop" -v m="$MAXDROP" -v a="$achieved" -v b="$best" \
+			'BEGIN { exit !(d <= m && a > b) }'; then
+			best="$achieved"
+		fi
+		STEPS="$STEPS$(echo "$row" | awk -F, '{
+			printf "%s{\"variant\": \"%s\", \"offered_pps\": %s, \"sent\": %s, \"processed\": %s, \"achieved_pps\": %s, \"drop_pct\": %s, \"cpu_pct\": %s, \"p50_us\": %s, \"p99_us\": %s, \"p999_us\": %s}",
+				"", $1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }'),"
+	done
+	SUMMARY="$SUMMARY\"$variant\": $best,"
+	echo "$variant: max sustainable rate $best pps (drop <= $MAXDROP%)"
+done
+
+{
+	printf '{"timestamp": "%s", "duration_s": %s, "threads": %s, ' \
+		"$STAMP" "$DURATION" "$THREADS"
+	printf '"max_sustainable_pps": {%s}, ' "${SUMMARY%,}"
+	printf '"steps": [%s]}\n' "${STEPS%,}"
+} > "$JSON"
+cp "$CSV" "$OUT/latest.csv"
+cp "$JSON" "$OUT/latest.json"
+echo "Results: $CSV $JSON"
+
+# Fail on a max sustainable rate regression against the baseline
+if [ -n "$BASELINE" ]; then
+	status=0
+	for variant in $VARIANTS; do
+		old="$(grep -o "\"$variant\": [0-9.]*" "$BASELINE" | head -1 | awk '{ print $2 }')"
+		new="$(grep -o "\"$variant\": [0-9.]*" "$JSON" | head -1 | awk '{ print $2 }')"
+		if [ -z "$old" ] || [ -z "$new" ]; then
+			continue
+		fi
+		if awk -v o="$old" -v n="$new" -v t="$TOLERANCE" \
+			'BEGIN { exit !(n < o*(1 - t/100.0)) }'; then
+			echo "REGRESSION $variant: $new pps vs baseline $old pps" >&2
+			status=1
+		fi
+	done
+	exit $status
+fi
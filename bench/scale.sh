@@ -0,0 +1,71 @@
+#!/bin/bash
+#==========================================================================
+# File Name:  	scale.sh
+#
+# Title: 		Processing Worker Scaling Benchmark
+#
+# Purpose:  	Runs the multithreaded router with 1 to 16 processing
+# 				workers (-P) and a fixed simulated cost per packet (-w),
+# 				drives it open loop with enough sender threads for many
+# 				flows and records the processing rate and steals per step.
+# 				Each sender thread and port pair is one flow, and a flow
+# 				is only ever processed by one worker at a time, so the
+# 				flow count bounds the useful number of workers.
+#
+# Usage:		make scale, or bench/scale.sh from the repository root
+#
+# Environment:
+#		SCALE_WORKERS	- 	worker counts to step through
+#		SCALE_WORK		- 	simulated processing cost per packet in ns
+#		SCALE_DURATION	- 	seconds per step
+#		SCALE_THREADS	- 	load generator sender threads
+#		SCALE_PORT		- 	first router port, two ports are used
+#		SCALE_OUT		- 	output directory
+#
+#==========================================================================
+
+set -u
+
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+WORKERS="${SCALE_WORKERS:-1 2 4 8 16}"
+WORK="${SCALE_WORK:-2000}"
+DURATION="${SCALE_DURATION:-2}"
+THREADS="${SCALE_THREADS:-16}"
+PORT="${SCALE_PORT:-23500}"
+OUT="${SCALE_OUT:-$ROOT/bench/results}"
+STAMP="$(date +%Y%m%d-%H%M%S)"
+CSV="$OUT/scale-$STAMP.csv"
+
+mkdir -p "$OUT"
+
+echo "workers,work_ns,flows,sent,processed,processed_pps,speedup,steals" > "$CSV"
+base=""
+for workers in $WORKERS; do
+	log="$(mktemp)"
+	"$ROOT/multithreaded/router" -p "$PORT" -n 2 -b 32 -w "$WORK" \
+		-P "$workers" -L warn > "$log" 2>&1 &
+	pid=$!
+	sleep 0.5
+	if ! kill -0 "$pid" 2>/dev/null; then
+		echo "router did not start with $workers workers" >&2
+		cat "$log" >&2
+		rm -f "$log"
+		exit 1
+	fi
+	# threads,ports,size,rate,sent,...
+	sent="$("$ROOT/client" -t "$THREADS" -p "$PORT" -n 2 -r 0 \
+		-d "$DURATION" -N -o csv | tail -1 | cut -d, -f5)"
+	kill -INT "$pid"
+	wait "$pid" 2>/dev/null
+	processed="$(grep -a "Packets processed" "$log" | tail -1 | awk '{ print $1 }')"
+	steals="$(grep -a "^Worker " "$log" | awk '{ s += $9 } END { print s + 0 }')"
+	rm -f "$log"
+	pps="$(awk -v p="${processed:-0}" -v d="$DURATION" \
+		'BEGIN { printf "%.0f", p/d }')"
+	base="${base:-$pps}"
+	echo "$workers,$WORK,$((THREADS*2)),${sent:-0},${processed:-0},$pps,$(awk \
+		-v p="$pps" -v b="$base" 'BEGIN { printf "%.2f", (b > 0) ? p/b : 0 }'),$steals" \
+		| tee -a "$CSV"
+done
+cp "$CSV" "$OUT/scale-latest.csv"
+echo "Results: $CSV"
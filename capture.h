@@ -0,0 +1,332 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Datagrams per thread ring - a full ring drops new datagrams */
+#define CAPTURE_RINGSIZE	4096
+/* Records appended per ring per pass of the writer thread */
+#define CAPTURE_PASS		256
+/* Writer thread sleep while every ring is empty */
+#define CAPTURE_IDLENSEC	1000000
+/* The file is extended and remapped in steps of this size */
+#define CAPTURE_CHUNK		(64UL*1024*1024)
+/* pcap with nanosecond timestamps, one IPv4 datagram per record */
+#define PCAP_MAGIC_NSEC		0xA1B23C4DU
+#define PCAP_MAGIC_USEC		0xA1B2C3D4U
+#define PCAP_SNAPLEN		65535
+#define PCAP_HDRSIZE		24
+#define PCAP_RECHDRSIZE		16
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_IPV4		228
+/* Synthesized IPv4 and UDP headers in front of every datagram */
+#define CAPTURE_IPHDR		20
+#define CAPTURE_UDPHDR		8
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Set while a capture is running - the only cost of a disabled capture */
+bool capturing = false;
+/* Every live ring - pushed lock-free, unlinked only by the writer */
+_Atomic(DATA_captureRing *) captureRings;
+/* Ring of the calling thread, attached on its first datagram */
+_Thread_local DATA_captureRing *captureRing;
+/* Retires a thread's ring when the thread exits */
+pthread_key_t captureRingKey;
+pthread_once_t captureRingOnce = PTHREAD_ONCE_INIT;
+/* Losses of rings already freed, writer thread only */
+unsigned long captureRetiredDropped;
+/* Cleared to stop the writer thread */
+atomic_int captureRunning;
+pthread_t captureTid;
+DATA_captureFile captureOut;
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* Key destructor - hands the exiting thread's ring to the writer */
+void captureRetire(void *ring)
+{
+	atomic_store_explicit(&((DATA_captureRing *) ring)->retired, true, 
+		memory_order_release);
+}
+
+void captureCreateKey(void)
+{
+	if (pthread_key_create(&captureRingKey, captureRetire) != 0)
+	{
+		perror("capture ring key failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Creates the calling thread's ring and publishes it to the writer */
+DATA_captureRing *captureAttach(void)
+{
+	DATA_captureRing *ring = aligned_alloc(CACHELINE, 
+		sizeof(DATA_captureRing));
+	if (ring == NULL || (ring->records = 
+		malloc(CAPTURE_RINGSIZE*sizeof(DATA_captureRecord))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->retired, false);
+	ring->cachedHead 	= 0;
+	ring->dropped 		= 0;
+	ring->mask 			= CAPTURE_RINGSIZE - 1;
+	/* Treiber push - only the writer unlinks, pushers touch just the top */
+	ring->next = atomic_load(&captureRings);
+	while (!atomic_compare_exchange_weak(&captureRings, &ring->next, ring))
+	{
+	}
+	pthread_once(&captureRingOnce, captureCreateKey);
+	pthread_setspecific(captureRingKey, ring);
+	captureRing = ring;
+	return ring;
+}
+
+/*
+** Owner only - copies a datagram received on port index port into the 
+** thread's ring. Never blocks: when the writer is behind, the datagram is
+** left out of the capture and counted instead.
+*/
+void capturePost(int port, const struct sockaddr_in *src, const char *data,
+	unsigned len, uint64_t now)
+{
+	DATA_captureRing *ring = (captureRing != NULL) ? captureRing : 
+		captureAttach();
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - ring->cachedHead == CAPTURE_RINGSIZE)
+	{
+		ring->cachedHead = atomic_load_explicit(&ring->head, 
+			memory_order_acquire);
+		if (tail - ring->cachedHead == CAPTURE_RINGSIZE)
+		{
+			ring->dropped += 1;
+			return;
+		}
+	}
+	DATA_captureRecord *record = &ring->records[tail & ring->mask];
+	record->nsec 	= now;
+	record->src 	= *src;
+	record->port 	= port;
+	record->len 	= (len < PKT_MAXSIZE) ? len : PKT_MAXSIZE;
+	memcpy(record->data, data, record->len);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Writer only - makes room for len more bytes at the end of the file */
+void captureReserve(DATA_captureFile *out, size_t len)
+{
+	if (out->used + len <= out->mapped)
+	{
+		return;
+	}
+	size_t size = out->mapped + CAPTURE_CHUNK;
+	char *map;
+	if (ftruncate(out->fd, size) == -1 || (map = (out->map == NULL) ? 
+		mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0) :
+		mremap(out->map, out->mapped, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+	{
+		perror("capture file");
+		exit(EXIT_FAILURE);
+	}
+	out->map 	= map;
+	out->mapped = size;
+}
+
+uint16_t ipChecksum(const uint16_t *words, unsigned count)
+{
+	uint32_t sum = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		sum += words[i];
+	}
+	while (sum >> 16)
+	{
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+/*
+** Appends one pcap record: record header, then the datagram behind IPv4
+** and UDP headers rebuilt from the source address and the router port.
+*/
+void captureAppend(DATA_captureFile *out, const DATA_captureRecord *record)
+{
+	unsigned ipLen = CAPTURE_IPHDR + CAPTURE_UDPHDR + record->len;
+	captureReserve(out, PCAP_RECHDRSIZE + ipLen);
+	char *at = out->map + out->used;
+	uint64_t real = record->nsec + out->realOffset;
+	uint32_t header[4] = {real/1000000000ULL, real%1000000000ULL, ipLen, 
+		ipLen};
+	memcpy(at, header, sizeof(header));
+	uint8_t *ip = (uint8_t *) at + sizeof(header);
+	uint16_t words[CAPTURE_IPHDR/2] = {
+		htons(0x4500), htons(ipLen), htons(out->ipId++), htons(0x4000), 
+		htons(64 << 8 | IPPROTO_UDP), 0, 0, 0, 0, 0};
+	uint32_t dst = htonl(INADDR_LOOPBACK);
+	memcpy(&words[6], &record->src.sin_addr.s_addr, 4);
+	memcpy(&words[8], &dst, 4);
+	words[5] = ipChecksum(words, CAPTURE_IPHDR/2);
+	memcpy(ip, words, CAPTURE_IPHDR);
+	/* UDP checksum 0 - not computed, which IPv4 allows */
+	uint16_t udp[4] = {record->src.sin_port, 
+		htons(out->firstPort + record->port), 
+		htons(CAPTURE_UDPHDR + record->len), 0};
+	memcpy(ip + CAPTURE_IPHDR, udp, CAPTURE_UDPHDR);
+	memcpy(ip + CAPTURE_IPHDR + CAPTURE_UDPHDR, record->data, record->len);
+	out->used += PCAP_RECHDRSIZE + ipLen;
+	out->written += 1;
+}
+
+/* Writer only - unlinks and frees drained rings, as logReap() does */
+void captureReap(void)
+{
+	DATA_captureRing *prev = NULL, *ring = atomic_load(&captureRings);
+	while (ring != NULL)
+	{
+		DATA_captureRing *next = ring->next, *top = ring;
+		bool drained = atomic_load_explicit(&ring->retired, 
+			memory_order_acquire) && atomic_load_explicit(&ring->tail, 
+			memory_order_relaxed) == atomic_load_explicit(&ring->head, 
+			memory_order_relaxed);
+		if (drained && (prev != NULL || 
+			atomic_compare_exchange_strong(&captureRings, &top, next)))
+		{
+			if (prev != NULL)
+			{
+				prev->next = next;
+			}
+			captureRetiredDropped += ring->dropped;
+			free(ring->records);
+			free(ring);
+		}
+		else
+		{
+			prev = ring;
+		}
+		ring = next;
+	}
+}
+
+/* Writer only - appends a share of every ring, returns records written */
+int captureFlush(DATA_captureFile *out)
+{
+	int count = 0;
+	captureReap();
+	for (DATA_captureRing *ring = atomic_load(&captureRings); ring != NULL; 
+		ring = ring->next)
+	{
+		unsigned head = atomic_load_explicit(&ring->head, 
+			memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(&ring->tail, 
+			memory_order_acquire);
+		unsigned n = tail - head;
+		n = (n < CAPTURE_PASS) ? n : CAPTURE_PASS;
+		for (unsigned i = 0; i < n; i++)
+		{
+			captureAppend(out, &ring->records[(head + i) & ring->mask]);
+		}
+		atomic_store_explicit(&ring->head, head + n, memory_order_release);
+		count += n;
+	}
+	return count;
+}
+
+void *captureThread(void *args)
+{
+	(void) args;
+	struct timespec idle = {0, CAPTURE_IDLENSEC};
+	while (atomic_load(&captureRunning))
+	{
+		if (captureFlush(&captureOut) == 0)
+		{
+			nanosleep(&idle, NULL);
+		}
+	}
+	/* Append whatever was queued before the stop */
+	while (captureFlush(&captureOut) > 0)
+	{
+	}
+	return NULL;
+}
+
+/* Creates the capture file and starts the writer thread */
+void startCapture(const char *path, int firstPort)
+{
+	DATA_captureFile *out = &captureOut;
+	memset(out, 0, sizeof(DATA_captureFile));
+	if ((out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+	{
+		perror("capture file");
+		exit(EXIT_FAILURE);
+	}
+	/* Records are stamped with the monotonic clock on the receive path */
+	struct timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	out->realOffset = ((int64_t) real.tv_sec - mono.tv_sec)*1000000000LL + 
+		(real.tv_nsec - mono.tv_nsec);
+	/* pcap global header: magic, version 2.4, zone, accuracy, snaplen, link */
+	uint32_t magic = PCAP_MAGIC_NSEC, fields[4] = {0, 0, PCAP_SNAPLEN, 
+		LINKTYPE_IPV4};
+	uint16_t version[2] = {2, 4};
+	captureReserve(out, PCAP_HDRSIZE);
+	memcpy(out->map, &magic, 4);
+	memcpy(out->map + 4, version, 4);
+	memcpy(out->map + 8, fields, 16);
+	out->used = PCAP_HDRSIZE;
+	out->firstPort = firstPort;
+	atomic_store(&captureRunning, 1);
+	if (pthread_create(&captureTid, NULL, captureThread, NULL) != 0)
+	{
+		perror("capture thread failed");
+		exit(EXIT_FAILURE);
+	}
+	capturing = true;
+}
+
+/* Appends every queued datagram, trims the file and reports losses */
+void stopCapture(void)
+{
+	DATA_captureFile *out = &captureOut;
+	unsigned long dropped = 0;
+	if (!capturing)
+	{
+		return;
+	}
+	capturing = false;
+	atomic_store(&captureRunning, 0);
+	pthread_join(captureTid, NULL);
+	dropped += captureRetiredDropped;
+	for (DATA_captureRing *ring = atomic_load(&captureRings); ring != NULL; 
+		ring = ring->next)
+	{
+		dropped += ring->dropped;
+	}
+	munmap(out->map, out->mapped);
+	if (ftruncate(out->fd, out->used) == -1)
+	{
+		perror("capture file");
+	}
+	close(out->fd);
+	printf("Capture: %lu datagrams written, %lu dropped\n", out->written, 
+		dropped);
+}
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef CCSDS_H
+#define CCSDS_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <arpa/inet.h>
+#include "data_types.h"
+#include "stats.h"
+#include "packet.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Contexts in the table and their idle timeout unless changed with -A */
+#define CCSDS_CONTEXTS		64
+#define CCSDS_MAXCONTEXTS	4096
+#define CCSDS_TIMEOUT		1000
+/* Largest reassembled space packet - with its router header it still fits
+   the 16-bit length of the header */
+#define CCSDS_MAXSIZE		16384
+/* Context buffer - a router header, then the space packet */
+#define CCSDS_BUFSIZE		(PKT_HDRSIZE + CCSDS_MAXSIZE)
+#define CCSDS_SEQMASK		0x3FFF
+/* Locks of a shared table, and the end of a bucket chain or free list */
+#define CCSDS_SHARDS		16
+#define CCSDS_NONE			UINT32_MAX
+/* Fibonacci hashing multiplier */
+#define CCSDS_HASH			0x9E3779B97F4A7C15ULL
+/* Context states - a finished packet is held until its batch is flushed */
+#define CONTEXT_FREE		0
+#define CONTEXT_ACTIVE		1
+#define CONTEXT_HELD		2
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* Reads -A contexts[:timeout ms], exiting on a malformed value */
+void parseContexts(const char *text, DATA_routerConfig *config)
+{
+	char *end;
+	long contexts = strtol(text, &end, 10), timeout = CCSDS_TIMEOUT;
+	if (*end == ':')
+	{
+		timeout = strtol(end + 1, &end, 10);
+	}
+	if (*end != '\0' || contexts < 1 || timeout < 1)
+	{
+		fprintf(stderr, "Bad reassembly contexts %s\n", text);
+		exit(EXIT_FAILURE);
+	}
+	config->spaceContexts 	= contexts;
+	config->spaceTimeout 	= timeout;
+}
+
+/*
+** Allocates every context and its buffer once, so segments are copied
+** into place without an allocation per segment or per packet. Contexts
+** and buckets are dealt out to up to CCSDS_SHARDS shards by the low bits
+** of their index; a shared table locks each shard on its own.
+*/
+DATA_reassembly *createReassembly(unsigned capacity, unsigned timeoutMsec,
+	bool shared)
+{
+	unsigned shards = 1, buckets = 1;
+	/* An unshared table keeps every context in one shard */
+	while (shared && shards*2 <= CCSDS_SHARDS && shards*2 <= capacity)
+	{
+		shards *= 2;
+	}
+	/* Chains stay short with twice as many buckets as contexts */
+	while (buckets < 2*capacity)
+	{
+		buckets *= 2;
+	}
+	DATA_reassembly *reasm = calloc(1, sizeof(DATA_reassembly));
+	if (reasm == NULL ||
+		(reasm->contexts = calloc(capacity, sizeof(DATA_spaceContext)))
+		== NULL || (reasm->buffers = aligned_alloc(CACHELINE,
+		(size_t) capacity*CCSDS_BUFSIZE)) == NULL ||
+		(reasm->buckets = malloc(buckets*sizeof(uint32_t))) == NULL ||
+		(reasm->shards = aligned_alloc(CACHELINE,
+		shards*sizeof(DATA_spaceShard))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(reasm->shards, 0, shards*sizeof(DATA_spaceShard));
+	for (unsigned s = 0; s < shards; s++)
+	{
+		pthread_mutex_init(&reasm->shards[s].lock, NULL);
+		reasm->shards[s].free = CCSDS_NONE;
+	}
+	for (unsigned b = 0; b < buckets; b++)
+	{
+		reasm->buckets[b] = CCSDS_NONE;
+	}
+	/* Highest index first, so each free list hands out its lowest */
+	for (unsigned i = capacity; i-- > 0;)
+	{
+		DATA_spaceShard *shard = &reasm->shards[i & (shards - 1)];
+		reasm->contexts[i].data = reasm->buffers + (size_t) i*CCSDS_BUFSIZE;
+		reasm->contexts[i].next = shard->free;
+		shard->free = i;
+	}
+	reasm->capacity 	= capacity;
+	reasm->bucketMask 	= buckets - 1;
+	reasm->shardMask 	= shards - 1;
+	reasm->shared 		= shared;
+	reasm->timeoutNsec 	= (uint64_t) timeoutMsec*1000000ULL;
+	return reasm;
+}
+
+void freeReassembly(DATA_reassembly *reasm)
+{
+	for (unsigned s = 0; s <= reasm->shardMask; s++)
+	{
+		pthread_mutex_destroy(&reasm->shards[s].lock);
+	}
+	free(reasm->shards);
+	free(reasm->buckets);
+	free(reasm->contexts);
+	free(reasm->buffers);
+	free(reasm);
+}
+
+/* List of the packets one forward batch can hold - every context at most */
+DATA_spaceHeld *createSpaceHeld(DATA_reassembly *reasm)
+{
+	DATA_spaceHeld *held = calloc(1, sizeof(DATA_spaceHeld));
+	if (held == NULL ||
+		(held->contexts = malloc(reasm->capacity*sizeof(uint32_t))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	return held;
+}
+
+void freeSpaceHeld(DATA_spaceHeld *held)
+{
+	free(held->contexts);
+	free(held);
+}
+
+/* Bucket of a sender, router port and APID */
+unsigned spaceBucket(DATA_reassembly *reasm, const struct sockaddr_in *src,
+	int port, unsigned apid)
+{
+	uint64_t key = (uint64_t) ntohl(src->sin_addr.s_addr) << 32 |
+		(uint64_t) ntohs(src->sin_port) << 16 | (unsigned) port;
+	key = (key ^ (uint64_t) apid << 52)*CCSDS_HASH;
+	return (key >> 32) & reasm->bucketMask;
+}
+
+void spaceLock(DATA_reassembly *reasm, DATA_spaceShard *shard)
+{
+	if (reasm->shared)
+	{
+		pthread_mutex_lock(&shard->lock);
+	}
+}
+
+void spaceUnlock(DATA_reassembly *reasm, DATA_spaceShard *shard)
+{
+	if (reasm->shared)
+	{
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* Shard lock held - returns a context to its shard's free list */
+void spaceFree(DATA_reassembly *reasm, DATA_spaceShard *shard, uint32_t i)
+{
+	reasm->contexts[i].state 	= CONTEXT_FREE;
+	reasm->contexts[i].next 	= shard->free;
+	shard->free 				= i;
+}
+
+/*
+** Shard lock held - unlinks the context at *link from its bucket and
+** frees it, counting its segments as dropped
+*/
+void spaceDrop(DATA_reassembly *reasm, DATA_spaceShard *shard,
+	uint32_t *link, DATA_statsSlot *counters)
+{
+	uint32_t i = *link;
+	statAdd(counters, STAT_REASM_DROPS, reasm->contexts[i].segments);
+	*link = reasm->contexts[i].next;
+	spaceFree(reasm, shard, i);
+}
+
+/* Shard lock held - drops the shard's packets whose next segment is overdue */
+void spaceExpire(DATA_reassembly *reasm, DATA_spaceShard *shard,
+	unsigned s, uint64_t now, DATA_statsSlot *counters)
+{
+	for (unsigned b = s; b <= reasm->bucketMask; b += reasm->shardMask + 1)
+	{
+		uint32_t *link = &reasm->buckets[b];
+		while (*link != CCSDS_NONE)
+		{
+			DATA_spaceContext *ctx = &reasm->contexts[*link];
+			if (ctx->lastNsec + reasm->timeoutNsec <= now)
+			{
+				spaceDrop(reasm, shard, link, counters);
+				shard->timedOut += 1;
+			}
+			else
+			{
+				link = &ctx->next;
+			}
+		}
+	}
+	shard->nextSweep = now + reasm->timeoutNsec/4;
+}
+
+/*
+** Shard lock held - link to the context of the packet the sender is
+** sending on this port and APID, or to the end of its bucket's chain
+*/
+uint32_t *spaceFind(DATA_reassembly *reasm, unsigned bucket,
+	const struct sockaddr_in *src, int port, unsigned apid)
+{
+	uint32_t *link = &reasm->buckets[bucket];
+	while (*link != CCSDS_NONE)
+	{
+		DATA_spaceContext *ctx = &reasm->contexts[*link];
+		if (ctx->apid == apid && ctx->port == port &&
+			ctx->src.sin_addr.s_addr == src->sin_addr.s_addr &&
+			ctx->src.sin_port == src->sin_port)
+		{
+			break;
+		}
+		link = &ctx->next;
+	}
+	return link;
+}
+
+/*
+** Takes a validated space packet from a sender on the router port with
+** index port. An unsegmented packet is returned as it is. Segments are
+** copied into the context of their sender and APID: the first one whole,
+** the later ones without their primary header, each in sequence. The last
+** segment returns the whole packet behind a router header of its own,
+** added to held and kept until releaseAssembled() - after the forward
+** batch it is routed through is flushed. Anything else returns NULL.
+** Only the shard of the segment's bucket is locked.
+*/
+const DATA_packetHeader *reassembleSpace(DATA_reassembly *reasm,
+	const DATA_packetHeader *packet, const struct sockaddr_in *src, int port,
+	uint64_t now, DATA_spaceHeld *held, DATA_statsSlot *counters)
+{
+	const DATA_spaceHeader *space = packetSpace(packet);
+	unsigned flags = spaceSeqFlags(space), len = spaceLength(space);
+	if (flags == CCSDS_UNSEGMENTED)
+	{
+		return packet;
+	}
+	unsigned apid = spaceApid(space);
+	unsigned bucket = spaceBucket(reasm, src, port, apid);
+	unsigned s = bucket & reasm->shardMask;
+	DATA_spaceShard *shard = &reasm->shards[s];
+	spaceLock(reasm, shard);
+	if (now >= shard->nextSweep)
+	{
+		spaceExpire(reasm, shard, s, now, counters);
+	}
+	uint32_t *link = spaceFind(reasm, bucket, src, port, apid);
+	DATA_spaceContext *ctx;
+	if (flags == CCSDS_SEG_FIRST)
+	{
+		/* A new first segment abandons the packet before it */
+		if (*link != CCSDS_NONE)
+		{
+			spaceDrop(reasm, shard, link, counters);
+		}
+		if (shard->free == CCSDS_NONE)
+		{
+			shard->full += 1;
+			spaceUnlock(reasm, shard);
+			statAdd(counters, STAT_REASM_DROPS, 1);
+			return NULL;
+		}
+		/* Take a free context and put it at the head of the bucket */
+		uint32_t i = shard->free;
+		ctx = &reasm->contexts[i];
+		shard->free 	= ctx->next;
+		ctx->next 		= reasm->buckets[bucket];
+		reasm->buckets[bucket] = i;
+		ctx->src 		= *src;
+		ctx->port 		= port;
+		ctx->apid 		= apid;
+		ctx->state 		= CONTEXT_ACTIVE;
+		ctx->nextSeq 	= (spaceSeqCount(space) + 1) & CCSDS_SEQMASK;
+		ctx->len 		= len;
+		ctx->segments 	= 1;
+		ctx->lastNsec 	= now;
+		memcpy(ctx->data, packet, PKT_HDRSIZE);
+		memcpy(ctx->data + PKT_HDRSIZE, space, len);
+		spaceUnlock(reasm, shard);
+		return NULL;
+	}
+	ctx = (*link != CCSDS_NONE) ? &reasm->contexts[*link] : NULL;
+	/* A lost or reordered segment loses the whole packet */
+	if (ctx == NULL || spaceSeqCount(space) != ctx->nextSeq ||
+		ctx->len + len - CCSDS_HDRSIZE > CCSDS_MAXSIZE)
+	{
+		if (ctx != NULL)
+		{
+			spaceDrop(reasm, shard, link, counters);
+		}
+		spaceUnlock(reasm, shard);
+		statAdd(counters, STAT_REASM_DROPS, 1);
+		return NULL;
+	}
+	memcpy(ctx->data + PKT_HDRSIZE + ctx->len,
+		(const char *) space + CCSDS_HDRSIZE, len - CCSDS_HDRSIZE);
+	ctx->len 		+= len - CCSDS_HDRSIZE;
+	ctx->segments 	+= 1;
+	ctx->nextSeq 	= (ctx->nextSeq + 1) & CCSDS_SEQMASK;
+	ctx->lastNsec 	= now;
+	if (flags == CCSDS_SEG_CONT)
+	{
+		spaceUnlock(reasm, shard);
+		return NULL;
+	}
+	/* Complete - off its bucket, so the next first segment starts anew */
+	uint32_t i = *link;
+	*link 			= ctx->next;
+	ctx->state 		= CONTEXT_HELD;
+	shard->completed += 1;
+	spaceUnlock(reasm, shard);
+	held->contexts[held->count++] = i;
+	statAdd(counters, STAT_REASSEMBLED, 1);
+	/* Both headers now describe the whole packet */
+	DATA_packetHeader *whole = (DATA_packetHeader *) ctx->data;
+	DATA_spaceHeader *head = (DATA_spaceHeader *) (ctx->data + PKT_HDRSIZE);
+	whole->hdrLen 	= PKT_HDRSIZE;
+	whole->length 	= htons(PKT_HDRSIZE + ctx->len);
+	whole->flags 	&= ~htons(PKT_FLAG_CRC);
+	head->sequence 	= htons(CCSDS_UNSEGMENTED << 14 | spaceSeqCount(head));
+	head->length 	= htons(ctx->len - CCSDS_HDRSIZE - 1);
+	return whole;
+}
+
+/* Frees the finished packets in held, once their batch is flushed */
+void releaseAssembled(DATA_reassembly *reasm, DATA_spaceHeld *held)
+{
+	for (unsigned k = 0; k < held->count; k++)
+	{
+		uint32_t i = held->contexts[k];
+		DATA_spaceShard *shard = &reasm->shards[i & reasm->shardMask];
+		spaceLock(reasm, shard);
+		spaceFree(reasm, shard, i);
+		spaceUnlock(reasm, shard);
+	}
+	held->count = 0;
+}
+
+/* Totals of every shard - taken without the locks, for reports */
+void printReassemblyStats(DATA_reassembly *reasm)
+{
+	unsigned long completed = 0, timedOut = 0, full = 0;
+	for (unsigned s = 0; s <= reasm->shardMask; s++)
+	{
+		completed 	+= reasm->shards[s].completed;
+		timedOut 	+= reasm->shards[s].timedOut;
+		full 		+= reasm->shards[s].full;
+	}
+	if (completed + timedOut + full > 0)
+	{
+		printf("Reassembly: %lu space packets of %u contexts in %u shards, "
+			"%lu timed out, %lu segments dropped full\n", completed,
+			reasm->capacity, reasm->shardMask + 1, timedOut, full);
+	}
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "data_types.h"
+#include "packet.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Reflected CRC32C (Castagnoli) polynomial, as computed by SSE4.2 */
+#define CRC32C_POLY			0x82F63B78U
+/* Packets handed to crc32cBatch() at once by verifyTrailers() */
+#define CRC32C_BATCH		64
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+uint32_t crc32cSlice(uint32_t crc, const char *data, size_t len);
+void crc32cBatchSlice(const char *const data[], const unsigned len[],
+	uint32_t crc[], unsigned count);
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Slicing-by-8 tables of the fallback, filled in by initChecksum() */
+uint32_t crc32cTables[8][256];
+/* Kernels chosen by initChecksum() for this CPU */
+crc32cFunc crc32c 				= crc32cSlice;
+crc32cBatchFunc crc32cBatch 	= crc32cBatchSlice;
+const char *checksumEngine 		= "table";
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Table-driven CRC32C, eight bytes per step. crc is the value returned
+** for the data before, 0 to start.
+*/
+uint32_t crc32cSlice(uint32_t crc, const char *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	crc = ~crc;
+	while (len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		word = le64toh(word) ^ crc;
+		crc = crc32cTables[7][word & 0xFF] ^
+			crc32cTables[6][(word >> 8) & 0xFF] ^
+			crc32cTables[5][(word >> 16) & 0xFF] ^
+			crc32cTables[4][(word >> 24) & 0xFF] ^
+			crc32cTables[3][(word >> 32) & 0xFF] ^
+			crc32cTables[2][(word >> 40) & 0xFF] ^
+			crc32cTables[1][(word >> 48) & 0xFF] ^
+			crc32cTables[0][word >> 56];
+		bytes += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+	{
+		crc = crc32cTables[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+void crc32cBatchSlice(const char *const data[], const unsigned len[],
+	uint32_t crc[], unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+	{
+		crc[i] = crc32cSlice(0, data[i], len[i]);
+	}
+}
+
+#if defined(__x86_64__)
+/* Continues an inverted crc over len bytes with the crc32 instruction */
+__attribute__((target("sse4.2")))
+uint32_t crc32cRun(uint32_t crc, const unsigned char *bytes, size_t len)
+{
+	uint64_t value = crc;
+	while (len >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		value = _mm_crc32_u64(value, word);
+		bytes += 8;
+		len -= 8;
+	}
+	crc = (uint32_t) value;
+	while (len-- > 0)
+	{
+		crc = _mm_crc32_u8(crc, *bytes++);
+	}
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const char *data, size_t len)
+{
+	return ~crc32cRun(~crc, (const unsigned char *) data, len);
+}
+
+/*
+** The crc32 instruction takes three cycles but issues every cycle, so one
+** packet at a time leaves two thirds of it idle. Three packets are run
+** side by side over their common length, each chain independent of the
+** others, and their tails are finished one by one.
+*/
+__attribute__((target("sse4.2")))
+void crc32cBatchSse42(const char *const data[], const unsigned len[],
+	uint32_t crc[], unsigned count)
+{
+	unsigned i = 0;
+	for (; i + 3 <= count; i += 3)
+	{
+		const unsigned char *a = (const unsigned char *) data[i];
+		const unsigned char *b = (const unsigned char *) data[i + 1];
+		const unsigned char *c = (const unsigned char *) data[i + 2];
+		unsigned common = len[i];
+		common = (len[i + 1] < common) ? len[i + 1] : common;
+		common = (len[i + 2] < common) ? len[i + 2] : common;
+		common &= ~7U;
+		uint64_t crcA = 0xFFFFFFFFU, crcB = 0xFFFFFFFFU, crcC = 0xFFFFFFFFU;
+		for (unsigned offset = 0; offset < common; offset += 8)
+		{
+			uint64_t wordA, wordB, wordC;
+			memcpy(&wordA, a + offset, 8);
+			memcpy(&wordB, b + offset, 8);
+			memcpy(&wordC, c + offset, 8);
+			crcA = _mm_crc32_u64(crcA, wordA);
+			crcB = _mm_crc32_u64(crcB, wordB);
+			crcC = _mm_crc32_u64(crcC, wordC);
+		}
+		crc[i] 		= ~crc32cRun(crcA, a + common, len[i] - common);
+		crc[i + 1] 	= ~crc32cRun(crcB, b + common, len[i + 1] - common);
+		crc[i + 2] 	= ~crc32cRun(crcC, c + common, len[i + 2] - common);
+	}
+	for (; i < count; i++)
+	{
+		crc[i] = ~crc32cRun(0xFFFFFFFFU, (const unsigned char *) data[i],
+			len[i]);
+	}
+}
+#endif
+
+/*
+** Fills in the fallback tables and picks the SSE4.2 kernels when the CPU
+** has them. Call once at startup, before any packet is checked.
+*/
+void initChecksum(void)
+{
+	for (unsigned i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		}
+		crc32cTables[0][i] = crc;
+	}
+	for (unsigned i = 0; i < 256; i++)
+	{
+		for (int k = 1; k < 8; k++)
+		{
+			crc32cTables[k][i] = (crc32cTables[k - 1][i] >> 8) ^
+				crc32cTables[0][crc32cTables[k - 1][i] & 0xFF];
+		}
+	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		crc32c 			= crc32cSse42;
+		crc32cBatch 	= crc32cBatchSse42;
+		checksumEngine 	= "sse4.2";
+	}
+#endif
+}
+
+/* Appends the CRC32C trailer to a packet whose header asks for one */
+void sealPacket(DATA_packetHeader *packet)
+{
+	unsigned covered = packetLength(packet) - PKT_TRAILERSIZE;
+	uint32_t crc = htonl(crc32c(0, (const char *) packet, covered));
+	memcpy((char *) packet + covered, &crc, PKT_TRAILERSIZE);
+}
+
+/*
+** Checks the trailer of every packet of a batch that carries one, with
+** one crc32cBatch() call per CRC32C_BATCH of them, and clears the entries
+** whose trailer does not match. NULL entries are skipped. Returns the
+** number of packets cleared.
+*/
+unsigned verifyTrailers(const DATA_packetHeader *packets[], unsigned count)
+{
+	const char *data[CRC32C_BATCH];
+	unsigned len[CRC32C_BATCH], index[CRC32C_BATCH], corrupt = 0;
+	uint32_t crc[CRC32C_BATCH];
+	unsigned i = 0;
+	while (i < count)
+	{
+		unsigned n = 0;
+		for (; i < count && n < CRC32C_BATCH; i++)
+		{
+			if (packets[i] != NULL && packetHasTrailer(packets[i]))
+			{
+				data[n] 	= (const char *) packets[i];
+				len[n] 		= packetLength(packets[i]) - PKT_TRAILERSIZE;
+				index[n++] 	= i;
+			}
+		}
+		crc32cBatch(data, len, crc, n);
+		for (unsigned j = 0; j < n; j++)
+		{
+			if (crc[j] != packetTrailer(packets[index[j]]))
+			{
+				packets[index[j]] = NULL;
+				corrupt += 1;
+			}
+		}
+	}
+	return corrupt;
+}
+
+#endif
@@ -7,13 +7,23 @@
 ** $Revision: 	1.0 $
 ** $Date:      	2020-07-11
 **
-** Purpose:  	This application is a UDP client which creates a forked 
-** process, and sends packets to two sockets in the UDP server application.
+** Purpose:  	This application is a UDP load generator for the router.
+** Sender threads spread packets over a range of router ports, either as
+** fast as possible or paced to a target rate, batching sends with
+** sendmmsg(). Every sender numbers its packets per router port; the
+** router's cumulative acknowledgements give the loss, and the send time
+** they echo the round-trip latency. The achieved rate, loss and latency
+** percentiles are printed at the end.
 **
 ** Functions Defined:
-**    createChild 	- Creates child process using fork()
-**    createSocket 	- Calls to socket() to create a new socket
-**    initPacket	- Initializes a data packets with values
+**    parseLoadConfig 	- Reads threads, ports, size, rate, duration, 
+** 						  message ID and checksum trailer
+**    createSocket 		- Calls to socket() to create a new socket
+**    initPacket		- Initializes a data packets with values
+**    runSender			- Sender thread entry - paced sendmmsg() loop
+**    drainConfirmations- Reads acknowledgements, updates loss and latency
+**    printResults		- Prints rate, loss and latency percentiles
+**    nowNsec			- Monotonic clock in nanoseconds
 **
 ** Modification History:
 **   Date | Author | Description
@@ -27,66 +37,87 @@
 ** INCLUDE FILES
 **==========================================================================*/
 #include "router.h"
+#include "histogram.h"
+#include "batch.h"
+#include "packet.h"
+#include "checksum.h"
+#include <arpa/inet.h>
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Acknowledgements read per recvmmsg() */
+#define ACKBATCH			64
+/* Time to wait for the last confirmations after sending stops */
+#define ACKGRACE_NSEC		1000000000LL
+/* Output formats selectable with -o */
+#define FORMAT_TEXT			0
+#define FORMAT_CSV			1
+#define FORMAT_JSON			2
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Cleared by SIGINT/SIGTERM to stop sending early */
+volatile sig_atomic_t running = 1;
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+void parseLoadConfig(int argc, char *argv[], DATA_loadConfig *config);
+void *runSender(void *args);
+void drainConfirmations(DATA_sender *self, int flags);
+void printResults(DATA_loadConfig *config, DATA_sender senders[]);
+uint64_t nowNsec(void);
 
 /*==========================================================================
 ** MAIN PROCESS
 **==========================================================================*/
-int main(void)
+int main(int argc, char *argv[])
 {
-	/* Create data constands */
-	char letters[2];
-	UINT8 nums[2];
-	/* Create child process */
-	PID pid = createChild();
-	/* Create a socket */
-	int fd = createSocket();
-	/* Init buffer for receiving server confirmation packets */
-	char buffer[MAXBUFFER];
-	/* Create struct for storing packet data */
-	DATA_stdPacket packet;
-	/* Create struct for storing server address*/
-	struct sockaddr_in servaddr;
-	/* Allocate memory for server address */
-	memset(&servaddr, 0, sizeof(servaddr));
-	/* Set server address host - same host for each process */
-	servaddr.sin_addr.s_addr = HOST;
-	/* Check which process I am, and adjust PORT and data accordingly */
-	if (pid == 0)
-	{
-		printf("I am the child process.\n");
-		/* Set port of child process */
-		servaddr.sin_port = htons(PORT1);
-		/* Init child packet data with some values */
-		letters[0] = 'C'; letters[1] = 'H'; nums[0] = 1; nums[1] = 2;
-		initPacket(&packet, letters, nums);
+	/* Read the load profile from the command line */
+	DATA_loadConfig config;
+	parseLoadConfig(argc, argv, &config);
+	/* Trailers are written with the fastest CRC32C kernel of this CPU */
+	initChecksum();
+	/* Stop sending on SIGINT/SIGTERM but still print the results */
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	/* One socket and one thread per sender */
+	DATA_sender *senders = calloc(config.threads, sizeof(DATA_sender));
+	if (senders == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
 	}
-	else
+	for (int i = 0; i < config.threads; i++)
 	{
-		printf("I am the parent process.\n");
-		/* Set port of parent process */
-		servaddr.sin_port = htons(PORT2);
-		/* Init parent packet data with some values */
-		letters[0] = 'P'; letters[1] = 'A'; nums[0] = 3; nums[1] = 4;
-		initPacket(&packet, letters, nums);
+		senders[i].id 		= i;
+		senders[i].config 	= &config;
+		senders[i].fd 		= createSocket();
+		senders[i].seqs 	= calloc(config.numPorts, sizeof(uint32_t));
+		senders[i].received = calloc(config.numPorts, sizeof(uint32_t));
+		initHistogram(&senders[i].latency);
+		/* Room for a burst of confirmations while the sender is busy */
+		int rcvbuf = 4*1024*1024;
+		setsockopt(senders[i].fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			sizeof(rcvbuf));
+		if (senders[i].seqs == NULL || senders[i].received == NULL ||
+			pthread_create(&senders[i].tid, NULL, runSender, &senders[i]) != 0)
+		{
+			perror("sender setup failed");
+			exit(EXIT_FAILURE);
+		}
 	}
-
-	int len, n;
-
-	len = sizeof(servaddr);
-	/* Send packet to server */
-	sendto(fd, (const DATA_stdPacket *) &packet, sizeof(DATA_stdPacket), 
-		MSG_CONFIRM, (const struct sockaddr *) &servaddr, len);
-	printf("\nClient: Packet sent.\n\n");
-	/* If server mode is two-way - receive confirmation packet from server */
-	if (SERVMODE == 2)
-	{
-		n = recvfrom(fd, (char *)buffer, MAXBUFFER, MSG_WAITALL, 
-			(struct sockaddr *) &servaddr, &len);
-		buffer[n] = '\0';
-		printf("Server says: \n\t\t%s\n", buffer);
-	}
-	/* Close socket in each process */
-	close(fd);
+	for (int i = 0; i < config.threads; i++)
+	{
+		pthread_join(senders[i].tid, NULL);
+		close(senders[i].fd);
+	}
+	printResults(&config, senders);
 
 	exit(EXIT_SUCCESS);
 }
@@ -94,21 +125,375 @@ int main(void)
 /*==========================================================================
 ** FUNCTION DEFINITIONS
 **==========================================================================*/
+void handleSignal(int sig)
+{
+	running = 0;
+}
+
+void parseLoadConfig(int argc, char *argv[], DATA_loadConfig *config)
+{
+	/* Defaults send one packet to each of the two default router ports */
+	config->threads 	= NUMSOCK;
+	config->firstPort 	= PORT1;
+	config->numPorts 	= NUMSOCK;
+	config->size 		= PKT_HDRSIZE + sizeof(DATA_stdPacket);
+	config->rate 		= 0;
+	config->duration 	= 0;
+	config->count 		= -1;
+	config->batchSize 	= BATCHSIZE;
+	config->acks 		= (SERVMODE == 2);
+	config->format 		= FORMAT_TEXT;
+	config->msgId 		= PKT_DEFAULT_MSGID;
+	config->priority 	= 0;
+	config->trailer 	= false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:p:n:s:r:d:c:b:No:m:P:K")) != -1)
+	{
+		switch (opt)
+		{
+			case 't':
+				config->threads = atoi(optarg);
+				break;
+			case 'p':
+				config->firstPort = atoi(optarg);
+				break;
+			case 'n':
+				config->numPorts = atoi(optarg);
+				break;
+			case 's':
+				config->size = atoi(optarg);
+				break;
+			case 'r':
+				config->rate = atof(optarg);
+				break;
+			case 'd':
+				config->duration = atof(optarg);
+				break;
+			case 'c':
+				config->count = atol(optarg);
+				break;
+			case 'b':
+				config->batchSize = atoi(optarg);
+				break;
+			case 'N':
+				config->acks = false;
+				break;
+			case 'o':
+				config->format = (strcmp(optarg, "csv") == 0) ? FORMAT_CSV :
+					(strcmp(optarg, "json") == 0) ? FORMAT_JSON : FORMAT_TEXT;
+				break;
+			case 'm':
+				config->msgId = strtol(optarg, NULL, 0);
+				break;
+			case 'P':
+				config->priority = atoi(optarg);
+				break;
+			case 'K':
+				config->trailer = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-t threads] [-p first port] "
+					"[-n ports] [-s packet size] [-r packets/s, 0 = max] "
+					"[-d seconds] [-c packets per thread] [-b batch size] "
+					"[-N no confirmations] [-o text|csv|json] "
+					"[-m message ID] [-P priority class 0-%d] "
+					"[-K CRC32C trailer]\n", argv[0], NUMCLASSES - 1);
+				exit(EXIT_FAILURE);
+		}
+	}
+	/* Without a duration each thread sends one packet, as before */
+	if (config->count < 0)
+	{
+		config->count = (config->duration > 0) ? 0 : 1;
+	}
+	if (config->threads < 1 || config->numPorts < 1 ||
+		config->firstPort < 1 || config->firstPort + config->numPorts > 65536 ||
+		config->size < (int) (PKT_HDRSIZE + 
+		(config->trailer ? PKT_TRAILERSIZE : 0)) ||
+		config->size > PKT_MAXSIZE || config->rate < 0 ||
+		config->msgId < 0 || config->msgId > 0xFFFF ||
+		config->priority < 0 || config->priority >= NUMCLASSES ||
+		config->batchSize < 1 || config->batchSize > MAXBATCH)
+	{
+		fprintf(stderr, "Invalid load profile\n");
+		exit(EXIT_FAILURE);
+	}
+}
 
-PID createChild()
+void *runSender(void *args)
 {
-	PID pid;
-	if((pid = fork()) == -1)
+	DATA_sender *self = (DATA_sender *) args;
+	DATA_loadConfig *config = self->config;
+	int batchSize = config->batchSize;
+	/* One packet per batch entry - sequence and send time differ */
+	char *packets = aligned_alloc(CACHELINE, 
+		(size_t) batchSize*PKT_MAXSIZE);
+	char letters[2] = {'L', 'G'};
+	UINT8 nums[2] = {self->id, 0};
+	/* One destination per router port, sent round-robin from my offset */
+	struct sockaddr_in *ports = calloc(config->numPorts,
+		sizeof(struct sockaddr_in));
+	struct mmsghdr *msgs = calloc(batchSize, sizeof(struct mmsghdr));
+	struct iovec *iovs = calloc(batchSize, sizeof(struct iovec));
+	/* Router port of each batch entry */
+	unsigned *dests = calloc(batchSize, sizeof(unsigned));
+	if (packets == NULL || ports == NULL || msgs == NULL || iovs == NULL ||
+		dests == NULL)
 	{
-		perror("fork failed");
+		perror("malloc failed");
 		exit(EXIT_FAILURE);
 	}
+	memset(packets, 0, (size_t) batchSize*PKT_MAXSIZE);
+	for (int i = 0; i < config->numPorts; i++)
+	{
+		ports[i].sin_family 		= AF_INET;
+		ports[i].sin_port 			= htons(config->firstPort + i);
+		ports[i].sin_addr.s_addr 	= htonl(INADDR_LOOPBACK);
+	}
+	for (int i = 0; i < batchSize; i++)
+	{
+		DATA_packetHeader *packet = (DATA_packetHeader *) 
+			(packets + (size_t) i*PKT_MAXSIZE);
+		initHeader(packet, config->msgId, config->size);
+		setPacketClass(packet, config->priority);
+		if (config->trailer)
+		{
+			setPacketTrailer(packet);
+		}
+		/* The demo payload follows the header when there is room */
+		if (packetPayloadLen(packet) >= sizeof(DATA_stdPacket))
+		{
+			initPacket((DATA_stdPacket *) packetPayload(packet), letters, 
+				nums);
+		}
+		iovs[i].iov_base 			= packet;
+		iovs[i].iov_len 			= config->size;
+		msgs[i].msg_hdr.msg_iov 	= &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen 	= 1;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	/* Token bucket - each thread paces its share of the total rate */
+	double rate = config->rate/config->threads;
+	double tokens = 0;
+	uint64_t start = nowNsec(), last = start, now;
+	uint64_t end = start + (uint64_t) (config->duration*1e9);
+	unsigned next = self->id % config->numPorts;
+	while (running)
+	{
+		now = nowNsec();
+		if ((config->duration > 0 && now >= end) ||
+			(config->count > 0 && self->sent >= (uint64_t) config->count))
+		{
+			break;
+		}
+		int n = batchSize;
+		if (config->count > 0 && config->count - self->sent < (uint64_t) n)
+		{
+			n = config->count - self->sent;
+		}
+		if (rate > 0)
+		{
+			/* Refill, capped at one batch so pauses do not cause bursts */
+			tokens += (now - last)*rate/1e9;
+			last = now;
+			if (tokens > batchSize)
+			{
+				tokens = batchSize;
+			}
+			if (tokens < 1)
+			{
+				/* Sleep for long gaps, spin for short ones */
+				double wait = (1 - tokens)/rate*1e9;
+				if (wait > 100000)
+				{
+					struct timespec ts = {0, (long) (wait - 50000)};
+					nanosleep(&ts, NULL);
+				}
+				if (config->acks)
+				{
+					drainConfirmations(self, MSG_DONTWAIT);
+				}
+				continue;
+			}
+			if (tokens < n)
+			{
+				n = (int) tokens;
+			}
+		}
+		/* Stamp before sending - the ack can arrive before sendmmsg returns */
+		now = nowNsec();
+		for (int i = 0; i < n; i++)
+		{
+			dests[i] = next;
+			msgs[i].msg_hdr.msg_name = &ports[next];
+			stampHeader((DATA_packetHeader *) iovs[i].iov_base, 
+				self->seqs[next]++, now);
+			/* The trailer covers the stamp, so it is written per send */
+			if (config->trailer)
+			{
+				sealPacket((DATA_packetHeader *) iovs[i].iov_base);
+			}
+			next = (next + 1 == (unsigned) config->numPorts) ? 0 : next + 1;
+		}
+		int sent = sendmmsg(self->fd, msgs, n, 0);
+		/* Sequence numbers of unsent packets are used again */
+		for (int i = n - 1; i >= (sent > 0 ? sent : 0); i--)
+		{
+			self->seqs[dests[i]] -= 1;
+		}
+		if (sent <= 0)
+		{
+			continue;
+		}
+		self->sent += sent;
+		tokens -= sent;
+		if (config->acks)
+		{
+			drainConfirmations(self, MSG_DONTWAIT);
+		}
+	}
+	/* Rate is measured over the sending phase only */
+	self->sendNsec = nowNsec() - start;
+	/* Give the router a moment to confirm the last packets */
+	uint64_t grace = nowNsec() + ACKGRACE_NSEC;
+	while (config->acks && self->confirmed < self->sent && nowNsec() < grace)
+	{
+		struct timeval tv = {0, 100000};
+		setsockopt(self->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		drainConfirmations(self, 0);
+	}
+	free(packets);
+	free(ports);
+	free(msgs);
+	free(iovs);
+	free(dests);
+	return NULL;
+}
+
+void drainConfirmations(DATA_sender *self, int flags)
+{
+	DATA_loadConfig *config = self->config;
+	DATA_ackPacket buffers[ACKBATCH];
+	struct sockaddr_in addrs[ACKBATCH];
+	struct iovec iovs[ACKBATCH];
+	struct mmsghdr msgs[ACKBATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < ACKBATCH; i++)
+	{
+		iovs[i].iov_base 			= &buffers[i];
+		iovs[i].iov_len 			= sizeof(buffers[i]);
+		msgs[i].msg_hdr.msg_iov 	= &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen 	= 1;
+		msgs[i].msg_hdr.msg_name 	= &addrs[i];
+	}
+	int n;
+	while (1)
+	{
+		for (int i = 0; i < ACKBATCH; i++)
+		{
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+		if ((n = recvmmsg(self->fd, msgs, ACKBATCH, flags | MSG_WAITFORONE,
+			NULL)) <= 0)
+		{
+			break;
+		}
+		uint64_t now = nowNsec();
+		for (int i = 0; i < n; i++)
+		{
+			const DATA_packetHeader *ack = checkPacket((char *) &buffers[i], 
+				msgs[i].msg_len);
+			/* The router port that sent the ack identifies the flow */
+			int port = ntohs(addrs[i].sin_port) - config->firstPort;
+			if (ack == NULL || packetMsgId(ack) != PKT_ACK_MSGID || 
+				packetPayloadLen(ack) < sizeof(DATA_ackPayload) ||
+				port < 0 || port >= config->numPorts)
+			{
+				continue;
+			}
+			const DATA_ackPayload *payload = 
+				(const DATA_ackPayload *) packetPayload(ack);
+			/* The count is cumulative - acks may arrive out of order */
+			uint32_t received = ntohl(payload->received);
+			if (received > self->received[port])
+			{
+				self->confirmed += received - self->received[port];
+				self->received[port] = received;
+			}
+			/* The echoed send time is of the newest packet acknowledged */
+			recordHistogram(&self->latency, now - packetSendNsec(ack));
+			self->acks += 1;
+		}
+		if (n < ACKBATCH)
+		{
+			break;
+		}
+	}
+}
+
+void printResults(DATA_loadConfig *config, DATA_sender senders[])
+{
+	DATA_histogram latency;
+	uint64_t sent = 0, confirmed = 0, acks = 0, sendNsec = 0;
+	initHistogram(&latency);
+	for (int i = 0; i < config->threads; i++)
+	{
+		/* Senders run side by side - the slowest one sets the elapsed time */
+		if (senders[i].sendNsec > sendNsec)
+		{
+			sendNsec = senders[i].sendNsec;
+		}
+		sent += senders[i].sent;
+		confirmed += senders[i].confirmed;
+		acks += senders[i].acks;
+		mergeHistogram(&latency, &senders[i].latency);
+	}
+	uint64_t lost = (config->acks && confirmed < sent) ? sent - confirmed : 0;
+	double lossPct = sent ? 100.0*lost/sent : 0.0;
+	double elapsed = sendNsec/1e9;
+	double pps = elapsed > 0 ? sent/elapsed : 0.0;
+	double p50 = histogramPercentile(&latency, 0.50)/1e3;
+	double p99 = histogramPercentile(&latency, 0.99)/1e3;
+	double p999 = histogramPercentile(&latency, 0.999)/1e3;
+	double max = latency.count ? latency.max/1e3 : 0.0;
+	if (config->format == FORMAT_CSV)
+	{
+		printf("threads,ports,size,rate,sent,confirmed,lost,loss_pct,pps,"
+			"p50_us,p99_us,p999_us,max_us,acks\n");
+		printf("%d,%d,%d,%.0f,%lu,%lu,%lu,%.4f,%.0f,%.1f,%.1f,%.1f,%.1f,%lu\n",
+			config->threads, config->numPorts, config->size, config->rate,
+			sent, confirmed, lost, lossPct, pps, p50, p99, p999, max, acks);
+	}
+	else if (config->format == FORMAT_JSON)
+	{
+		printf("{\"threads\": %d, \"ports\": %d, \"size\": %d, "
+			"\"rate\": %.0f, \"sent\": %lu, \"confirmed\": %lu, "
+			"\"lost\": %lu, \"loss_pct\": %.4f, \"pps\": %.0f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+			"\"max_us\": %.1f, \"acks\": %lu}\n", config->threads, 
+			config->numPorts, config->size, config->rate, sent, confirmed, 
+			lost, lossPct, pps, p50, p99, p999, max, acks);
+	}
 	else
 	{
-		return pid;
+		printf("Sent %lu packets in %.3f s (%.0f pps), %lu confirmed by "
+			"%lu acks, %lu lost (%.3f%%)\n", sent, elapsed, pps, confirmed, 
+			acks, lost, lossPct);
+		if (config->acks)
+		{
+			printf("Latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+				p50, p99, p999, max);
+		}
 	}
 }
 
+uint64_t nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
 int createSocket()
 {
 	/* Init fd to store output from socket() */
@@ -121,7 +506,6 @@ int createSocket()
 	}
 	else
 	{
-		printf("New Socket: %d\n", fd);
 		return fd;
 	}
 }
@@ -5,6 +5,8 @@
 ** INCLUDE FILES
 **==========================================================================*/
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -15,10 +17,21 @@
 #define PID 	pid_t
 #define MUTEX	pthread_mutex_t
 #define SEM 	sem_t
+/* Keeps fields written by different threads on separate cache lines */
+#define CACHELINE	64
+/* Priority classes - 0 is critical, the others share by weight */
+#define NUMCLASSES	4
+/* Ancillary buffer per received datagram, fits one 32-bit cmsg */
+#define BATCH_CONTROLLEN	32
+/* Largest datagram payload accepted - 1500 byte MTU less IPv4/UDP headers */
+#define PKT_MAXSIZE			1472
+/* Local route handlers that can be registered, built-ins included */
+#define ROUTE_MAXHANDLERS	32
 
 /*==========================================================================
 ** CUSTOM DATA TYPES
 **==========================================================================*/
+/* Demo payload - carried after the packet header */
 typedef struct stdPacket
 {
 	char 	firstChar;
@@ -27,20 +40,784 @@ typedef struct stdPacket
 	UINT8 	secondNum;
 } DATA_stdPacket;
 
+/*
+** Wire header at the start of every datagram, multi-byte fields in network
+** byte order. hdrLen lets later versions append header fields; length is
+** the whole datagram, header included. Naturally aligned - 24 bytes.
+*/
+typedef struct packetHeader
+{
+	uint8_t 	version;
+	uint8_t 	hdrLen;
+	uint16_t 	msgId;
+	uint16_t 	length;
+	uint16_t 	flags;
+	uint32_t 	seq;
+	uint32_t 	reserved;
+	uint64_t 	sendNsec;
+} DATA_packetHeader;
+
+/*
+** CCSDS space packet primary header, at the start of the payload of a
+** packet flagged PKT_FLAG_CCSDS. Big-endian: version, type, secondary
+** header flag and APID; sequence flags and count; data length minus one.
+*/
+typedef struct spaceHeader
+{
+	uint16_t 	streamId;
+	uint16_t 	sequence;
+	uint16_t 	length;
+} DATA_spaceHeader;
+
+/* CRC32C kernels - one buffer, continuing from crc, or a batch of them */
+typedef uint32_t (*crc32cFunc)(uint32_t crc, const char *data, size_t len);
+typedef void (*crc32cBatchFunc)(const char *const data[], 
+	const unsigned len[], uint32_t crc[], unsigned count);
+
+/*
+** Acknowledgement sent back to a sender, in a packet of its own message 
+** ID. The header seq is the cumulative ack - every sequence number below 
+** it arrived or was given up - and sendNsec echoes the newest packet's.
+*/
+typedef struct ackPayload
+{
+	/* Bit i set when seq + i has arrived - bit 0 is always clear */
+	uint64_t 	bitmap;
+	/* Packets of the flow received and given up on so far */
+	uint32_t 	received;
+	uint32_t 	missed;
+} DATA_ackPayload;
+
+typedef struct ackPacket
+{
+	DATA_packetHeader 	header;
+	DATA_ackPayload 	payload;
+} DATA_ackPacket;
+
+/*
+** Single-producer/single-consumer ring. head and tail are free-running
+** counters, each on its own cache line with the index cache of the thread
+** that writes it, so producer and consumer never share a written line.
+*/
 typedef struct Queue
 {
-	int front, rear, size;
-	unsigned capacity;
-	DATA_stdPacket *array;
+	/* Written by the consumer */
+	_Alignas(CACHELINE) atomic_uint head;
+	unsigned 			cachedTail;
+	/* Written by the producer */
+	_Alignas(CACHELINE) atomic_uint tail;
+	unsigned 			cachedHead;
+	/* Read-only after createQueue() */
+	_Alignas(CACHELINE) unsigned capacity;
+	unsigned 			mask;
+	/* Set when the producer may evict the oldest slots (drop-oldest) */
+	int 				overwrite;
+	/* Packets are carried as indices of slots in the reader's pool */
+	uint32_t 			*array;
 } packetQueue;
 
+/*
+** One preallocated packet buffer. Readers receive straight into data and
+** the source address, so only the slot index travels between threads.
+*/
+typedef struct poolSlot
+{
+	uint32_t 			len;
+	uint32_t 			next;
+	/* When the reader received it, for the queueing delay */
+	uint64_t 			rxNsec;
+	struct sockaddr_in 	src;
+	char 				data[];
+} DATA_poolSlot;
+
+/*
+** Fixed-size pool of slots carved from one slab. Any thread may return
+** slots to the lock-free free list; only the owning reader takes them,
+** refilling a private cache with one atomic exchange of the whole list.
+*/
+typedef struct packetPool
+{
+	/* Pushed to by every thread that frees slots */
+	_Alignas(CACHELINE) atomic_uint freeHead;
+	/* Owner-only cache of free slot indices */
+	_Alignas(CACHELINE) uint32_t *cache;
+	unsigned 			cached;
+	/* Read-only after createPool() */
+	_Alignas(CACHELINE) char *slab;
+	size_t 				slabSize;
+	unsigned 			slotSize;
+	unsigned 			count;
+	bool 				hugePages;
+} DATA_packetPool;
+
+/* Token bucket in packets, kept as a schedule - see ratelimit.h */
+typedef struct rateLimit
+{
+	/* Nanoseconds per packet at the limit rate */
+	uint64_t 			interval;
+	/* How far the schedule may run ahead of now - burst*interval */
+	uint64_t 			window;
+	/* Time the next packet is due; per sender limits use the flow's */
+	uint64_t 			tat;
+} DATA_rateLimit;
+
+typedef struct routerConfig
+{
+	int		engine;
+	int		firstPort;
+	int		numSock;
+	long	maxPackets;
+	int		batchSize;
+	long	workNsec;
+	int		shards;
+	int		*cpus;
+	int		numCpus;
+	bool	flowAffinity;
+	int		weights[NUMCLASSES];
+	int		*policies;
+	int		numPolicies;
+	int		workers;
+	int		rcvBuf;
+	int		statsPort;
+	const char	*routeFile;
+	const char	*captureFile;
+	const char	*spoolDir;
+	const char	*configFile;
+	unsigned	ackEvery;
+	unsigned	flowCapacity;
+	unsigned	flowIdle;
+	unsigned	spaceContexts;
+	unsigned	spaceTimeout;
+	int		timeoutSec;
+	DATA_rateLimit	*portLimits;
+	int		numPortLimits;
+	DATA_rateLimit	*srcLimits;
+	int		numSrcLimits;
+} DATA_routerConfig;
+
+typedef struct batch
+{
+	unsigned 			size;
+	struct mmsghdr 		*msgs;
+	struct iovec 		*iovs;
+	DATA_stdPacket 		*packets;
+	struct sockaddr_in 	*addrs;
+	struct mmsghdr 		*replies;
+	struct iovec 		replyIov;
+	/* fill[k] counts receive calls that returned k datagrams */
+	unsigned long 		*fill;
+	unsigned long 		calls;
+	unsigned long 		received;
+	unsigned long 		sendCalls;
+	unsigned long 		sent;
+	/* Ancillary data per datagram - the SO_RXQ_OVFL drop count */
+	char 				(*controls)[BATCH_CONTROLLEN];
+	/* Datagrams the kernel dropped on the socket, as last reported */
+	uint32_t 			kernelDrops;
+} DATA_batch;
+
+/* Raw io_uring instance - ring pointers into the kernel-shared mappings */
+typedef struct uring
+{
+	int 						fd;
+	unsigned 					*sqHead;
+	unsigned 					*sqTail;
+	unsigned 					*sqMask;
+	unsigned 					*sqArray;
+	unsigned 					sqEntries;
+	unsigned 					sqLocalTail;
+	unsigned 					sqPending;
+	struct io_uring_sqe 		*sqes;
+	unsigned 					*cqHead;
+	unsigned 					*cqTail;
+	unsigned 					*cqMask;
+	struct io_uring_cqe 		*cqes;
+	void 						*sqRing;
+	size_t 						sqRingSize;
+	void 						*cqRing;
+	size_t 						cqRingSize;
+	size_t 						sqesSize;
+	/* Provided buffer ring the kernel picks receive buffers from */
+	struct io_uring_buf_ring 	*bufRing;
+	char 						*bufBase;
+	unsigned 					bufCount;
+	unsigned 					bufSize;
+	unsigned short 				bufTail;
+	unsigned short 				bufGroup;
+} DATA_uring;
+
+/*
+** Log-linear latency histogram: HIST_SUBBUCKETS linear buckets per power
+** of two, so any recorded value is known to within 1/HIST_SUBBUCKETS.
+*/
+typedef struct histogram
+{
+	uint64_t 	count;
+	uint64_t 	min;
+	uint64_t 	max;
+	uint64_t 	*buckets;
+} DATA_histogram;
+
+/*
+** Consumer-side scheduler state: strict priority for class 0, deficit
+** round-robin in bytes for the others. Queueing delay is kept by the
+** workers that process the packets.
+*/
+typedef struct scheduler
+{
+	int 				weights[NUMCLASSES];
+	long 				deficit[NUMCLASSES];
+	/* Reader whose queue of the class is served next */
+	int 				cursor[NUMCLASSES];
+	unsigned long 		packets[NUMCLASSES];
+	unsigned long 		bytes[NUMCLASSES];
+} DATA_scheduler;
+
+typedef struct loadConfig
+{
+	int		threads;
+	int		firstPort;
+	int		numPorts;
+	int		size;
+	double	rate;
+	double	duration;
+	long	count;
+	int		batchSize;
+	bool	acks;
+	int		format;
+	int		msgId;
+	int		priority;
+	bool	trailer;
+} DATA_loadConfig;
+
+typedef struct replayConfig
+{
+	const char	*path;
+	const char	*host;
+	int		firstPort;
+	double	speed;
+	bool	fast;
+	int		batchSize;
+	int		loops;
+} DATA_replayConfig;
+
+/* One datagram of a capture file, indexed before the replay starts */
+typedef struct replayRecord
+{
+	/* Capture time relative to the first record */
+	uint64_t 			nsec;
+	/* UDP payload offset in the mapped file */
+	size_t 				offset;
+	uint16_t 			len;
+	/* Router port relative to the lowest port in the capture */
+	uint16_t 			port;
+	/* Socket standing in for the original sender */
+	uint32_t 			sock;
+} DATA_replayRecord;
+
+typedef struct sender
+{
+	pthread_t 			tid;
+	int 				id;
+	int 				fd;
+	DATA_loadConfig 	*config;
+	uint64_t 			sent;
+	uint64_t 			confirmed;
+	uint64_t 			sendNsec;
+	uint64_t 			acks;
+	DATA_histogram 		latency;
+	/* Per router port - next sequence number and packets acknowledged */
+	uint32_t 			*seqs;
+	uint32_t 			*received;
+} DATA_sender;
+
+/*
+** Local destination of a route - gets the validated packets routed to it
+** since the last flush, in arrival order, with one call
+*/
+typedef void (*routeHandler)(const DATA_packetHeader **packets, 
+	unsigned count);
+
+/* One destination of a message ID or port - a UDP endpoint or a handler */
+typedef struct routeDest
+{
+	int 				kind;
+	int 				msgId;
+	/* Router port of a port route, 0 for a message ID route */
+	int 				port;
+	/* APID of an APID route, -1 for the others */
+	int 				apid;
+	/* Index into routeHandlers[] of a local destination */
+	int 				handler;
+	struct sockaddr_in 	addr;
+} DATA_routeDest;
+
+/*
+** Direct-indexed route table. entries[msgId] packs the index of the first
+** destination and the fan-out count into 32 bits, so the whole 64K table
+** is 256 KB and every lookup is one load. ports[port] and apids[apid],
+** allocated only when the file has such routes, are laid out the same and
+** are looked up first, in that order.
+*/
+typedef struct routeTable
+{
+	uint32_t 			*entries;
+	uint32_t 			*ports;
+	uint32_t 			*apids;
+	DATA_routeDest 		*dests;
+	unsigned 			numDests;
+	unsigned 			numRoutes;
+	unsigned 			numPorts;
+	unsigned 			numApids;
+} DATA_routeTable;
+
+/*
+** Datagrams waiting to be forwarded with one sendmmsg(), and packets 
+** waiting for their local handlers - up to size per handler
+*/
+typedef struct forward
+{
+	int 				fd;
+	unsigned 			size;
+	unsigned 			count;
+	struct mmsghdr 		*msgs;
+	struct iovec 		*iovs;
+	unsigned long 		calls;
+	unsigned long 		sent;
+	unsigned long 		failed;
+	/* size entries per handler id */
+	const DATA_packetHeader **local;
+	unsigned 			localCount[ROUTE_MAXHANDLERS];
+	/* Bit per handler id with packets waiting */
+	uint32_t 			localPending;
+	unsigned long 		localCalls;
+	unsigned long 		localPackets;
+} DATA_forward;
+
+/* Integer arguments carried by one log record */
+#define LOG_MAXARGS 	5
+
+/*
+** One deferred log message - 64 bytes. The format string is not copied, so
+** it must be a literal, and arguments - pointers included - are stored as
+** long.
+*/
+typedef struct logRecord
+{
+	uint64_t 			nsec;
+	const char 			*fmt;
+	long 				level;
+	long 				args[LOG_MAXARGS];
+} DATA_logRecord;
+
+/*
+** Per-thread single-producer/single-consumer ring of log records. The
+** owning thread writes records, the logger thread formats them. A ring
+** retired by its exiting owner is freed by the logger once drained.
+*/
+typedef struct logRing
+{
+	/* Written by the logger thread */
+	_Alignas(CACHELINE) atomic_uint head;
+	/* Written by the owning thread */
+	_Alignas(CACHELINE) atomic_uint tail;
+	unsigned 			cachedHead;
+	unsigned long 		dropped;
+	atomic_bool 		retired;
+	/* Read-only after the ring is attached */
+	_Alignas(CACHELINE) unsigned mask;
+	DATA_logRecord 		*records;
+	struct logRing 		*next;
+} DATA_logRing;
+
+/* One received datagram waiting for the capture writer */
+typedef struct captureRecord
+{
+	uint64_t 			nsec;
+	struct sockaddr_in 	src;
+	/* Index of the router port it arrived on */
+	uint16_t 			port;
+	uint16_t 			len;
+	char 				data[PKT_MAXSIZE];
+} DATA_captureRecord;
+
+/*
+** Per-thread single-producer/single-consumer ring of captured datagrams,
+** laid out like DATA_logRing. The receiving thread copies datagrams in,
+** the capture writer appends them to the file.
+*/
+typedef struct captureRing
+{
+	/* Written by the capture writer */
+	_Alignas(CACHELINE) atomic_uint head;
+	/* Written by the owning thread */
+	_Alignas(CACHELINE) atomic_uint tail;
+	unsigned 			cachedHead;
+	unsigned long 		dropped;
+	atomic_bool 		retired;
+	/* Read-only after the ring is attached */
+	_Alignas(CACHELINE) unsigned mask;
+	DATA_captureRecord 	*records;
+	struct captureRing 	*next;
+} DATA_captureRing;
+
+/* Capture file state, owned by the writer thread */
+typedef struct captureFile
+{
+	int 				fd;
+	char 				*map;
+	size_t 				mapped;
+	size_t 				used;
+	unsigned long 		written;
+	uint16_t 			ipId;
+	int 				firstPort;
+	/* Added to monotonic stamps to give wall clock time */
+	int64_t 			realOffset;
+} DATA_captureFile;
+
+/* Hot-path counters kept in every statistics slot */
+enum statCounter
+{
+	STAT_RX_PACKETS,
+	STAT_RX_BYTES,
+	STAT_QUEUE_HWM,
+	STAT_STALLS,
+	STAT_DROPS,
+	STAT_CONFIRMS,
+	STAT_PROCESSED,
+	STAT_PROC_NSEC,
+	STAT_FORWARDED,
+	STAT_UNROUTED,
+	STAT_INVALID,
+	STAT_KERNEL_DROPS,
+	STAT_NEW_FLOWS,
+	STAT_EXPIRED_FLOWS,
+	STAT_UNTRACKED,
+	STAT_RATE_DROPS,
+	STAT_SPOOLED,
+	STAT_UNSPOOLED,
+	STAT_CORRUPT,
+	STAT_REASSEMBLED,
+	STAT_REASM_DROPS,
+	STAT_COUNT
+};
+
+/*
+** Counters of one port written by exactly one thread. Slots are cache-line
+** aligned so no two writers share a line, and the single writer updates
+** with relaxed load/store pairs - no locked read-modify-write.
+*/
+typedef struct statsSlot
+{
+	_Alignas(CACHELINE) atomic_uint_fast64_t counters[STAT_COUNT];
+	const char 			*role;
+	int 				thread;
+	int 				port;
+} DATA_statsSlot;
+
+typedef struct stats
+{
+	DATA_statsSlot 		*slots;
+	atomic_uint 		numSlots;
+	unsigned 			maxSlots;
+	int 				firstPort;
+	int 				fd;
+	pthread_t 			tid;
+} DATA_stats;
+
+/*
+** Receive state of one sender on one port, in host byte order. Kept in
+** the flow table beside the sender's entry, see flowAcks().
+*/
+typedef struct ackState
+{
+	/* Next sequence number expected in order */
+	uint32_t 			cum;
+	uint32_t 			received;
+	/* Bit i set when cum + i has arrived */
+	uint64_t 			bitmap;
+	uint32_t 			missed;
+	/* Packets since the last ack and the newest one's send time */
+	uint32_t 			pending;
+	uint64_t 			echo;
+	bool 				active;
+	/* Set while the flow is on the pending list */
+	bool 				queued;
+} DATA_ackState;
+
+/* One sender on one router port, 64 bytes */
+typedef struct flowEntry
+{
+	/* Where replies to this sender go */
+	_Alignas(CACHELINE) struct sockaddr_in addr;
+	uint64_t 			firstSeen;
+	uint64_t 			lastSeen;
+	uint64_t 			packets;
+	uint64_t 			bytes;
+	uint32_t 			lastSeq;
+	/* Packets whose sequence number did not follow the previous one */
+	uint32_t 			outOfOrder;
+	/* Rate limit schedule of this sender, see rateAllow() */
+	uint64_t 			tat;
+} DATA_flowEntry;
+
+
+/* Written by one thread only - no locks or atomics */
+typedef struct flowTable
+{
+	uint64_t 			*keys;
+	DATA_flowEntry 		*entries;
+	unsigned 			mask;
+	unsigned 			shift;
+	unsigned 			limit;
+	unsigned 			count;
+	/* Expiry cursor, advanced a few slots per packet */
+	unsigned 			sweep;
+	unsigned 			maxProbe;
+	uint64_t 			idleNsec;
+	/* Ack state per slot, moved with the entries - NULL unless the router
+	   acknowledges, so an entry stays one cache line either way */
+	DATA_ackState 		*acks;
+} DATA_flowTable;
+
+typedef struct acks
+{
+	/* Flow table holding the state of every sender */
+	DATA_flowTable 		*flows;
+	/* Flow keys of the senders with packets not yet acknowledged */
+	uint64_t 			*pending;
+	unsigned 			numPending;
+	unsigned 			every;
+	/* Acks leave in one sendmmsg() per port socket; the packets and their
+	   addresses stay here until it is sent */
+	DATA_forward 		*out;
+	DATA_ackPacket 		*packets;
+	struct sockaddr_in 	*addrs;
+	DATA_statsSlot 		**counters;
+} DATA_acks;
+
+/* One space packet being put together from its segments */
+typedef struct spaceContext
+{
+	/* Sender, router port and APID the segments come from */
+	struct sockaddr_in 	src;
+	int 				port;
+	unsigned 			apid;
+	int 				state;
+	/* Sequence count the next segment must carry */
+	unsigned 			nextSeq;
+	/* Space packet bytes so far, after the router header in data */
+	unsigned 			len;
+	unsigned 			segments;
+	uint64_t 			lastNsec;
+	/* Next context in the same hash bucket or free list */
+	uint32_t 			next;
+	char 				*data;
+} DATA_spaceContext;
+
+/*
+** One lock's share of the reassembly table - the contexts and hash
+** buckets whose index has the shard's number in its low bits
+*/
+typedef struct spaceShard
+{
+	_Alignas(CACHELINE) pthread_mutex_t lock;
+	/* Contexts of the shard not in use */
+	uint32_t 			free;
+	uint64_t 			nextSweep;
+	unsigned long 		completed;
+	unsigned long 		timedOut;
+	unsigned long 		full;
+} DATA_spaceShard;
+
+/*
+** Fixed table of reassembly contexts, their buffers allocated once up
+** front, found by a hash of sender, port and APID. A shared table takes
+** the lock of one shard per segment.
+*/
+typedef struct reassembly
+{
+	DATA_spaceContext 	*contexts;
+	char 				*buffers;
+	unsigned 			capacity;
+	/* Chains of the contexts being filled, by key hash */
+	uint32_t 			*buckets;
+	unsigned 			bucketMask;
+	DATA_spaceShard 	*shards;
+	unsigned 			shardMask;
+	bool 				shared;
+	uint64_t 			timeoutNsec;
+} DATA_reassembly;
+
+/* Finished space packets routed through one forward batch, freed after
+   its flush */
+typedef struct spaceHeld
+{
+	uint32_t 			*contexts;
+	unsigned 			count;
+} DATA_spaceHeld;
+
+/* On-disk header at the start of every spool segment */
+typedef struct spoolHeader
+{
+	uint32_t 			magic;
+	uint32_t 			version;
+	uint64_t 			seq;
+	/* Consumed up to here - persisted with the next msync() */
+	uint64_t 			readOffset;
+} DATA_spoolHeader;
+
+/* One spooled packet, padded to 8 bytes; a zero length ends a segment */
+typedef struct spoolRecord
+{
+	uint32_t 			len;
+	/* CRC32C of the record - tells a written one from a torn one after a
+	   crash, see spoolCheck() */
+	uint32_t 			check;
+	uint64_t 			rxNsec;
+	struct sockaddr_in 	src;
+	char 				data[];
+} DATA_spoolRecord;
+
+/* A mapped segment file */
+typedef struct spoolSegment
+{
+	uint64_t 			seq;
+	int 				fd;
+	char 				*map;
+	size_t 				readOffset;
+	size_t 				writeOffset;
+} DATA_spoolSegment;
+
+/*
+** Segmented log of one reader's overflow, oldest segment first. Written
+** and drained by the owning reader only - no locks or atomics.
+*/
+typedef struct spool
+{
+	char 				*dir;
+	int 				port;
+	int 				shard;
+	/* Ring of SPOOL_MAXSEGS mapped segments */
+	DATA_spoolSegment 	*segs;
+	unsigned 			first;
+	unsigned 			count;
+	uint64_t 			nextSeq;
+	/* Records written and not yet drained */
+	uint64_t 			records;
+	/* Offset of the newest segment already flushed by msync() */
+	size_t 				synced;
+	bool 				dirty;
+	uint64_t 			lastSync;
+	unsigned long 		recovered;
+	unsigned long 		syncs;
+	unsigned long 		full;
+} DATA_spool;
+
+/* Settings read from the -g file, see reload.h */
+typedef struct fileConfig
+{
+	/* Ring capacity and policy per port index, capacity 0 when closed */
+	unsigned 			*queues;
+	int 				*policies;
+	char 				*routeFile;
+	/* -1 keeps the current level */
+	int 				logLevel;
+	int 				weights[NUMCLASSES];
+} DATA_fileConfig;
+
 typedef struct threadData
 {
 	pthread_t 			tid;
 	int					threadnum;
+	int					port;
+	int					shard;
+	int					cpu;
 	int					fd;
-	packetQueue 		*buffer;
-	struct sockaddr_in 	clientAddr;
+	int					epfd;
+	int					policy;
+	packetQueue 		*buffers[NUMCLASSES];
+	DATA_packetPool 	*pool;
+	uint32_t 			*rxSlots;
+	DATA_batch			*batch;
+	DATA_statsSlot 		*stats;
+	/* Slots handed to the workers and not yet freed */
+	atomic_uint 		inflight;
+	/* Senders seen by this reader */
+	DATA_flowTable 		*flows;
+	/* This reader's share of the port limit, and the per-sender limit */
+	DATA_rateLimit 		portLimit;
+	DATA_rateLimit 		srcLimit;
+	/* Overflow log of the spool policy, NULL under the other policies */
+	DATA_spool 			*spool;
+	/* Life of the reader across reloads, one of the READER_ states */
+	atomic_int 			state;
+	/* Posted by the reloader to wake the reader from epoll_wait() */
+	int 				retirefd;
+	/* Class queue capacity the port was configured with */
+	unsigned 			capacity;
+	/* Reader this one took the socket over from, -1 for a new port */
+	int 				prev;
+	/* Not served by the main thread until prev's queues are empty */
+	bool 				waiting;
 } DATA_pthread;
 
+/*
+** Readers the main thread schedules and the routes the processors use.
+** The reloader builds a new table and publishes it with one pointer
+** store; the old one is freed once every processing thread has seen it.
+*/
+typedef struct portTable
+{
+	int 				count;
+	/* Indices into the reader array, in scheduling order */
+	int 				*readers;
+	DATA_routeTable 	*routes;
+	int 				weights[NUMCLASSES];
+} DATA_portTable;
+
+/*
+** Chase-Lev work-stealing deque of flow bucket ids. The owner pushes and
+** pops at the bottom, other workers steal from the top.
+*/
+typedef struct deque
+{
+	_Alignas(CACHELINE) atomic_long top;
+	_Alignas(CACHELINE) atomic_long bottom;
+	_Alignas(CACHELINE) unsigned mask;
+	atomic_uint 		*array;
+} DATA_deque;
+
+/*
+** Packets of the flows that hash to one bucket, in arrival order. The 
+** main thread is the ring's only producer; the one worker holding the 
+** bucket is its consumer.
+*/
+typedef struct flowBucket
+{
+	_Alignas(CACHELINE) atomic_int scheduled;
+	packetQueue 		*ring;
+} DATA_flowBucket;
+
+typedef struct worker
+{
+	pthread_t 			tid;
+	int 				id;
+	/* Buckets posted by the main thread, moved to the deque by the owner */
+	packetQueue 		*inbox;
+	DATA_deque 			*deque;
+	DATA_forward 		*forward;
+	/* Space packets routed through forward until it is flushed */
+	DATA_spaceHeld 		*assembled;
+	/* One counter slot per port */
+	DATA_statsSlot 		**stats;
+	DATA_histogram 		delay[NUMCLASSES];
+	unsigned long 		packets;
+	unsigned long 		turns;
+	unsigned long 		steals;
+	long 				workNsec;
+	/* Newest port table epoch this worker has seen between buckets */
+	atomic_ulong 		epoch;
+} DATA_worker;
+
 #endif
@@ -0,0 +1,251 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <arpa/inet.h>
+#include "data_types.h"
+#include "stats.h"
+#include "packet.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Slots in the table unless changed with -f - a power of two */
+#define FLOW_CAPACITY		262144
+#define FLOW_MAXCAPACITY	(1U << 28)
+/* Seconds without a packet before a flow may be expired, changed with -i */
+#define FLOW_IDLE			30
+/* Slots the expiry cursor checks per packet, and once the table is full */
+#define FLOW_SWEEP			1
+#define FLOW_SWEEPFULL		256
+/* Set in every key so that 0 marks an empty slot */
+#define FLOW_USED			(1ULL << 63)
+/* Router port index in the low bits of a key */
+#define FLOW_SOCKMASK		0xFFFU
+/* Fibonacci hashing multiplier */
+#define FLOW_HASH			0x9E3779B97F4A7C15ULL
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Open-addressing table with linear probing. Keys are probed in their own
+** array, eight to a cache line, and only the matching entry is touched.
+** Entries leave by backward-shift deletion, so there are no tombstones.
+*/
+DATA_flowTable *createFlows(unsigned capacity, unsigned idleSec)
+{
+	unsigned size = 1024, bits = 10;
+	while (size < capacity)
+	{
+		size <<= 1;
+		bits += 1;
+	}
+	DATA_flowTable *table = calloc(1, sizeof(DATA_flowTable));
+	if (table == NULL ||
+		(table->keys = calloc(size, sizeof(uint64_t))) == NULL ||
+		(table->entries = aligned_alloc(CACHELINE, 
+		(size_t) size*sizeof(DATA_flowEntry))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	table->mask 	= size - 1;
+	table->shift 	= 64 - bits;
+	/* Probe runs stay short below three quarters full */
+	table->limit 	= size/4*3;
+	table->idleNsec = (uint64_t) idleSec*1000000000ULL;
+	return table;
+}
+
+/* Source address and port on the router port with index sock */
+uint64_t flowKey(const struct sockaddr_in *src, int sock)
+{
+	return FLOW_USED | (uint64_t) ntohl(src->sin_addr.s_addr) << 28 |
+		(uint64_t) ntohs(src->sin_port) << 12 | ((unsigned) sock &
+		FLOW_SOCKMASK);
+}
+
+unsigned flowHome(DATA_flowTable *table, uint64_t key)
+{
+	return (key*FLOW_HASH) >> table->shift;
+}
+
+/* Gives every slot ack state, for a router that acknowledges senders */
+void flowTrackAcks(DATA_flowTable *table)
+{
+	if ((table->acks = calloc(table->mask + 1, sizeof(DATA_ackState)))
+		== NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Ack state of a flow - valid until the next flowTouch() */
+DATA_ackState *flowAcks(DATA_flowTable *table, DATA_flowEntry *entry)
+{
+	return &table->acks[entry - table->entries];
+}
+
+/* Entry of a key, or NULL when the flow is not in the table */
+DATA_flowEntry *flowFind(DATA_flowTable *table, uint64_t key)
+{
+	for (unsigned i = flowHome(table, key); table->keys[i] != 0;
+		i = (i + 1) & table->mask)
+	{
+		if (table->keys[i] == key)
+		{
+			return &table->entries[i];
+		}
+	}
+	return NULL;
+}
+
+/* Empties slot i, moving later entries of its probe run back */
+void flowRemove(DATA_flowTable *table, unsigned i)
+{
+	unsigned j = i;
+	uint64_t key;
+	while ((key = table->keys[j = (j + 1) & table->mask]) != 0)
+	{
+		/* An entry may move back to i only if i is not before its home */
+		unsigned home = flowHome(table, key);
+		if (((j - home) & table->mask) >= ((j - i) & table->mask))
+		{
+			table->keys[i] 		= key;
+			table->entries[i] 	= table->entries[j];
+			if (table->acks != NULL)
+			{
+				table->acks[i] = table->acks[j];
+			}
+			i = j;
+		}
+	}
+	table->keys[i] = 0;
+	table->count -= 1;
+}
+
+/* Advances the expiry cursor over n slots, removing idle flows */
+void flowSweep(DATA_flowTable *table, unsigned n, uint64_t now, 
+	DATA_statsSlot *counters)
+{
+	for (unsigned k = 0; k < n; k++)
+	{
+		unsigned i = table->sweep;
+		if (table->keys[i] != 0 && 
+			now - table->entries[i].lastSeen > table->idleNsec)
+		{
+			/* Another entry may have moved into i - check it next time */
+			flowRemove(table, i);
+			statAdd(counters, STAT_EXPIRED_FLOWS, 1);
+			continue;
+		}
+		table->sweep = (i + 1) & table->mask;
+	}
+}
+
+/*
+** Finds or creates the flow of a valid packet and updates it. A new flow 
+** takes the first idle slot on its probe path, if there is one. Returns
+** NULL when the table is full of live flows; the packet is still routed.
+*/
+DATA_flowEntry *flowTouch(DATA_flowTable *table, const struct sockaddr_in *src,
+	int sock, const DATA_packetHeader *packet, unsigned len, uint64_t now,
+	DATA_statsSlot *counters)
+{
+	uint64_t key = flowKey(src, sock);
+	DATA_flowEntry *entry;
+	/* Expiry is paid for a slot at a time by the packets themselves */
+	flowSweep(table, FLOW_SWEEP, now, counters);
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		unsigned i = flowHome(table, key), probe = 0, idle = UINT32_MAX;
+		while (table->keys[i] != 0 && table->keys[i] != key)
+		{
+			if (idle == UINT32_MAX && 
+				now - table->entries[i].lastSeen > table->idleNsec)
+			{
+				idle = i;
+			}
+			i = (i + 1) & table->mask;
+			probe += 1;
+		}
+		if (probe > table->maxProbe)
+		{
+			table->maxProbe = probe;
+		}
+		entry = &table->entries[i];
+		if (table->keys[i] == key && 
+			now - entry->lastSeen <= table->idleNsec)
+		{
+			break;
+		}
+		if (table->keys[i] == key || idle != UINT32_MAX)
+		{
+			/* Sender came back after going idle, or its slot is reused */
+			if (table->keys[i] != key)
+			{
+				i = idle;
+				entry = &table->entries[i];
+				table->keys[i] = key;
+			}
+			statAdd(counters, STAT_EXPIRED_FLOWS, 1);
+		}
+		else if (table->count < table->limit)
+		{
+			table->keys[i] = key;
+			table->count += 1;
+		}
+		else
+		{
+			/* Full - expire what is idle once, then give up on this one */
+			if (attempt == 0)
+			{
+				flowSweep(table, FLOW_SWEEPFULL, now, counters);
+				continue;
+			}
+			statAdd(counters, STAT_UNTRACKED, 1);
+			return NULL;
+		}
+		memset(entry, 0, sizeof(DATA_flowEntry));
+		if (table->acks != NULL)
+		{
+			memset(flowAcks(table, entry), 0, sizeof(DATA_ackState));
+		}
+		entry->addr 		= *src;
+		entry->firstSeen 	= now;
+		entry->lastSeq 		= packetSeq(packet) - 1;
+		statAdd(counters, STAT_NEW_FLOWS, 1);
+		break;
+	}
+	uint32_t seq = packetSeq(packet);
+	/* Anything but the next sequence number is a gap or a reorder */
+	if (seq != entry->lastSeq + 1)
+	{
+		entry->outOfOrder += 1;
+	}
+	entry->lastSeq 		= seq;
+	entry->lastSeen 	= now;
+	entry->packets 		+= 1;
+	entry->bytes 		+= len;
+	return entry;
+}
+
+void freeFlows(DATA_flowTable *table)
+{
+	free(table->keys);
+	free(table->entries);
+	free(table->acks);
+	free(table);
+}
+
+void printFlowStats(DATA_flowTable *table, const char *name)
+{
+	printf("%s: %u flows tracked of %u slots, longest probe %u\n", name,
+		table->count, table->mask + 1, table->maxProbe);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Linear buckets per power of two - 2^HIST_SUBBITS */
+#define HIST_SUBBITS		6
+#define HIST_SUBBUCKETS		(1 << HIST_SUBBITS)
+/* Values up to 2^HIST_MAXBITS (about 18 minutes in ns) are recorded */
+#define HIST_MAXBITS		40
+#define HIST_BUCKETS		((HIST_MAXBITS - HIST_SUBBITS + 1)*HIST_SUBBUCKETS)
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+void initHistogram(DATA_histogram *hist)
+{
+	hist->count 	= 0;
+	hist->min 		= UINT64_MAX;
+	hist->max 		= 0;
+	hist->buckets 	= calloc(HIST_BUCKETS, sizeof(uint64_t));
+	if (hist->buckets == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+unsigned histogramBucket(uint64_t value)
+{
+	/* Values below HIST_SUBBUCKETS get one bucket each */
+	if (value < HIST_SUBBUCKETS)
+	{
+		return value;
+	}
+	if (value >= (1ULL << HIST_MAXBITS))
+	{
+		return HIST_BUCKETS - 1;
+	}
+	unsigned msb = 63 - __builtin_clzll(value);
+	unsigned shift = msb - HIST_SUBBITS;
+	return (shift + 1)*HIST_SUBBUCKETS + 
+		((value >> shift) & (HIST_SUBBUCKETS - 1));
+}
+
+/* Smallest value that falls in bucket - inverse of histogramBucket() */
+uint64_t histogramValue(unsigned bucket)
+{
+	if (bucket < HIST_SUBBUCKETS)
+	{
+		return bucket;
+	}
+	unsigned shift = bucket/HIST_SUBBUCKETS - 1;
+	return ((uint64_t) (HIST_SUBBUCKETS + bucket % HIST_SUBBUCKETS)) << shift;
+}
+
+void recordHistogram(DATA_histogram *hist, uint64_t value)
+{
+	hist->buckets[histogramBucket(value)] += 1;
+	hist->count += 1;
+	if (value < hist->min)
+	{
+		hist->min = value;
+	}
+	if (value > hist->max)
+	{
+		hist->max = value;
+	}
+}
+
+void mergeHistogram(DATA_histogram *into, const DATA_histogram *from)
+{
+	for (unsigned i = 0; i < HIST_BUCKETS; i++)
+	{
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	if (from->min < into->min)
+	{
+		into->min = from->min;
+	}
+	if (from->max > into->max)
+	{
+		into->max = from->max;
+	}
+}
+
+/* Value at or below which the given fraction of samples fall */
+uint64_t histogramPercentile(const DATA_histogram *hist, double fraction)
+{
+	if (hist->count == 0)
+	{
+		return 0;
+	}
+	uint64_t rank = (uint64_t) (fraction*hist->count + 0.5);
+	uint64_t seen = 0;
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+	for (unsigned i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen >= rank)
+		{
+			/* Report the top of the bucket, capped by the real maximum */
+			uint64_t top = histogramValue(i + 1) - 1;
+			return (top < hist->max) ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+#endif
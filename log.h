@@ -0,0 +1,408 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Log levels, most severe first */
+#define LOG_ERROR 		0
+#define LOG_WARN 		1
+#define LOG_INFO 		2
+#define LOG_DEBUG 		3
+/* Messages above this level are compiled out, e.g. -DLOG_COMPILED=1 */
+#ifndef LOG_COMPILED
+#define LOG_COMPILED 	LOG_DEBUG
+#endif
+/* Records per thread ring - a full ring drops new records */
+#define LOG_RINGSIZE 	4096
+/* Records formatted per pass of the logger thread */
+#define LOG_PASS 		1024
+/* Logger thread sleep while every ring is empty */
+#define LOG_IDLENSEC 	1000000
+
+/*
+** Queues a message for the logger thread. Formats take integers,
+** characters and strings that outlive the program, and are checked
+** against the arguments at compile time by a call that is never made.
+** The arguments are stored as long and logFormat() hands each back with
+** the type its conversion expects. A level above LOG_COMPILED removes the
+** statement, arguments included; a level above logLevel costs one
+** compare.
+*/
+#define LOG(level, fmt, ...) 												\
+	do 																		\
+	{ 																		\
+		if ((level) <= LOG_COMPILED && (level) <= 							\
+			atomic_load_explicit(&logLevel, memory_order_relaxed)) 			\
+		{ 																	\
+			if (0) 															\
+			{ 																\
+				logCheck((fmt), ##__VA_ARGS__); 							\
+			} 																\
+			long logArgs[LOG_MAXARGS + 1] = {0 LOG_ARGS(__VA_ARGS__)}; 		\
+			logPost((level), (fmt), logArgs + 1); 							\
+		} 																	\
+	} while (0)
+/* Stores each of up to LOG_MAXARGS arguments, integer or pointer, as long */
+#define LOG_ARG(x) 			, (long) (intptr_t) (x)
+#define LOG_ARGS0()
+#define LOG_ARGS1(a) 		LOG_ARG(a)
+#define LOG_ARGS2(a, b) 	LOG_ARG(a) LOG_ARG(b)
+#define LOG_ARGS3(a, b, c) 	LOG_ARG(a) LOG_ARG(b) LOG_ARG(c)
+#define LOG_ARGS4(a, b, c, d) 												\
+	LOG_ARG(a) LOG_ARG(b) LOG_ARG(c) LOG_ARG(d)
+#define LOG_ARGS5(a, b, c, d, e) 											\
+	LOG_ARG(a) LOG_ARG(b) LOG_ARG(c) LOG_ARG(d) LOG_ARG(e)
+#define LOG_PICK(_0, _1, _2, _3, _4, _5, name, ...) 	name
+#define LOG_ARGS(...) 														\
+	LOG_PICK(_0, ##__VA_ARGS__, LOG_ARGS5, LOG_ARGS4, LOG_ARGS3, 			\
+		LOG_ARGS2, LOG_ARGS1, LOG_ARGS0)(__VA_ARGS__)
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Runtime level, set from the command line and changed by a reload */
+atomic_int logLevel = LOG_DEBUG;
+/* Names accepted by parseLogLevel(), indexed by level */
+const char *logLevelNames[] = {"error", "warn", "info", "debug"};
+/* Every live ring - pushed lock-free, unlinked only by the logger */
+_Atomic(DATA_logRing *) logRings;
+/* Ring of the calling thread, attached on its first message */
+_Thread_local DATA_logRing *logRing;
+/* Retires a thread's ring when the thread exits */
+pthread_key_t logRingKey;
+pthread_once_t logRingOnce = PTHREAD_ONCE_INIT;
+/* Losses of rings already freed, logger thread only */
+unsigned long logRetiredDropped;
+/* Cleared to stop the logger thread */
+atomic_int logRunning;
+pthread_t logTid;
+FILE *logFile;
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* Never called - gives LOG() formats the compiler's printf checks */
+__attribute__((format(printf, 1, 2)))
+void logCheck(const char *fmt, ...)
+{
+	(void) fmt;
+}
+
+int parseLogLevel(const char *name)
+{
+	for (int level = LOG_ERROR; level <= LOG_DEBUG; level++)
+	{
+		if (strcmp(name, logLevelNames[level]) == 0)
+		{
+			return level;
+		}
+	}
+	fprintf(stderr, "Unknown log level: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* Key destructor - hands the exiting thread's ring to the logger */
+void logRetire(void *ring)
+{
+	atomic_store_explicit(&((DATA_logRing *) ring)->retired, true, 
+		memory_order_release);
+}
+
+void logCreateKey(void)
+{
+	if (pthread_key_create(&logRingKey, logRetire) != 0)
+	{
+		perror("log ring key failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Creates the calling thread's ring and publishes it to the logger */
+DATA_logRing *logAttach(void)
+{
+	DATA_logRing *ring = aligned_alloc(CACHELINE, sizeof(DATA_logRing));
+	if (ring == NULL || (ring->records = 
+		malloc(LOG_RINGSIZE*sizeof(DATA_logRecord))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->retired, false);
+	ring->cachedHead 	= 0;
+	ring->dropped 		= 0;
+	ring->mask 			= LOG_RINGSIZE - 1;
+	/* Treiber push - only the logger unlinks, pushers touch just the top */
+	ring->next = atomic_load(&logRings);
+	while (!atomic_compare_exchange_weak(&logRings, &ring->next, ring))
+	{
+	}
+	pthread_once(&logRingOnce, logCreateKey);
+	pthread_setspecific(logRingKey, ring);
+	logRing = ring;
+	return ring;
+}
+
+/* Owner only - copies one record into the thread's ring, never blocks */
+void logPost(int level, const char *fmt, const long args[])
+{
+	DATA_logRing *ring = (logRing != NULL) ? logRing : logAttach();
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - ring->cachedHead == LOG_RINGSIZE)
+	{
+		ring->cachedHead = atomic_load_explicit(&ring->head, 
+			memory_order_acquire);
+		if (tail - ring->cachedHead == LOG_RINGSIZE)
+		{
+			/* Logger is behind - lose the message, not packet time */
+			ring->dropped += 1;
+			return;
+		}
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	DATA_logRecord *record = &ring->records[tail & ring->mask];
+	record->nsec 	= (uint64_t) now.tv_sec*1000000000ULL + now.tv_nsec;
+	record->fmt 	= fmt;
+	record->level 	= level;
+	memcpy(record->args, args, sizeof(record->args));
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/*
+** Logger thread only - unlinks and frees every retired ring that has been
+** drained. The retired flag is read before the tail, so a retired ring
+** is final. A ring still on top while another thread pushes is left for
+** the next pass.
+*/
+void logReap(void)
+{
+	DATA_logRing *prev = NULL, *ring = atomic_load(&logRings);
+	while (ring != NULL)
+	{
+		DATA_logRing *next = ring->next, *top = ring;
+		bool drained = atomic_load_explicit(&ring->retired, 
+			memory_order_acquire) && atomic_load_explicit(&ring->tail, 
+			memory_order_relaxed) == atomic_load_explicit(&ring->head, 
+			memory_order_relaxed);
+		/* Below the top a plain store unlinks, the top needs a CAS */
+		if (drained && (prev != NULL || 
+			atomic_compare_exchange_strong(&logRings, &top, next)))
+		{
+			if (prev != NULL)
+			{
+				prev->next = next;
+			}
+			logRetiredDropped += ring->dropped;
+			free(ring->records);
+			free(ring);
+		}
+		else
+		{
+			prev = ring;
+		}
+		ring = next;
+	}
+}
+
+int compareLogRecords(const void *a, const void *b)
+{
+	uint64_t x = ((const DATA_logRecord *) a)->nsec;
+	uint64_t y = ((const DATA_logRecord *) b)->nsec;
+	return (x > y) - (x < y);
+}
+
+/*
+** Writes one record, passing each argument with the type its conversion
+** expects - an int for %d or %c, a long for %ld, a pointer for %s and so
+** on - since the formats were checked against the arguments as written.
+*/
+void logFormat(FILE *out, const char *fmt, const long args[])
+{
+	char spec[32];
+	int arg = 0;
+	while (*fmt != '\0')
+	{
+		const char *start = strchr(fmt, '%');
+		if (start == NULL)
+		{
+			fputs(fmt, out);
+			return;
+		}
+		fwrite(fmt, 1, start - fmt, out);
+		/* Flags, width, precision, length modifier, then the conversion */
+		const char *end = start + 1;
+		end += strspn(end, "-+ #0");
+		end += strspn(end, "0123456789");
+		end += (*end == '.') ? 1 + strspn(end + 1, "0123456789") : 0;
+		const char *length = end;
+		end += strspn(end, "hlzjt");
+		size_t size = end + 1 - start;
+		if (*end == '\0' || size >= sizeof(spec))
+		{
+			fputs(start, out);
+			return;
+		}
+		memcpy(spec, start, size);
+		spec[size] = '\0';
+		fmt = end + 1;
+		if (*end == '%')
+		{
+			fputc('%', out);
+			continue;
+		}
+		long value = (arg < LOG_MAXARGS) ? args[arg++] : 0;
+		bool wide = (end > length) && length[0] != 'h';
+		bool longLong = (end - length == 2 && length[0] == 'l') ||
+			length[0] == 'j';
+		switch (*end)
+		{
+			case 'd':
+			case 'i':
+				if (longLong)
+				{
+					fprintf(out, spec, (long long) value);
+				}
+				else if (wide)
+				{
+					fprintf(out, spec, value);
+				}
+				else
+				{
+					fprintf(out, spec, (int) value);
+				}
+				break;
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'o':
+				if (longLong)
+				{
+					fprintf(out, spec, (unsigned long long) value);
+				}
+				else if (wide)
+				{
+					fprintf(out, spec, (unsigned long) value);
+				}
+				else
+				{
+					fprintf(out, spec, (unsigned) value);
+				}
+				break;
+			case 'c':
+				fprintf(out, spec, (int) value);
+				break;
+			case 's':
+				fprintf(out, spec, (const char *) (intptr_t) value);
+				break;
+			case 'p':
+				fprintf(out, spec, (void *) (intptr_t) value);
+				break;
+			default:
+				/* Floating point and the rest are not stored */
+				fputs(spec, out);
+				break;
+		}
+	}
+}
+
+/*
+** Logger thread only - takes a share of every ring, orders the records by
+** time and formats them with one flush. Returns the number formatted.
+*/
+int logFlush(void)
+{
+	static DATA_logRecord pass[LOG_PASS];
+	int count = 0, rings = 0;
+	logReap();
+	for (DATA_logRing *ring = atomic_load(&logRings); ring != NULL; 
+		ring = ring->next)
+	{
+		rings += 1;
+	}
+	for (DATA_logRing *ring = atomic_load(&logRings); ring != NULL && 
+		count < LOG_PASS; ring = ring->next)
+	{
+		unsigned head = atomic_load_explicit(&ring->head, 
+			memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(&ring->tail, 
+			memory_order_acquire);
+		/* Fair share per ring so one chatty thread cannot starve others */
+		unsigned n = tail - head, share = LOG_PASS/rings;
+		n = (n < share) ? n : share;
+		n = (n < (unsigned) (LOG_PASS - count)) ? n : LOG_PASS - count;
+		for (unsigned i = 0; i < n; i++)
+		{
+			pass[count++] = ring->records[(head + i) & ring->mask];
+		}
+		atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	}
+	qsort(pass, count, sizeof(DATA_logRecord), compareLogRecords);
+	for (int i = 0; i < count; i++)
+	{
+		logFormat(logFile, pass[i].fmt, pass[i].args);
+	}
+	if (count > 0)
+	{
+		fflush(logFile);
+	}
+	return count;
+}
+
+void *logThread(void *args)
+{
+	(void) args;
+	struct timespec idle = {0, LOG_IDLENSEC};
+	while (atomic_load(&logRunning))
+	{
+		if (logFlush() == 0)
+		{
+			nanosleep(&idle, NULL);
+		}
+	}
+	/* Drain whatever was queued before the stop */
+	while (logFlush() > 0)
+	{
+	}
+	return NULL;
+}
+
+/* Starts the logger thread writing to the given stream */
+void startLogger(FILE *file)
+{
+	logFile = file;
+	atomic_store(&logRunning, 1);
+	if (pthread_create(&logTid, NULL, logThread, NULL) != 0)
+	{
+		perror("logger thread failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Formats every queued record, reports losses and stops the thread */
+void stopLogger(void)
+{
+	unsigned long dropped = 0;
+	atomic_store(&logRunning, 0);
+	pthread_join(logTid, NULL);
+	dropped += logRetiredDropped;
+	for (DATA_logRing *ring = atomic_load(&logRings); ring != NULL; 
+		ring = ring->next)
+	{
+		dropped += ring->dropped;
+	}
+	if (dropped > 0)
+	{
+		fprintf(logFile, "Logger: %lu messages dropped\n", dropped);
+	}
+	fflush(logFile);
+}
+
+#endif
@@ -27,6 +27,7 @@
 ** INCLUDE FILES
 **==========================================================================*/
 #include "../router.h"
+#include "../packet.h"
 
 /*==========================================================================
 ** MAIN PROCESS
@@ -40,8 +41,15 @@ int main(void)
 	PID pid = createChild();
 	/* Create a socket */
 	int fd = createSocket();
-	/* Create struct for storing packet data */
-	DATA_stdPacket packet;
+	/* Create struct for storing packet data - header, then demo payload */
+	struct
+	{
+		DATA_packetHeader 	header;
+		DATA_stdPacket 		data;
+	} packet;
+	uint32_t seq = 0;
+	/* Header and payload only - not the struct's tail padding */
+	unsigned size = PKT_HDRSIZE + sizeof(DATA_stdPacket);
 	/* Create struct for storing server address*/
 	struct sockaddr_in servaddr;
 	/* Allocate memory for server address */
@@ -56,7 +64,8 @@ int main(void)
 		servaddr.sin_port = htons(PORT1);
 		/* Init child packet data with some values */
 		letters[0] = 'C'; letters[1] = 'H'; nums[0] = 1; nums[1] = 2;
-		initPacket(&packet, letters, nums);
+		initHeader(&packet.header, PKT_DEFAULT_MSGID + 1, size);
+		initPacket(&packet.data, letters, nums);
 	}
 	else
 	{
@@ -65,15 +74,20 @@ int main(void)
 		servaddr.sin_port = htons(PORT2);
 		/* Init parent packet data with some values */
 		letters[0] = 'P'; letters[1] = 'A'; nums[0] = 3; nums[1] = 4;
-		initPacket(&packet, letters, nums);
+		initHeader(&packet.header, PKT_DEFAULT_MSGID + 2, size);
+		initPacket(&packet.data, letters, nums);
 	}
 	/* Init len for sendto() function */
 	int len = sizeof(servaddr);
 	/* Loop sending packets at 1 Hz*/
 	while(1)
 	{
-		/* Send packet to server */
-		sendto(fd, (const DATA_stdPacket *) &packet, sizeof(DATA_stdPacket), 
+		/* Number and time-stamp the packet, then send it to server */
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		stampHeader(&packet.header, seq++, 
+			(uint64_t) now.tv_sec*1000000000ULL + now.tv_nsec);
+		sendto(fd, &packet, size, 
 		MSG_CONFIRM, (const struct sockaddr *) &servaddr, len);
 		printf("\nClient %d: Packet sent.\n\n", pid);
 		sleep(1);
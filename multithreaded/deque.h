@@ -0,0 +1,109 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "../data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Returned by dequePop()/dequeSteal() when there is nothing to take */
+#define DEQUE_EMPTY			UINT32_MAX
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Fixed-size Chase-Lev deque (with the C11 orderings of Le et al., 2013).
+** Capacity must cover every item that can be in the deque at once; the
+** router never holds a bucket in more than one place, so the number of
+** buckets is enough and the array never grows.
+*/
+DATA_deque *createDeque(unsigned capacity)
+{
+	unsigned size = 1;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+	DATA_deque *deque = aligned_alloc(CACHELINE, sizeof(DATA_deque));
+	if (deque == NULL ||
+		(deque->array = calloc(size, sizeof(atomic_uint))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	deque->mask = size - 1;
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	return deque;
+}
+
+/* Owner only */
+void dequePush(DATA_deque *deque, uint32_t item)
+{
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	atomic_store_explicit(&deque->array[bottom & deque->mask], item,
+		memory_order_relaxed);
+	/* The item must be visible before a thief can see the new bottom */
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/* Owner only - takes the newest item */
+uint32_t dequePop(DATA_deque *deque)
+{
+	long bottom = atomic_load_explicit(&deque->bottom,
+		memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	/* Claim the bottom before looking at what thieves have taken */
+	atomic_thread_fence(memory_order_seq_cst);
+	long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	uint32_t item = DEQUE_EMPTY;
+	if (top <= bottom)
+	{
+		item = atomic_load_explicit(&deque->array[bottom & deque->mask],
+			memory_order_relaxed);
+		if (top == bottom)
+		{
+			/* Last item - race the thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&deque->top, &top,
+				top + 1, memory_order_seq_cst, memory_order_relaxed))
+			{
+				item = DEQUE_EMPTY;
+			}
+			atomic_store_explicit(&deque->bottom, bottom + 1,
+				memory_order_relaxed);
+		}
+	}
+	else
+	{
+		atomic_store_explicit(&deque->bottom, bottom + 1,
+			memory_order_relaxed);
+	}
+	return item;
+}
+
+/* Any other thread - takes the oldest item, DEQUE_EMPTY on a lost race */
+uint32_t dequeSteal(DATA_deque *deque)
+{
+	long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (top >= bottom)
+	{
+		return DEQUE_EMPTY;
+	}
+	uint32_t item = atomic_load_explicit(&deque->array[top & deque->mask],
+		memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+		memory_order_seq_cst, memory_order_relaxed))
+	{
+		return DEQUE_EMPTY;
+	}
+	return item;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <sys/mman.h>
+#include "../data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Marks the end of the free list */
+#define POOL_NONE			UINT32_MAX
+/* Slot size - header plus the largest datagram, rounded to cache lines */
+#define POOL_SLOTSIZE		((sizeof(DATA_poolSlot) + PKT_MAXSIZE + \
+								CACHELINE - 1) & ~(CACHELINE - 1))
+/* Huge page size tried for the slab */
+#define POOL_HUGEPAGE		(2UL*1024*1024)
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+DATA_poolSlot *poolSlot(DATA_packetPool *pool, uint32_t index)
+{
+	return (DATA_poolSlot *) (pool->slab + (size_t) index*pool->slotSize);
+}
+
+/*
+** Allocates count slots in one slab at startup. The slab is backed by
+** huge pages when the system has them reserved, transparent huge pages 
+** are requested otherwise. Every slot starts out in the owner's cache.
+*/
+DATA_packetPool *createPool(unsigned count)
+{
+	DATA_packetPool *pool = aligned_alloc(CACHELINE, sizeof(DATA_packetPool));
+	if (pool == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(pool, 0, sizeof(DATA_packetPool));
+	pool->count 	= count;
+	pool->slotSize 	= POOL_SLOTSIZE;
+	pool->slabSize 	= ((size_t) count*pool->slotSize + POOL_HUGEPAGE - 1) & 
+		~(POOL_HUGEPAGE - 1);
+	pool->hugePages = true;
+	pool->slab = mmap(NULL, pool->slabSize, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (pool->slab == MAP_FAILED)
+	{
+		/* No reserved huge pages - fall back to normal pages */
+		pool->hugePages = false;
+		pool->slab = mmap(NULL, pool->slabSize, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool->slab == MAP_FAILED)
+		{
+			perror("mmap failed");
+			exit(EXIT_FAILURE);
+		}
+		madvise(pool->slab, pool->slabSize, MADV_HUGEPAGE);
+		/* Fault the slab in now rather than on the packet path */
+		memset(pool->slab, 0, pool->slabSize);
+	}
+	pool->cache = malloc(count*sizeof(uint32_t));
+	if (pool->cache == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned i = 0; i < count; i++)
+	{
+		pool->cache[i] = count - 1 - i;
+	}
+	pool->cached = count;
+	atomic_init(&pool->freeHead, POOL_NONE);
+	return pool;
+}
+
+/* Owner only - takes a free slot, POOL_NONE if every slot is in use */
+uint32_t poolAlloc(DATA_packetPool *pool)
+{
+	if (pool->cached == 0)
+	{
+		/* Take the whole shared free list at once - no ABA on exchange */
+		uint32_t index = atomic_exchange_explicit(&pool->freeHead, POOL_NONE, 
+			memory_order_acquire);
+		while (index != POOL_NONE)
+		{
+			pool->cache[pool->cached++] = index;
+			index = poolSlot(pool, index)->next;
+		}
+		if (pool->cached == 0)
+		{
+			return POOL_NONE;
+		}
+	}
+	return pool->cache[--pool->cached];
+}
+
+/* Once no thread holds a slot of the pool any more */
+void freePool(DATA_packetPool *pool)
+{
+	munmap(pool->slab, pool->slabSize);
+	free(pool->cache);
+	free(pool);
+}
+
+/* Any thread - returns n slots to the free list with a single CAS */
+void poolFreeN(DATA_packetPool *pool, const uint32_t *slots, unsigned n)
+{
+	if (n == 0)
+	{
+		return;
+	}
+	/* Link the slots into a chain first, then splice it in */
+	for (unsigned i = 0; i + 1 < n; i++)
+	{
+		poolSlot(pool, slots[i])->next = slots[i + 1];
+	}
+	DATA_poolSlot *last = poolSlot(pool, slots[n - 1]);
+	uint32_t head = atomic_load_explicit(&pool->freeHead, 
+		memory_order_relaxed);
+	do
+	{
+		last->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&pool->freeHead, &head, 
+		slots[0], memory_order_release, memory_order_relaxed));
+}
+
+#endif
@@ -9,50 +9,208 @@
 /*==========================================================================
 ** FUNCTION DEFINITIONS
 **==========================================================================*/
+/*
+** Lock-free single-producer/single-consumer ring of packet pool slot 
+** indices. Only one thread may call the enqueue functions and only one 
+** (other) thread the dequeue functions.
+** The producer publishes slots with a release store of tail and the
+** consumer frees them with a release store of head; each side re-reads the
+** other's index with acquire only when its cached copy says full/empty.
+*/
 packetQueue *createQueue(unsigned capacity)
 {
-	packetQueue *queue = malloc(sizeof(packetQueue));
-	queue->capacity = capacity;
-	queue->front = queue->size = 0;
-	queue->rear = capacity - 1;
-	queue->array = malloc(queue->capacity*sizeof(DATA_stdPacket));
+	/* Round capacity up to a power of two so wrapping is a mask */
+	unsigned size = 1;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+	packetQueue *queue = aligned_alloc(CACHELINE, sizeof(packetQueue));
+	if (queue == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(queue, 0, sizeof(packetQueue));
+	queue->capacity = size;
+	queue->mask = size - 1;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	queue->array = malloc(queue->capacity*sizeof(uint32_t));
+	if (queue->array == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
 	return queue;
 }
 
+void freeQueue(packetQueue *queue)
+{
+	free(queue->array);
+	free(queue);
+}
+
+unsigned queueSize(packetQueue *queue)
+{
+	/* Head first - it never passes the tail loaded after it */
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	return atomic_load_explicit(&queue->tail, memory_order_acquire) - head;
+}
+
 int isFull(packetQueue *queue)
 {
-	return (queue->size == queue->capacity);
+	return (queueSize(queue) == queue->capacity);
 }
 
 int isEmpty(packetQueue *queue)
 {
-	return (queue->size == 0);
+	return (queueSize(queue) == 0);
+}
+
+/* Producer only - adds up to n slot indices, returns how many were added */
+unsigned enqueue_n(packetQueue *queue, const uint32_t *slots, 
+	unsigned n)
+{
+	unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned space = queue->capacity - (tail - queue->cachedHead);
+	/* Only touch the consumer's line when the cached index says full */
+	if (space < n)
+	{
+		queue->cachedHead = atomic_load_explicit(&queue->head, 
+			memory_order_acquire);
+		space = queue->capacity - (tail - queue->cachedHead);
+		if (space < n)
+		{
+			n = space;
+		}
+	}
+	for (unsigned i = 0; i < n; i++)
+	{
+		queue->array[(tail + i) & queue->mask] = slots[i];
+	}
+	/* Publish the new slots to the consumer */
+	atomic_store_explicit(&queue->tail, tail + n, memory_order_release);
+	return n;
+}
+
+/* Producer only - returns 0 if the queue is full */
+int enqueue(packetQueue *queue, uint32_t slot)
+{
+	return enqueue_n(queue, &slot, 1);
+}
+
+/*
+** Producer only, on an overwrite queue - removes up to n of the oldest
+** slot indices so newer ones fit. The consumer may take the same slots at
+** the same time, so both sides claim them by advancing head with a CAS.
+*/
+unsigned evict_n(packetQueue *queue, uint32_t *slots, unsigned n)
+{
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned count;
+	do
+	{
+		count = (tail - head < n) ? tail - head : n;
+		for (unsigned i = 0; i < count; i++)
+		{
+			slots[i] = queue->array[(head + i) & queue->mask];
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, 
+		head + count, memory_order_acq_rel, memory_order_acquire));
+	queue->cachedHead = head + count;
+	return count;
 }
 
-void enqueue(packetQueue *queue, DATA_stdPacket packet)
+/* Consumer side of an overwrite queue - claims slots with a CAS on head */
+unsigned dequeueShared(packetQueue *queue, uint32_t *slots, unsigned n)
 {
-	queue->rear = (queue->rear + 1) % queue->capacity;
-	queue->array[queue->rear] = packet;
-	queue->size = queue->size + 1;
-	printf("Packet enqueued.\n");
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	unsigned count;
+	do
+	{
+		/* Loaded after head, so never behind it */
+		queue->cachedTail = atomic_load_explicit(&queue->tail, 
+			memory_order_acquire);
+		count = (queue->cachedTail - head < n) ? queue->cachedTail - head : n;
+		for (unsigned i = 0; i < count; i++)
+		{
+			slots[i] = queue->array[(head + i) & queue->mask];
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, 
+		head + count, memory_order_acq_rel, memory_order_acquire));
+	return count;
 }
+
+/* Consumer only - removes up to n slot indices, returns how many were removed */
+unsigned dequeue_n(packetQueue *queue, uint32_t *slots, unsigned n)
+{
+	if (queue->overwrite)
+	{
+		return dequeueShared(queue, slots, n);
+	}
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	unsigned avail = queue->cachedTail - head;
+	/* Only touch the producer's line when the cached index says empty */
+	if (avail < n)
+	{
+		queue->cachedTail = atomic_load_explicit(&queue->tail, 
+			memory_order_acquire);
+		avail = queue->cachedTail - head;
+		if (avail < n)
+		{
+			n = avail;
+		}
+	}
+	for (unsigned i = 0; i < n; i++)
+	{
+		slots[i] = queue->array[(head + i) & queue->mask];
+	}
+	/* Hand the slots back to the producer */
+	atomic_store_explicit(&queue->head, head + n, memory_order_release);
+	return n;
+}
+
 /* Function call must check if queue is empty first */
-DATA_stdPacket dequeue(packetQueue *queue)
+uint32_t dequeue(packetQueue *queue)
+{
+	uint32_t slot;
+	dequeue_n(queue, &slot, 1);
+	return slot;
+}
+
+/* Consumer only - reads the oldest slot index without removing it */
+int peek(packetQueue *queue, uint32_t *slot)
 {
-	DATA_stdPacket packet = queue->array[queue->front];
-	queue->front = (queue->front + 1) % queue->capacity;
-	queue->size = queue->size - 1;
-	return packet;
+	/* The producer may move head of an overwrite queue - reload both */
+	unsigned head = atomic_load_explicit(&queue->head, queue->overwrite ? 
+		memory_order_acquire : memory_order_relaxed);
+	if (queue->overwrite || queue->cachedTail == head)
+	{
+		queue->cachedTail = atomic_load_explicit(&queue->tail, 
+			memory_order_acquire);
+		if (queue->cachedTail == head)
+		{
+			return 0;
+		}
+	}
+	*slot = queue->array[head & queue->mask];
+	return 1;
 }
 
-DATA_stdPacket front(packetQueue *queue)
+/* Consumer only */
+uint32_t front(packetQueue *queue)
 {
-	return queue->array[queue->front];
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	return queue->array[head & queue->mask];
 }
 
-DATA_stdPacket rear(packetQueue *queue)
+/* Consumer only */
+uint32_t rear(packetQueue *queue)
 {
-	return queue->array[queue->rear];
+	unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	return queue->array[(tail - 1) & queue->mask];
 }
 
-#endif
\ No newline at end of file
+#endif
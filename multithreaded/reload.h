@@ -0,0 +1,284 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <limits.h>
+#include "../data_types.h"
+#include "../log.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Largest class queue of a port - pool slot indices fit WORK_SLOTBITS */
+#define RELOAD_MAXQUEUE		8192
+/* Ports a reload may open beyond those open at startup */
+#define RELOAD_PORTS		64
+/* Reloader poll interval while it waits on readers and processors */
+#define RELOAD_POLLMSEC		1
+/* Port line without its own queue or policy - the defaults fill it in */
+#define RELOAD_UNSET		UINT_MAX
+/* Life of a reader slot: started, asked to stop, stopped and joined, and
+   drained by the main thread until the reloader frees the slot */
+#define READER_FREE			0
+#define READER_RUNNING		1
+#define READER_RETIRING		2
+#define READER_STOPPED		3
+#define READER_DRAINED		4
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Names of the overload policies, indexed by POLICY_ value */
+const char *policyNames[] = {"block", "drop-newest", "drop-oldest", "spool"};
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* POLICY_ value of a name, -1 for an unknown one */
+int policyByName(const char *name)
+{
+	for (int p = 0; p < (int) (sizeof(policyNames)/sizeof(policyNames[0]));
+		p++)
+	{
+		if (strcmp(name, policyNames[p]) == 0)
+		{
+			return p;
+		}
+	}
+	return -1;
+}
+
+/* Queue capacity of a config value, 0 after printing the error */
+unsigned parseQueueSize(const char *value, int lineNo)
+{
+	char *end;
+	unsigned long queue = strtoul(value, &end, 10);
+	if (end == value || *end != '\0' || queue < 1 || queue > RELOAD_MAXQUEUE)
+	{
+		fprintf(stderr, "Config line %d: queue must be 1 to %d, not %s\n",
+			lineNo, RELOAD_MAXQUEUE, value);
+		return 0;
+	}
+	return queue;
+}
+
+/*
+** Parses one line of the config file. A port line opens a port or a range
+** of ports, optionally with its own queue capacity and policy; the other
+** keys set the defaults of every port line, the route file, the log level
+** and the class weights. Returns -1 after printing the error.
+*/
+int parseConfigLine(char *line, int lineNo, const DATA_routerConfig *config,
+	DATA_fileConfig *file, unsigned *queue, int *policy)
+{
+	char *save, *key = strtok_r(line, " \t\r\n", &save);
+	char *value = (key != NULL) ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+	int first, last, used;
+	if (key == NULL || key[0] == '#')
+	{
+		return 0;
+	}
+	if (value == NULL)
+	{
+		fprintf(stderr, "Config line %d: %s needs a value\n", lineNo, key);
+		return -1;
+	}
+	if (strcmp(key, "port") == 0)
+	{
+		/* A single port or first-last, and nothing after it */
+		int more = 0;
+		last = (sscanf(value, "%d%n", &first, &used) == 1) ? first : -1;
+		if (last != -1 && value[used] == '-')
+		{
+			last = (sscanf(value + used + 1, "%d%n", &last, &more) == 1) ?
+				last : -1;
+			used += 1 + more;
+		}
+		if (last == -1 || value[used] != '\0')
+		{
+			fprintf(stderr, "Config line %d: bad port %s\n", lineNo, value);
+			return -1;
+		}
+		if (first < config->firstPort || last < first || last > 65535 ||
+			last - config->firstPort >= MAXSOCK)
+		{
+			fprintf(stderr, "Config line %d: ports must be %d to %d\n",
+				lineNo, config->firstPort, config->firstPort + MAXSOCK - 1);
+			return -1;
+		}
+		unsigned portQueue = RELOAD_UNSET;
+		int portPolicy = -1;
+		char *option, *arg;
+		while ((option = strtok_r(NULL, " \t\r\n", &save)) != NULL &&
+			option[0] != '#')
+		{
+			arg = strtok_r(NULL, " \t\r\n", &save);
+			if (arg != NULL && strcmp(option, "queue") == 0)
+			{
+				if ((portQueue = parseQueueSize(arg, lineNo)) == 0)
+				{
+					return -1;
+				}
+			}
+			else if (arg != NULL && strcmp(option, "policy") == 0 &&
+				(portPolicy = policyByName(arg)) != -1)
+			{
+				continue;
+			}
+			else
+			{
+				fprintf(stderr, "Config line %d: bad port option %s %s\n",
+					lineNo, option, (arg != NULL) ? arg : "");
+				return -1;
+			}
+		}
+		for (int port = first; port <= last; port++)
+		{
+			file->queues[port - config->firstPort] 		= portQueue;
+			file->policies[port - config->firstPort] 	= portPolicy;
+		}
+	}
+	else if (strcmp(key, "queue") == 0)
+	{
+		if ((*queue = parseQueueSize(value, lineNo)) == 0)
+		{
+			return -1;
+		}
+	}
+	else if (strcmp(key, "policy") == 0)
+	{
+		if ((*policy = policyByName(value)) == -1)
+		{
+			fprintf(stderr, "Config line %d: unknown overload policy %s\n",
+				lineNo, value);
+			return -1;
+		}
+	}
+	else if (strcmp(key, "routes") == 0)
+	{
+		free(file->routeFile);
+		if ((file->routeFile = strdup(value)) == NULL)
+		{
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (strcmp(key, "log") == 0)
+	{
+		file->logLevel = -1;
+		for (int level = LOG_ERROR; level <= LOG_DEBUG; level++)
+		{
+			if (strcmp(value, logLevelNames[level]) == 0)
+			{
+				file->logLevel = level;
+			}
+		}
+		if (file->logLevel == -1)
+		{
+			fprintf(stderr, "Config line %d: unknown log level %s\n", lineNo,
+				value);
+			return -1;
+		}
+	}
+	else if (strcmp(key, "weights") == 0)
+	{
+		if (parseWeights(value, file->weights) == -1)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "Config line %d: unknown key %s\n", lineNo, key);
+		return -1;
+	}
+	return 0;
+}
+
+void freeConfigFile(DATA_fileConfig *file)
+{
+	free(file->queues);
+	free(file->policies);
+	free(file->routeFile);
+	memset(file, 0, sizeof(DATA_fileConfig));
+}
+
+/*
+** Reads the -g file into the ports to open and the settings to apply.
+** Anything the file leaves out comes from the command line, and without
+** a file the -n ports from -p are open as before. Returns -1 after
+** printing the error, leaving file empty.
+*/
+int readConfigFile(const DATA_routerConfig *config, DATA_fileConfig *file)
+{
+	memset(file, 0, sizeof(DATA_fileConfig));
+	file->queues 	= calloc(MAXSOCK, sizeof(unsigned));
+	file->policies 	= malloc(MAXSOCK*sizeof(int));
+	if (file->queues == NULL || file->policies == NULL ||
+		(config->routeFile != NULL &&
+		(file->routeFile = strdup(config->routeFile)) == NULL))
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int port = 0; port < MAXSOCK; port++)
+	{
+		file->policies[port] = -1;
+	}
+	file->logLevel = -1;
+	memcpy(file->weights, config->weights, sizeof(file->weights));
+	unsigned queue = MAXBUFFER;
+	int policy = -1, ret = 0, lineNo = 0;
+	if (config->configFile == NULL)
+	{
+		for (int port = 0; port < config->numSock; port++)
+		{
+			file->queues[port] = RELOAD_UNSET;
+		}
+	}
+	else
+	{
+		FILE *in = fopen(config->configFile, "r");
+		if (in == NULL)
+		{
+			perror("config file");
+			ret = -1;
+		}
+		char *line = NULL;
+		size_t size = 0;
+		while (ret == 0 && getline(&line, &size, in) != -1)
+		{
+			ret = parseConfigLine(line, ++lineNo, config, file, &queue,
+				&policy);
+		}
+		free(line);
+		if (in != NULL)
+		{
+			fclose(in);
+		}
+	}
+	/* Port lines without their own settings take the defaults */
+	for (int port = 0; port < MAXSOCK; port++)
+	{
+		if (file->queues[port] == RELOAD_UNSET)
+		{
+			file->queues[port] = queue;
+		}
+		if (file->queues[port] > 0 && file->policies[port] == -1)
+		{
+			/* The last -O policy applies to the remaining ports */
+			file->policies[port] = (policy != -1) ? policy :
+				config->policies[(port < config->numPolicies) ? port :
+				config->numPolicies - 1];
+		}
+	}
+	if (ret == -1)
+	{
+		freeConfigFile(file);
+	}
+	return ret;
+}
+
+#endif
@@ -8,7 +8,9 @@
 ** $Date:      	2020-07-11
 **
 ** Purpose:  	This application is a UDP server which receives packets from
-** 				multiple sockets in different pthreads
+** 				multiple sockets in different pthreads. Each port can be
+** 				opened several times with SO_REUSEPORT so that one port is
+** 				received by several pinned worker threads.
 **
 ** Functions Defined:
 **    	initServAddrs 	- 	Initializes memory for addresses in address table 
@@ -16,7 +18,63 @@
 **    	createSocket 	- 	Calls to socket() to create a new socket
 **   	bindSocket		- 	Calls to bind() to bind a socket to a server
 ** 							address in the address table
+**		handleSignal	- 	Stops the loop or requests a statistics dump or a
+** 							reload
+**		installSignals	- 	Installs handleSignal for SIGINT/SIGTERM/SIGUSR1/
+** 							SIGHUP
+**		printThreadStats- 	Prints batch fill and hot-path counters
+**		parseConfig		- 	Reads ports, shards, CPUs, batch size, work, stats
+** 							port, log level, route file, flow table, rate
+** 							limits, capture file, spool directory, config
+** 							file and reassembly contexts
+**		parseCpuList	- 	Parses a CPU list such as 0,2,4-7
+**		setReusePort	- 	Sets SO_REUSEPORT on a shard socket
+**		attachFlowFilter- 	Attaches a CBPF program keeping flows on a shard
+**		setNonBlocking	- 	Sets O_NONBLOCK so workers can drain sockets
+**		raiseFdLimit	- 	Raises RLIMIT_NOFILE to fit every socket
+**		enqueueWait		- 	Adds slot indices to a ring, waiting while full
+**		attachSlots		- 	Points receive batch entries at free pool slots
+**		validateSlots	- 	Checks packet headers, the batch's trailers and
+** 							rate limits, records senders and frees the
+** 							packets not admitted
+**		wakeConsumer	- 	Posts the eventfd if the main thread is asleep
+**		waitForPackets	- 	Sleeps on the eventfd while all buffers are empty
+**		enqueueClasses	- 	Splits a batch into its priority class queues
+**		drainBuffers	- 	Serves class 0 first and the others by weight
+**		drainCritical	- 	Processes every queued strict-priority packet
+**		serveClass		- 	Spends one deficit round-robin turn on a class
+**		serveSlots		- 	Routes a run of slots and records their delay
+**		printClassStats	- 	Prints packets and queueing delay per class
+**		parseWeights	- 	Parses the -W list of class weights
+**		parsePolicyList	- 	Parses the -O list of per-port overload policies
+**		enqueuePolicy	- 	Queues slots, blocking, dropping or spooling when
+** 							full
+**		spoolSlots		- 	Appends slots to the reader's spool and frees them
+**		drainSpool		- 	Moves spooled packets back to the class queues
+**		createWorkers	- 	Sets up the processing contexts and flow buckets
+**		runWorker		- 	Entry of a processing worker thread
+**		processSlots	- 	Routes a run of one reader's slots on a worker
+**		dispatchSlots	- 	Hands slots to the flow buckets of the workers
+**		scheduleBucket	- 	Posts an idle bucket to its home worker
+**		takeBucket		- 	Pops a bucket from the own deque or steals one
+**		serveBucket		- 	Processes one turn of a bucket's packets
+**		printWorkerStats- 	Prints packets, turns and steals per worker
+**		simulateWork	- 	Busy-waits to model per-packet processing cost
 **		processPacket	- 	Prints the data from the received packet
+**		processSpacePacket	- Prints the primary header of a space packet
+**		startReader		- 	Sets up a reader slot and starts its thread
+**		openPort		- 	Binds the shard sockets of a port and starts
+** 							their readers
+**		retireReader	- 	Stops a reader at a batch boundary and joins it
+**		freeReader		- 	Frees the slot of a drained reader
+**		publishTable	- 	Swaps in a new port table and frees the old one
+**		waitForEpoch	- 	Waits until no thread can hold an older table
+**		reloadConfig	- 	Applies the config file to ports, queues, routes,
+** 							log level and weights
+**		collectReaders	- 	Frees readers retired by a reload once drained
+**		runReloader		- 	Entry of the thread applying SIGHUP reloads
+**		updateReaders	- 	Marks retired readers drained and releases the
+** 							readers that took their sockets over
 **		getMax			- 	Global utility function to get max integer from 
 ** 							array of integers
 **
@@ -33,170 +91,2018 @@
 **==========================================================================*/
 #include "../router.h"
 #include "queue.h"
+#include "pool.h"
+#include "../batch.h"
+#include "../stats.h"
+#include "../log.h"
+#include "../route.h"
+#include "../histogram.h"
+#include "../flow.h"
+#include "../ratelimit.h"
+#include "../capture.h"
+#include "../checksum.h"
+#include "../ccsds.h"
+#include "deque.h"
+#include "spool.h"
+#include "reload.h"
 
 /*==========================================================================
 ** GLOBAL VARIABLES
 **==========================================================================*/
-/* Init input buffer for each client */
-packetQueue *buffers[NUMSOCK];
-/* Mutual exclusion for input buffers */
-MUTEX buffers_mutex[NUMSOCK];
-/* Counting semaphores for full buffer */
-SEM buffers_sem[NUMSOCK];
-/* Pthread structure to hold thread info */
-DATA_pthread threads[NUMSOCK];
+/* Cleared by SIGINT/SIGTERM to leave the processing loop */
+volatile sig_atomic_t running = 1;
+/* Set by SIGUSR1 to print batch statistics from the loop */
+volatile sig_atomic_t dumpStats = 0;
+/* Main thread sleeps on this eventfd while every buffer is empty */
+int wakefd;
+/* Set while the main thread is (about to be) asleep on wakefd */
+atomic_int consumerSleeping;
+/* Reader slots - room for every port a reload may add, twice over so a
+   port can move to a new reader while the old one drains */
+DATA_pthread *threads;
+/* Number of reader slots */
+int numThreads;
+/* Hot-path counters - a slot per reader and per worker and port */
+DATA_stats *stats;
+/* Counter slot of each port shard, kept for the readers that follow */
+DATA_statsSlot **readerStats;
+/* Priority scheduling of the reader queues, owned by the main thread */
+DATA_scheduler sched;
+/* Readers and routes in use - swapped whole by the reloader */
+_Atomic(DATA_portTable *) portTable;
+/* Bumped after each swap; every processing thread reports what it saw */
+atomic_ulong tableEpoch;
+atomic_ulong mainEpoch;
+/* Table the main thread is scheduling, refreshed once per loop */
+DATA_portTable *mainTable;
+/* Settings of the open ports, owned by the reloader after startup */
+DATA_fileConfig portConfig;
+/* Server address of every port index */
+struct sockaddr_in *addrTbl;
+/* Flow table slots of each reader */
+unsigned readerFlows;
+/* SIGHUP posts this eventfd to wake the reloader thread */
+int reloadfd;
+pthread_t reloadTid;
+/* Processing contexts - with -P 0 workers[0] runs on the main thread */
+DATA_worker *workers;
+int numWorkers;
+/* Flows hash to buckets; a bucket is processed by one worker at a time */
+DATA_flowBucket *buckets;
+/* Space packets being put together - a packet's segments share a bucket, 
+   but the bucket may move to another worker between them, so the table
+   is shared and locked one shard at a time */
+DATA_reassembly *reasm;
+/* Set once the main thread dispatches no more - workers drain and exit */
+atomic_int workersStop;
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+void printThreadStats(void);
+void enqueueWait(packetQueue *queue, uint32_t *slots, unsigned n, 
+	DATA_statsSlot *counters);
+void attachSlots(DATA_pthread *self, unsigned n);
+int validateSlots(DATA_pthread *self, int n);
+void wakeConsumer(void);
+void waitForPackets(void);
+int drainBuffers(int *packetsProcessed);
+int drainCritical(void);
+int serveClass(int cls);
+void serveSlots(int i, int cls, uint32_t *slots, unsigned n);
+void enqueueClasses(DATA_pthread *self, int n);
+void enqueuePolicy(DATA_pthread *self, packetQueue *queue, uint32_t *slots, 
+	unsigned n);
+void spoolSlots(DATA_pthread *self, uint32_t *slots, unsigned n);
+uint64_t drainSpool(DATA_pthread *self);
+void printClassStats(void);
+void createWorkers(DATA_routerConfig *config);
+void *runWorker(void *args);
+void processSlots(DATA_worker *self, int i, uint32_t *slots, unsigned n);
+void dispatchSlots(int i, uint32_t *slots, unsigned n);
+void scheduleBucket(uint32_t b);
+uint32_t takeBucket(DATA_worker *self);
+void serveBucket(DATA_worker *self, uint32_t b);
+void printWorkerStats(void);
+void simulateWork(long nsec);
+void startReader(DATA_routerConfig *config, int i, int port, int shard, 
+	int fd, unsigned capacity, int policy, int prev);
+int openPort(DATA_routerConfig *config, int port, unsigned capacity, 
+	int policy, int *readers, int *count);
+int retireReader(int i);
+void freeReader(int i);
+int publishTable(int *readers, int count, DATA_routeTable *routes, 
+	const int weights[]);
+int waitForEpoch(uint64_t epoch);
+void reloadConfig(DATA_routerConfig *config);
+bool collectReaders(void);
+void *runReloader(void *args);
+void updateReaders(void);
 
 /*==========================================================================
 ** SOCKET READING THREAD ENTRY
 **==========================================================================*/
 void *readSocket(void *args)
 {
-	/* Initally assume thread is invalid */
-	int thread = -1;
-	/* phread_self() returns current thread ID*/
-	for (int i; i < NUMSOCK; i++){
-		/* Thread data is mine if current thread ID matches data */
-		if (threads[i].tid == pthread_self())
+	/* Thread data is handed over by pthread_create() */
+	DATA_pthread *self = (DATA_pthread *) args;
+	int thread = self->threadnum;
+	DATA_batch *batch = self->batch;
+	/* Each worker runs its own event loop over the shard socket it owns */
+	struct epoll_event events[MAXEVENTS];
+	/* Receive straight into pool slots - no copy on the way to the queue */
+	attachSlots(self, batch->size);
+	/* Loop receiving packets until the reloader retires the reader */
+	while (atomic_load_explicit(&self->state, memory_order_acquire) == 
+		READER_RUNNING)
+	{
+		/* Pend on the epoll instance until the shard socket is readable,
+		   polling instead while the spool has packets or unsynced data */
+		int timeout = (self->spool != NULL && (self->spool->records > 0 ||
+			self->spool->dirty)) ? SPOOL_POLLMSEC : -1;
+		int ready = epoll_wait(self->epfd, events, MAXEVENTS, timeout);
+		if (self->spool != NULL)
+		{
+			drainSpool(self);
+			wakeConsumer();
+		}
+		if (ready <= 0)
+		{
+			continue;
+		}
+		/* Edge-triggered - drain the socket until it would block */
+		int n;
+		while (atomic_load_explicit(&self->state, memory_order_relaxed) == 
+			READER_RUNNING && (n = recvBatch(self->fd, batch)) > 0)
+		{
+			LOG(LOG_DEBUG, "Thread %d: received %d packets\n", thread, n);
+			uint64_t bytes = 0;
+			uint64_t now = capturing ? statsClock() : 0;
+			for (int i = 0; i < n; i++)
+			{
+				DATA_poolSlot *slot = poolSlot(self->pool, self->rxSlots[i]);
+				slot->len = batch->msgs[i].msg_len;
+				bytes += slot->len;
+				/* Copied before validation, so rejected datagrams are kept */
+				if (capturing)
+				{
+					capturePost(self->port, &slot->src, slot->data, slot->len,
+						now);
+				}
+			}
+			statAdd(self->stats, STAT_RX_PACKETS, n);
+			statAdd(self->stats, STAT_RX_BYTES, bytes);
+			/* Cumulative per socket, so the latest value is the count */
+			statMax(self->stats, STAT_KERNEL_DROPS, batch->kernelDrops);
+			/* Only valid packets within their rate limits are handed over */
+			int valid = validateSlots(self, n);
+			/* Behind a spool that still holds packets, new ones join its end */
+			if (self->spool != NULL && drainSpool(self) > 0)
+			{
+				spoolSlots(self, self->rxSlots, valid);
+			}
+			else
+			{
+				/* Hand the slot indices over to the queue of their class */
+				enqueueClasses(self, valid);
+			}
+			/* Wake the main thread if it went to sleep on empty buffers */
+			wakeConsumer();
+			/* Replace the slots just handed over with free ones */
+			attachSlots(self, n);
+		}
+	}
+	/* The reloader hands the socket, flows and spool on or closes them */
+	pthread_exit(0);
+}
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(int argc, char *argv[])
+{
+	/* Read ports, shards, CPUs, batch size and work from the command line */
+	DATA_routerConfig config;
+	parseConfig(argc, argv, &config);
+	/* Messages are formatted off the packet path by the logger thread */
+	startLogger(stdout);
+	/* Ports, queues and policies from -g, or the -n ports as before */
+	if (readConfigFile(&config, &portConfig) == -1)
+	{
+		exit(EXIT_FAILURE);
+	}
+	if (portConfig.logLevel != -1)
+	{
+		atomic_store(&logLevel, portConfig.logLevel);
+	}
+	int numOpen = 0;
+	for (int port = 0; port < MAXSOCK; port++)
+	{
+		numOpen += (portConfig.queues[port] > 0);
+	}
+	/* Bucket entries carry the reader index above the slot index */
+	numThreads = 2*(numOpen + RELOAD_PORTS)*config.shards;
+	if (numOpen == 0)
+	{
+		fprintf(stderr, "No ports to open\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config.workers > 0 && numThreads > (1 << (32 - WORK_SLOTBITS)))
+	{
+		fprintf(stderr, "Processing workers take up to %d ports\n", 
+			(1 << (32 - WORK_SLOTBITS))/(2*config.shards) - RELOAD_PORTS);
+		exit(EXIT_FAILURE);
+	}
+	/* A socket, epoll instance and eventfd per reader */
+	raiseFdLimit(3*numThreads);
+	threads = calloc(numThreads, sizeof(DATA_pthread));
+	readerStats = calloc((size_t) MAXSOCK*config.shards, 
+		sizeof(DATA_statsSlot *));
+	/* Init table to hold client and server addresses */
+	addrTbl = malloc(SERVMODE*MAXSOCK*sizeof(struct sockaddr_in));
+	if (threads == NULL || readerStats == NULL || addrTbl == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	/* Readers post to this eventfd when the main thread is asleep */
+	if ((wakefd = eventfd(0, 0)) == -1 || (reloadfd = eventfd(0, 0)) == -1)
+	{
+		perror("eventfd failed");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&consumerSleeping, 0);
+	/* Init server addresses of every port a reload may open */
+	initServAddrs(addrTbl, config.firstPort, MAXSOCK);
+	/* The -f slots are split over the readers open at startup */
+	readerFlows = config.flowCapacity/(numOpen*config.shards);
+	/* Readers and every processing context write their own counter slots,
+	   with room for the ports a reload adds */
+	stats = createStats((numOpen + RELOAD_PORTS)*(config.shards + 
+		((config.workers > 0) ? config.workers : 1)), config.firstPort);
+	if (config.statsPort > 0)
+	{
+		startStatsServer(stats, config.statsPort);
+	}
+	/* Class 0 is served first, the others by deficit round-robin */
+	memcpy(sched.weights, portConfig.weights, sizeof(sched.weights));
+	/* Readers check trailers with the fastest CRC32C kernel of this CPU */
+	initChecksum();
+	reasm = createReassembly(config.spaceContexts, config.spaceTimeout, 
+		true);
+	/* No route file routes everything to print */
+	DATA_routeTable *routes = loadRoutes(portConfig.routeFile);
+	/* Start the processing workers, if any, before the first packet */
+	createWorkers(&config);
+	LOG(LOG_INFO, "Routes: %u message IDs, %u destinations\n", 
+		routes->numRoutes, routes->numDests);
+	LOG(LOG_INFO, "Checksum: CRC32C %s\n", checksumEngine);
+	/* Stop cleanly on SIGINT/SIGTERM, dump stats on SIGUSR1, reload on 
+	   SIGHUP */
+	installSignals();
+	/* The readers copy every datagram to the capture writer with -d */
+	if (config.captureFile != NULL)
+	{
+		startCapture(config.captureFile, config.firstPort);
+	}
+	/* Create and bind every shard socket of every port and start its reader */
+	int *readers = malloc(numThreads*sizeof(int)), count = 0;
+	if (readers == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int port = 0; port < MAXSOCK; port++)
+	{
+		if (portConfig.queues[port] > 0 && openPort(&config, port, 
+			portConfig.queues[port], portConfig.policies[port], readers, 
+			&count) == -1)
+		{
+			exit(EXIT_FAILURE);
+		}
+	}
+	publishTable(readers, count, routes, portConfig.weights);
+	free(readers);
+	mainTable = atomic_load(&portTable);
+	/* SIGHUP reloads are applied off the packet path */
+	int createret;
+	if ((createret = pthread_create(&reloadTid, NULL, *runReloader, 
+		&config)) != 0)
+	{
+		errno = createret;
+		perror("thread failed");
+		exit(EXIT_FAILURE);
+	}
+	/* Tally of packets processed */
+	int packetsProcessed = 0;
+	/* Drain whole batches while packets keep arriving, sleep otherwise */
+	while(running)
+	{
+		/* Epoch first - the table loaded after it is at least that new */
+		atomic_store(&mainEpoch, atomic_load(&tableEpoch));
+		DATA_portTable *table = atomic_load(&portTable);
+		if (table != mainTable)
+		{
+			/* Cursors are positions in the table - start the turns over */
+			mainTable = table;
+			memset(sched.cursor, 0, sizeof(sched.cursor));
+			memcpy(sched.weights, table->weights, sizeof(sched.weights));
+		}
+		updateReaders();
+		/* Print per-thread batch fill on request */
+		if (dumpStats)
+		{
+			printThreadStats();
+			dumpStats = 0;
+		}
+		if (drainBuffers(&packetsProcessed) == 0)
+		{
+			waitForPackets();
+		}
+	}
+	/* The reloader stops first, so the table stays as it is */
+	uint64_t one = 1;
+	write(reloadfd, &one, sizeof(one));
+	pthread_join(reloadTid, NULL);
+	mainTable = atomic_load(&portTable);
+	/* Readers block in epoll_wait() - cancel them, then join. Retired
+	   ones have already passed their socket on or closed it */
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		DATA_pthread *thread = &threads[mainTable->readers[k]];
+		int state = atomic_load(&thread->state);
+		if (state == READER_RUNNING || state == READER_RETIRING)
+		{
+			pthread_cancel(thread->tid);
+			pthread_join(thread->tid, NULL);
+			close(thread->fd);
+		}
+		close(thread->epfd);
+	}
+	/* No reader is left to post - append what they captured */
+	stopCapture();
+	/* Undrained packets stay on disk for the next run */
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		DATA_pthread *thread = &threads[mainTable->readers[k]];
+		if (thread->spool != NULL)
+		{
+			closeSpool(thread->spool, statsClock());
+		}
+	}
+	/* Workers finish the buckets already dispatched, then exit */
+	atomic_store(&workersStop, 1);
+	unsigned long processed = 0;
+	for (int w = 0; w < ((numWorkers > 0) ? numWorkers : 1); w++)
+	{
+		if (numWorkers > 0)
+		{
+			pthread_join(workers[w].tid, NULL);
+		}
+		processed += workers[w].packets;
+	}
+	/* Flush queued messages before the exit reports */
+	stopLogger();
+	printf("%lu Packets processed.\n", processed);
+	printThreadStats();
+	exit(EXIT_SUCCESS);
+}
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+void handleSignal(int sig)
+{
+	uint64_t one = 1;
+	if (sig == SIGUSR1)
+	{
+		dumpStats = 1;
+	}
+	else if (sig == SIGHUP)
+	{
+		/* The reloader does the work - it may block, the handler may not */
+		write(reloadfd, &one, sizeof(one));
+		return;
+	}
+	else
+	{
+		running = 0;
+	}
+	/* The main thread may be asleep on the eventfd - wake it */
+	write(wakefd, &one, sizeof(one));
+}
+
+void installSignals(void)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	/* No SA_RESTART so a blocked eventfd read() returns early */
+	action.sa_handler = handleSignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+}
+
+void printThreadStats(void)
+{
+	char name[32];
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		int i = mainTable->readers[k];
+		snprintf(name, sizeof(name), "Thread %d", i);
+		printBatchStats(threads[i].batch, name);
+		/* A reader that passed its socket on passed its flows with it */
+		if (threads[i].flows != NULL)
+		{
+			printFlowStats(threads[i].flows, name);
+		}
+	}
+	printClassStats();
+	printWorkerStats();
+	printReassemblyStats(reasm);
+	printStats(stats);
+}
+
+void printClassStats(void)
+{
+	DATA_histogram delays[NUMCLASSES];
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		DATA_histogram *delay = &delays[cls];
+		if (sched.packets[cls] == 0)
+		{
+			continue;
+		}
+		/* Each context records the packets it processed */
+		initHistogram(delay);
+		for (int w = 0; w < ((numWorkers > 0) ? numWorkers : 1); w++)
+		{
+			mergeHistogram(delay, &workers[w].delay[cls]);
+		}
+		printf("Class %d (%s %d): %lu packets, %lu bytes, queueing delay us "
+			"p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n", cls, 
+			cls == 0 ? "strict" : "weight", sched.weights[cls], 
+			sched.packets[cls], sched.bytes[cls], 
+			histogramPercentile(delay, 0.50)/1e3, 
+			histogramPercentile(delay, 0.99)/1e3, 
+			histogramPercentile(delay, 0.999)/1e3, delay->max/1e3);
+	}
+}
+
+void parseConfig(int argc, char *argv[], DATA_routerConfig *config)
+{
+	/* Defaults match the original two-client build, one shard per port */
+	memset(config, 0, sizeof(DATA_routerConfig));
+	config->firstPort 	= PORT1;
+	config->numSock 	= NUMSOCK;
+	config->batchSize 	= 1;
+	config->workNsec 	= 0;
+	config->shards 		= 1;
+	config->statsPort 	= 0;
+	config->routeFile 	= NULL;
+	config->rcvBuf 		= 0;
+	config->numPolicies = 0;
+	config->workers 	= 0;
+	config->flowCapacity = FLOW_CAPACITY;
+	config->flowIdle 	= FLOW_IDLE;
+	config->spaceContexts = CCSDS_CONTEXTS;
+	config->spaceTimeout = CCSDS_TIMEOUT;
+	config->numPortLimits = 0;
+	config->numSrcLimits = 0;
+	config->captureFile = NULL;
+	config->spoolDir 	= SPOOL_DIR;
+	config->configFile 	= NULL;
+	/* Class 0 is strict priority - its weight is not used */
+	int weights[NUMCLASSES] = DRR_WEIGHTS;
+	memcpy(config->weights, weights, sizeof(weights));
+	int opt;
+	while ((opt = getopt(argc, argv, "p:n:b:w:k:C:FS:L:r:W:O:R:P:f:i:l:s:d:D:g:A:"))
+		!= -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				config->firstPort = atoi(optarg);
+				break;
+			case 'n':
+				config->numSock = atoi(optarg);
+				break;
+			case 'b':
+				config->batchSize = atoi(optarg);
+				break;
+			case 'w':
+				config->workNsec = atol(optarg);
+				break;
+			case 'k':
+				config->shards = atoi(optarg);
+				break;
+			case 'C':
+				config->numCpus = parseCpuList(optarg, &config->cpus);
+				break;
+			case 'F':
+				config->flowAffinity = true;
+				break;
+			case 'S':
+				config->statsPort = atoi(optarg);
+				break;
+			case 'L':
+				logLevel = parseLogLevel(optarg);
+				break;
+			case 'r':
+				config->routeFile = optarg;
+				break;
+			case 'W':
+				if (parseWeights(optarg, config->weights) == -1)
+				{
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'O':
+				config->numPolicies = parsePolicyList(optarg, 
+					&config->policies);
+				break;
+			case 'R':
+				config->rcvBuf = atoi(optarg);
+				break;
+			case 'P':
+				config->workers = atoi(optarg);
+				break;
+			case 'f':
+				config->flowCapacity = atoi(optarg);
+				break;
+			case 'i':
+				config->flowIdle = atoi(optarg);
+				break;
+			case 'l':
+				config->numPortLimits = parseRateList(optarg, 
+					&config->portLimits);
+				break;
+			case 's':
+				config->numSrcLimits = parseRateList(optarg, 
+					&config->srcLimits);
+				break;
+			case 'd':
+				config->captureFile = optarg;
+				break;
+			case 'D':
+				config->spoolDir = optarg;
+				break;
+			case 'g':
+				config->configFile = optarg;
+				break;
+			case 'A':
+				parseContexts(optarg, config);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p first port] [-n sockets] "
+					"[-b batch size] [-w simulated work per packet in ns] "
+					"[-k shards per port] [-C cpu list] [-F] "
+					"[-S stats port] [-L error|warn|info|debug] "
+					"[-r route file] [-W weights of classes 1-%d] "
+					"[-O block|drop-newest|drop-oldest|spool per port] "
+					"[-R receive buffer bytes] [-P processing workers] "
+					"[-f flow table slots] [-i flow idle seconds] "
+					"[-l port rate[:burst],...] [-s sender rate[:burst],...] "
+					"[-d capture file] [-D spool directory] "
+					"[-g config file] [-A reassembly contexts[:timeout ms]]\n",
+					argv[0], NUMCLASSES - 1);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (config->numSock < 1 || config->numSock > MAXSOCK ||
+		config->firstPort < 1 || config->firstPort + config->numSock > 65536)
+	{
+		fprintf(stderr, "Invalid port range: %d sockets from port %d\n",
+			config->numSock, config->firstPort);
+		exit(EXIT_FAILURE);
+	}
+	if (config->batchSize < 1 || config->batchSize > MAXBATCH || 
+		config->workNsec < 0)
+	{
+		fprintf(stderr, "Batch size must be 1 to %d, work must be >= 0\n", 
+			MAXBATCH);
+		exit(EXIT_FAILURE);
+	}
+	if (config->shards < 1 || config->shards > MAXSHARDS)
+	{
+		fprintf(stderr, "Shards per port must be 1 to %d\n", MAXSHARDS);
+		exit(EXIT_FAILURE);
+	}
+	if (config->workers < 0 || config->workers > MAXWORKERS)
+	{
+		fprintf(stderr, "Processing workers must be 0 to %d\n", MAXWORKERS);
+		exit(EXIT_FAILURE);
+	}
+	if (config->flowCapacity > FLOW_MAXCAPACITY || config->flowIdle < 1)
+	{
+		fprintf(stderr, "Flow table slots must be up to %u, idle time >= 1\n",
+			FLOW_MAXCAPACITY);
+		exit(EXIT_FAILURE);
+	}
+	if (config->spaceContexts < 1 || 
+		config->spaceContexts > CCSDS_MAXCONTEXTS || config->spaceTimeout < 1)
+	{
+		fprintf(stderr, "Reassembly contexts must be 1 to %d, timeout >= 1\n",
+			CCSDS_MAXCONTEXTS);
+		exit(EXIT_FAILURE);
+	}
+	/* Readers wait for the processor unless told to drop */
+	if (config->numPolicies == 0)
+	{
+		config->numPolicies = parsePolicyList("block", &config->policies);
+	}
+}
+
+int parseWeights(const char *list, int weights[])
+{
+	/* Comma separated weights of classes 1, 2, ... */
+	int used;
+	for (int cls = 1; cls < NUMCLASSES; cls++)
+	{
+		if (sscanf(list, "%d%n", &weights[cls], &used) != 1 || 
+			weights[cls] < 1)
+		{
+			fprintf(stderr, "Weights must be %d integers >= 1\n", 
+				NUMCLASSES - 1);
+			return -1;
+		}
+		list += used;
+		if (*list == ',')
+		{
+			list += 1;
+		}
+	}
+	return 0;
+}
+
+int parsePolicyList(const char *list, int **policies)
+{
+	char *copy = strdup(list), *save, *word;
+	int count = 0;
+	*policies = NULL;
+	for (word = strtok_r(copy, ",", &save); word != NULL; 
+		word = strtok_r(NULL, ",", &save))
+	{
+		int policy = policyByName(word);
+		if (policy == -1 || 
+			(*policies = realloc(*policies, (count + 1)*sizeof(int))) == NULL)
+		{
+			fprintf(stderr, "Unknown overload policy %s\n", word);
+			exit(EXIT_FAILURE);
+		}
+		(*policies)[count++] = policy;
+	}
+	free(copy);
+	return count;
+}
+
+int parseCpuList(const char *list, int **cpus)
+{
+	/* Comma separated CPU numbers, ranges written as first-last */
+	int count = 0, capacity = 16, first, last, used;
+	int *out = malloc(capacity*sizeof(int));
+	while (out != NULL && *list != '\0')
+	{
+		if (sscanf(list, "%d%n", &first, &used) != 1 || first < 0)
+		{
+			fprintf(stderr, "Invalid CPU list near: %s\n", list);
+			exit(EXIT_FAILURE);
+		}
+		list += used;
+		last = first;
+		if (*list == '-')
+		{
+			list += 1;
+			if (sscanf(list, "%d%n", &last, &used) != 1 || last < first)
+			{
+				fprintf(stderr, "Invalid CPU range near: %s\n", list);
+				exit(EXIT_FAILURE);
+			}
+			list += used;
+		}
+		for (int cpu = first; cpu <= last && out != NULL; cpu++)
+		{
+			if (count == capacity)
+			{
+				capacity *= 2;
+				out = realloc(out, capacity*sizeof(int));
+			}
+			if (out != NULL)
+			{
+				out[count++] = cpu;
+			}
+		}
+		if (*list == ',')
+		{
+			list += 1;
+		}
+	}
+	if (out == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	*cpus = out;
+	return count;
+}
+
+void setReusePort(int fd)
+{
+	/* Every shard socket must set the option before bind() */
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+	{
+		perror("SO_REUSEPORT failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void attachFlowFilter(int fd, int shards)
+{
+	/*
+	** Classic BPF run by the kernel for each datagram of the port. It 
+	** hashes the IPv4 source address and UDP source port (the packet data 
+	** starts after the UDP header, so both are read relative to the 
+	** network header) and returns the shard index, which is the position 
+	** of the socket in the reuseport group - the order shards were bound.
+	*/
+	struct sock_filter code[] = {
+		/* A = source address */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		/* X = A */
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		/* A = source port - assumes no IPv4 options */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 20),
+		/* A = ((A ^ X) * golden ratio) >> 16 */
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 2654435761U),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		/* return A % shards */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len 	= sizeof(code)/sizeof(code[0]),
+		.filter = code,
+	};
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, 
+		sizeof(prog)) == -1)
+	{
+		perror("SO_ATTACH_REUSEPORT_CBPF failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void setNonBlocking(int fd)
+{
+	/* Keep existing flags and add O_NONBLOCK */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		perror("fcntl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void raiseFdLimit(int numSock)
+{
+	struct rlimit limit;
+	/* Leave room for stdio and the epoll descriptor */
+	rlim_t needed = numSock + 16;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed)
+	{
+		return;
+	}
+	/* Soft limit can only be raised as far as the hard limit */
+	limit.rlim_cur = (needed < limit.rlim_max) ? needed : limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+	{
+		perror("setrlimit failed");
+	}
+}
+
+void enqueueWait(packetQueue *queue, uint32_t *slots, unsigned n, 
+	DATA_statsSlot *counters)
+{
+	/* Back off briefly while the processor frees slots */
+	struct timespec backoff = {0, 100000};
+	unsigned added;
+	while ((added = enqueue_n(queue, slots, n)) < n)
+	{
+		slots += added;
+		n -= added;
+		statAdd(counters, STAT_STALLS, 1);
+		nanosleep(&backoff, NULL);
+	}
+}
+
+void attachSlots(DATA_pthread *self, unsigned n)
+{
+	/* Back off briefly while every slot is queued or being processed */
+	struct timespec backoff = {0, 100000};
+	for (unsigned i = 0; i < n; i++)
+	{
+		while ((self->rxSlots[i] = poolAlloc(self->pool)) == POOL_NONE)
+		{
+			statAdd(self->stats, STAT_STALLS, 1);
+			nanosleep(&backoff, NULL);
+		}
+		DATA_poolSlot *slot = poolSlot(self->pool, self->rxSlots[i]);
+		attachBatchSlot(self->batch, i, slot->data, PKT_MAXSIZE, &slot->src);
+	}
+}
+
+int validateSlots(DATA_pthread *self, int n)
+{
+	/* Check headers in place, then the trailers of the whole batch */
+	const DATA_packetHeader *packets[MAXBATCH];
+	uint32_t rejected[MAXBATCH];
+	int valid = 0, dropped = 0, limited = 0;
+	for (int i = 0; i < n; i++)
+	{
+		DATA_poolSlot *slot = poolSlot(self->pool, self->rxSlots[i]);
+		packets[i] = checkPacket(slot->data, slot->len);
+	}
+	unsigned corrupt = verifyTrailers(packets, n);
+	/* One clock read per batch serves the flow table and the limits */
+	uint64_t now = statsClock();
+	/* Keep admitted slots in arrival order */
+	for (int i = 0; i < n; i++)
+	{
+		DATA_poolSlot *slot = poolSlot(self->pool, self->rxSlots[i]);
+		const DATA_packetHeader *packet = packets[i];
+		if (packet == NULL)
+		{
+			rejected[dropped++] = self->rxSlots[i];
+			continue;
+		}
+		DATA_flowEntry *flow = flowTouch(self->flows, &slot->src, self->port, 
+			packet, slot->len, now, self->stats);
+		/* Dropped before it can take a place in the port's queue */
+		if (!rateCheck(&self->srcLimit, flow, &self->portLimit, now, 
+			self->stats))
+		{
+			rejected[dropped++] = self->rxSlots[i];
+			limited += 1;
+			continue;
+		}
+		self->rxSlots[valid++] = self->rxSlots[i];
+	}
+	if (dropped > 0)
+	{
+		poolFreeN(self->pool, rejected, dropped);
+		statAdd(self->stats, STAT_INVALID, dropped - limited - corrupt);
+		statAdd(self->stats, STAT_CORRUPT, corrupt);
+	}
+	return valid;
+}
+
+void enqueueClasses(DATA_pthread *self, int n)
+{
+	/* Split the batch by priority class, keeping arrival order */
+	uint32_t byClass[NUMCLASSES][MAXBATCH];
+	unsigned count[NUMCLASSES] = {0};
+	uint64_t now = statsClock();
+	for (int i = 0; i < n; i++)
+	{
+		DATA_poolSlot *slot = poolSlot(self->pool, self->rxSlots[i]);
+		unsigned cls = packetClass((const DATA_packetHeader *) slot->data);
+		slot->rxNsec = now;
+		byClass[cls][count[cls]++] = self->rxSlots[i];
+	}
+	/* Critical packets are published first */
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		if (count[cls] > 0)
+		{
+			enqueuePolicy(self, self->buffers[cls], byClass[cls], count[cls]);
+			statMax(self->stats, STAT_QUEUE_HWM, 
+				queueSize(self->buffers[cls]));
+		}
+	}
+}
+
+/*
+** Hands slots to a queue under the port's overload policy. Every packet 
+** that does not make it is returned to the pool and counted as a drop.
+*/
+void enqueuePolicy(DATA_pthread *self, packetQueue *queue, uint32_t *slots, 
+	unsigned n)
+{
+	uint32_t evicted[MAXBATCH];
+	unsigned added = enqueue_n(queue, slots, n), dropped;
+	if (added == n)
+	{
+		return;
+	}
+	switch (self->policy)
+	{
+		case POLICY_BLOCK:
+			enqueueWait(queue, slots + added, n - added, self->stats);
+			break;
+		case POLICY_DROPNEWEST:
+			poolFreeN(self->pool, slots + added, n - added);
+			statAdd(self->stats, STAT_DROPS, n - added);
+			break;
+		case POLICY_DROPOLDEST:
+			/* Make room by evicting the oldest queued packets */
+			while (added < n)
+			{
+				dropped = evict_n(queue, evicted, n - added);
+				poolFreeN(self->pool, evicted, dropped);
+				statAdd(self->stats, STAT_DROPS, dropped);
+				added += enqueue_n(queue, slots + added, n - added);
+			}
+			break;
+		case POLICY_SPOOL:
+			/* Later packets of the port follow these through the spool */
+			spoolSlots(self, slots + added, n - added);
+			break;
+	}
+}
+
+/*
+** Copies packets to the end of the reader's spool and frees their slots.
+** A packet that finds every segment in use is dropped. Cancellation is 
+** held off so the main thread never stops a reader mid-record.
+*/
+void spoolSlots(DATA_pthread *self, uint32_t *slots, unsigned n)
+{
+	int state;
+	unsigned spooled = 0;
+	uint64_t now = statsClock();
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	for (unsigned i = 0; i < n; i++)
+	{
+		DATA_poolSlot *slot = poolSlot(self->pool, slots[i]);
+		spooled += spoolAppend(self->spool, now, &slot->src, slot->data, 
+			slot->len);
+	}
+	spoolSync(self->spool, now);
+	pthread_setcancelstate(state, NULL);
+	poolFreeN(self->pool, slots, n);
+	statAdd(self->stats, STAT_SPOOLED, spooled);
+	statAdd(self->stats, STAT_DROPS, n - spooled);
+}
+
+/*
+** Moves spooled packets, oldest first, into the class queues while their
+** queues have room and the pool has slots. Stops at the first packet that
+** does not fit, so the order of the port is kept. Returns the number of
+** packets still spooled.
+*/
+uint64_t drainSpool(DATA_pthread *self)
+{
+	DATA_spool *spool = self->spool;
+	uint32_t byClass[NUMCLASSES][SPOOL_DRAIN];
+	unsigned count[NUMCLASSES] = {0}, room[NUMCLASSES], moved = 0, invalid = 0;
+	const DATA_spoolRecord *record;
+	uint64_t now = statsClock();
+	int state;
+	if (spool->records == 0)
+	{
+		spoolSync(spool, now);
+		return 0;
+	}
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		room[cls] = self->buffers[cls]->capacity - 
+			queueSize(self->buffers[cls]);
+	}
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	while (moved + invalid < SPOOL_DRAIN && (record = spoolPeek(spool)) != NULL)
+	{
+		/* Segments of an earlier run are checked again */
+		const DATA_packetHeader *packet = checkPacket(record->data, 
+			record->len);
+		if (packet == NULL || verifyTrailers(&packet, 1) > 0)
+		{
+			spoolPop(spool);
+			invalid += 1;
+			continue;
+		}
+		unsigned cls = packetClass(packet);
+		uint32_t index;
+		if (count[cls] == room[cls] || 
+			(index = poolAlloc(self->pool)) == POOL_NONE)
+		{
+			break;
+		}
+		DATA_poolSlot *slot = poolSlot(self->pool, index);
+		slot->len 	= record->len;
+		slot->src 	= record->src;
+		/* Time spent in the spool counts as queueing delay - a record from
+		   before a reboot is stamped now */
+		slot->rxNsec = (record->rxNsec <= now) ? record->rxNsec : now;
+		memcpy(slot->data, record->data, record->len);
+		byClass[cls][count[cls]++] = index;
+		spoolPop(spool);
+		moved += 1;
+	}
+	spoolSync(spool, now);
+	pthread_setcancelstate(state, NULL);
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		if (count[cls] > 0)
+		{
+			enqueue_n(self->buffers[cls], byClass[cls], count[cls]);
+		}
+	}
+	statAdd(self->stats, STAT_UNSPOOLED, moved);
+	statAdd(self->stats, STAT_INVALID, invalid);
+	return spool->records;
+}
+
+void wakeConsumer(void)
+{
+	/*
+	** Pairs with waitForPackets(): the tail store in enqueue_n() is ordered
+	** before this load, so either the sleeper sees the packets on its
+	** re-check or this thread sees it asleep and posts the eventfd.
+	*/
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&consumerSleeping) && 
+		atomic_exchange(&consumerSleeping, 0))
+	{
+		uint64_t one = 1;
+		write(wakefd, &one, sizeof(one));
+	}
+}
+
+void waitForPackets(void)
+{
+	uint64_t count;
+	/* Announce the sleep, then re-check so no enqueue is missed */
+	atomic_store(&consumerSleeping, 1);
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		for (int cls = 0; cls < NUMCLASSES; cls++)
+		{
+			if (!isEmpty(threads[mainTable->readers[k]].buffers[cls]))
+			{
+				atomic_store(&consumerSleeping, 0);
+				return;
+			}
+		}
+	}
+	/* Blocks until a reader or a signal handler posts the eventfd */
+	read(wakefd, &count, sizeof(count));
+	atomic_store(&consumerSleeping, 0);
+}
+
+void serveSlots(int i, int cls, uint32_t *slots, unsigned n)
+{
+	for (unsigned p = 0; p < n; p++)
+	{
+		sched.bytes[cls] += poolSlot(threads[i].pool, slots[p])->len;
+	}
+	sched.packets[cls] += n;
+	/* Process here, or leave it to the workers in scheduled order */
+	if (numWorkers == 0)
+	{
+		processSlots(&workers[0], i, slots, n);
+	}
+	else
+	{
+		dispatchSlots(i, slots, n);
+	}
+}
+
+int drainCritical(void)
+{
+	uint32_t slots[DRAINBATCH];
+	int total = 0;
+	/* Strict priority - no deficit, take whatever is queued */
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		int i = mainTable->readers[k];
+		/* A port's new reader waits until the old one's queues are empty */
+		if (threads[i].waiting)
+		{
+			continue;
+		}
+		unsigned n = dequeue_n(threads[i].buffers[0], slots, DRAINBATCH);
+		if (n > 0)
+		{
+			serveSlots(i, 0, slots, n);
+			total += n;
+		}
+	}
+	return total;
+}
+
+int serveClass(int cls)
+{
+	uint32_t slots[DRAINBATCH], slot;
+	int total = 0, backlogged = 0;
+	/* One quantum per turn, scaled by the class weight */
+	sched.deficit[cls] += (long) sched.weights[cls]*DRR_QUANTUM;
+	/* Visit the class queue of every reader once, from the cursor */
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		int pos = sched.cursor[cls], i = mainTable->readers[pos];
+		packetQueue *queue = threads[i].buffers[cls];
+		unsigned n = 0;
+		if (threads[i].waiting)
+		{
+			sched.cursor[cls] = (pos + 1 == mainTable->count) ? 0 : pos + 1;
+			continue;
+		}
+		/* Take packets while the deficit covers the one at the head */
+		while (n < DRAINBATCH && peek(queue, &slot))
+		{
+			unsigned len = poolSlot(threads[i].pool, slot)->len;
+			if (len > sched.deficit[cls])
+			{
+				break;
+			}
+			/* A drop-oldest reader may have evicted the peeked slot */
+			if (dequeue_n(queue, &slots[n], 1) == 0)
+			{
+				break;
+			}
+			sched.deficit[cls] -= poolSlot(threads[i].pool, slots[n++])->len;
+		}
+		if (n > 0)
+		{
+			serveSlots(i, cls, slots, n);
+			total += n;
+		}
+		if (!isEmpty(queue))
+		{
+			if (n < DRAINBATCH)
+			{
+				/* Deficit used up - this queue is first on the next turn */
+				return total;
+			}
+			backlogged = 1;
+		}
+		sched.cursor[cls] = (pos + 1 == mainTable->count) ? 0 : pos + 1;
+	}
+	/* A class whose queues emptied keeps no credit, as in DRR */
+	if (!backlogged)
+	{
+		sched.deficit[cls] = 0;
+	}
+	return total;
+}
+
+int drainBuffers(int *packetsProcessed)
+{
+	/* Critical class first, and again after every other class's turn */
+	int total = drainCritical();
+	for (int cls = 1; cls < NUMCLASSES; cls++)
+	{
+		total += serveClass(cls);
+		total += drainCritical();
+	}
+	if (total > 0)
+	{
+		*packetsProcessed += total;
+		LOG(LOG_DEBUG, "%d Packets processed.\n", *packetsProcessed);
+	}
+	return total;
+}
+
+/*
+** Sets up the processing contexts. Without workers the main thread 
+** processes inline through workers[0]; with them every worker gets an 
+** inbox for the buckets the main thread schedules and a deque of its own.
+*/
+void createWorkers(DATA_routerConfig *config)
+{
+	int contexts = (config->workers > 0) ? config->workers : 1;
+	numWorkers = config->workers;
+	workers = calloc(contexts, sizeof(DATA_worker));
+	if (workers == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int w = 0; w < contexts; w++)
+	{
+		workers[w].id 		= w;
+		workers[w].workNsec = config->workNsec;
+		workers[w].forward 	= createForward(FORWARDBATCH);
+		workers[w].assembled = createSpaceHeld(reasm);
+		/* Slots are claimed as ports are opened */
+		workers[w].stats 	= calloc(MAXSOCK, sizeof(DATA_statsSlot *));
+		if (workers[w].stats == NULL)
+		{
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+		atomic_init(&workers[w].epoch, 0);
+		for (int cls = 0; cls < NUMCLASSES; cls++)
+		{
+			initHistogram(&workers[w].delay[cls]);
+		}
+	}
+	if (numWorkers == 0)
+	{
+		return;
+	}
+	buckets = aligned_alloc(CACHELINE, WORK_BUCKETS*sizeof(DATA_flowBucket));
+	if (buckets == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&workersStop, 0);
+	for (int b = 0; b < WORK_BUCKETS; b++)
+	{
+		atomic_init(&buckets[b].scheduled, 0);
+		buckets[b].ring = createQueue(WORK_BUCKETDEPTH);
+	}
+	/* Deques and inboxes all exist before any worker can steal */
+	for (int w = 0; w < numWorkers; w++)
+	{
+		/* A bucket is in one inbox or deque at a time - these never fill */
+		workers[w].inbox = createQueue(WORK_BUCKETS);
+		workers[w].deque = createDeque(WORK_BUCKETS);
+	}
+	for (int w = 0; w < numWorkers; w++)
+	{
+		int createret;
+		if ((createret = pthread_create(&workers[w].tid, NULL, *runWorker, 
+			&workers[w])) != 0)
+		{
+			errno = createret;
+			perror("thread failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	LOG(LOG_INFO, "Created %d processing workers, %d flow buckets\n", 
+		numWorkers, WORK_BUCKETS);
+}
+
+/*
+** Sets up reader slot i for one shard of a port and starts its thread.
+** With prev set the reader takes over prev's socket, flows, spool and 
+** rate limits, and the main thread serves it only once prev's queues are
+** empty, so the port keeps its order across the handover.
+*/
+void startReader(DATA_routerConfig *config, int i, int port, int shard, 
+	int fd, unsigned capacity, int policy, int prev)
+{
+	DATA_pthread *thread = &threads[i];
+	DATA_pthread *old = (prev >= 0) ? &threads[prev] : NULL;
+	thread->threadnum 	= i;
+	thread->port 		= port;
+	thread->shard 		= shard;
+	thread->fd 			= fd;
+	thread->capacity 	= capacity;
+	thread->policy 		= policy;
+	thread->prev 		= prev;
+	thread->waiting 	= (old != NULL);
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		thread->buffers[cls] = createQueue(capacity);
+		thread->buffers[cls]->overwrite = (policy == POLICY_DROPOLDEST);
+	}
+	thread->batch 		= createBatch(config->batchSize, MSG_RECVD);
+	/* Enough slots for full queues, a receive batch, a drain and the
+	   slots held by the workers */
+	thread->pool 		= createPool(NUMCLASSES*thread->buffers[0]->capacity + 
+		config->batchSize + DRAINBATCH + ((numWorkers > 0) ? WORK_INFLIGHT : 0));
+	atomic_init(&thread->inflight, 0);
+	thread->rxSlots 	= malloc(config->batchSize*sizeof(uint32_t));
+	if (thread->rxSlots == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	if (old != NULL)
+	{
+		/* Senders, their limits and spooled packets stay with the port */
+		thread->flows 		= old->flows;
+		thread->spool 		= old->spool;
+		thread->portLimit 	= old->portLimit;
+		thread->srcLimit 	= old->srcLimit;
+		old->flows 			= NULL;
+		old->spool 			= NULL;
+	}
+	else
+	{
+		thread->flows 		= createFlows(readerFlows, config->flowIdle);
+		thread->spool 		= NULL;
+		/* Shards split the port's rate; senders keep their own limit */
+		thread->portLimit 	= rateLimitFor(config->portLimits, 
+			config->numPortLimits, port);
+		thread->portLimit.interval *= config->shards;
+		if (thread->portLimit.window < thread->portLimit.interval)
 		{
-			/* Assign thread num from global data as local thread num */
-			thread = threads[i].threadnum;
+			thread->portLimit.window = thread->portLimit.interval;
 		}
+		thread->srcLimit 	= rateLimitFor(config->srcLimits, 
+			config->numSrcLimits, port);
 	}
-	/* Is thread is still -1, no thread id matches global data */
-	if (thread < 0)
+	/* Segments left by the last run are picked up before any read */
+	if (thread->spool == NULL && policy == POLICY_SPOOL)
 	{
-		printf("No matching thread\n");
+		thread->spool = createSpool(config->spoolDir, 
+			config->firstPort + port, shard);
+		LOG(LOG_INFO, "Port %d shard %d: %lu packets spooled\n", 
+			config->firstPort + port, shard, thread->spool->records);
+	}
+	/* A port shard keeps its counters across the readers it is given */
+	DATA_statsSlot **counters = &readerStats[port*config->shards + shard];
+	if (*counters == NULL)
+	{
+		*counters = statsSlot(stats, "reader", i, port);
+	}
+	thread->stats = *counters;
+	/* Each reader owns an epoll instance watching its shard socket and the
+	   eventfd it is retired with */
+	struct epoll_event event;
+	event.events 	= EPOLLIN | EPOLLET;
+	event.data.u32 	= i;
+	if ((thread->epfd = epoll_create1(0)) == -1 ||
+		(thread->retirefd = eventfd(0, EFD_NONBLOCK)) == -1 ||
+		epoll_ctl(thread->epfd, EPOLL_CTL_ADD, fd, &event) == -1 ||
+		epoll_ctl(thread->epfd, EPOLL_CTL_ADD, thread->retirefd, 
+		&event) == -1)
+	{
+		perror("epoll setup failed");
 		exit(EXIT_FAILURE);
 	}
-	/* Init packet for reading into */
-	DATA_stdPacket packet;
-	/* Get length of client address for recvfrom function */
-	int len = sizeof(struct sockaddr_in);
-	/* Loop receiving packets */
-	while(1)
-	{
-		/* Pend on UDP socket for packet */
-		recvfrom(threads[thread].fd, &packet, 
-				sizeof(DATA_stdPacket), MSG_WAITALL, 
-				(struct sockaddr *) &threads[thread].clientAddr, &len);
-		printf("Thread %d: received packet\n", thread);
-		/* Decrement my buffer semaphore to indicate filling buffer */
-		sem_wait(&buffers_sem[thread]);
-		/* Attain lock for accessing buffer queue */
-		pthread_mutex_lock(&buffers_mutex[thread]);
-		/* Add packet to buffer queue */
-		enqueue(threads[thread].buffer, packet);
-		/* Release lock */
-		pthread_mutex_unlock(&buffers_mutex[thread]);
-	}
-	/* Close file descriptor upo exit of thread */
-	close(threads[thread].fd);
-	pthread_exit(0);
+	atomic_store(&thread->state, READER_RUNNING);
+	/* Pin the reader to the next CPU of the list, if one was given */
+	int createret;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	pthread_attr_init(&attr);
+	thread->cpu = -1;
+	if (config->numCpus > 0)
+	{
+		thread->cpu = config->cpus[i % config->numCpus];
+		CPU_ZERO(&cpuset);
+		CPU_SET(thread->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+	}
+	/* pthread_create() returns 0 on success - check for error */
+	if ((createret = pthread_create(&thread->tid, &attr, *readSocket, 
+		thread)) != 0)
+	{
+		errno = createret;
+		perror("thread failed");
+		exit(EXIT_FAILURE);
+	}
+	pthread_attr_destroy(&attr);
+	LOG(LOG_INFO, "Created new thread %d: port %d shard %d cpu %d%s\n", 
+		i, config->firstPort + port, shard, thread->cpu, 
+		thread->pool->hugePages ? " hugepages" : "");
 }
 
-/*==========================================================================
-** MAIN PROCESS
-**==========================================================================*/
-int main(void)
+/*
+** Binds a socket for every shard of a port and starts their readers,
+** appending them to readers. Returns -1 with nothing opened when the port
+** cannot be bound or no reader or statistics slots are left for it.
+*/
+int openPort(DATA_routerConfig *config, int port, unsigned capacity, 
+	int policy, int *readers, int *count)
 {
-	/* Init array to hold socket file descriptors */
-	int fds[NUMSOCK];
-	/* Create a buffer queue for each client */
-	for (int buffer = 0; buffer < NUMSOCK; buffer++)
+	int fds[MAXSHARDS], slots[MAXSHARDS], found = 0;
+	int contexts = (numWorkers > 0) ? numWorkers : 1;
+	/* Counters are claimed once per port shard and processing context */
+	unsigned needed = 
+		((readerStats[port*config->shards] == NULL) ? config->shards : 0) +
+		((workers[0].stats[port] == NULL) ? contexts : 0);
+	for (int i = 0; i < numThreads && found < config->shards; i++)
+	{
+		if (atomic_load(&threads[i].state) == READER_FREE)
+		{
+			slots[found++] = i;
+		}
+	}
+	if (found < config->shards || 
+		atomic_load(&stats->numSlots) + needed > stats->maxSlots)
 	{
-		buffers[buffer] = createQueue(MAXBUFFER);
-		printf("Buffer Pointer: %d ->%p\n", buffer, buffers[buffer]);
+		LOG(LOG_ERROR, "Port %d: no room left for its readers\n", 
+			config->firstPort + port);
+		return -1;
 	}
-	/* Init table to hold client and server addresses */
-	struct sockaddr_in addrTbl[NUMADDR];
-	/* Init server addresses */
-	initServAddrs(addrTbl);
-	/* Start binding the first server address */
-	int servAddr = FIRST_SERVADDR;
-	/* Create and bind socket for each file descriptor */
-	for (int fd = 0; fd < NUMSOCK; fd++)
+	for (int shard = 0; shard < config->shards; shard++)
 	{
 		/* Create the socket */
-		fds[fd] = createSocket();
-		/* Bind socket to server address */
-		bindSocket(fds[fd], servAddr, addrTbl);
-		/* Move to next server address in address table */
-		servAddr += NEXTADDR;
+		fds[shard] = createSocket();
+		/* Shards of one port share it through SO_REUSEPORT */
+		if (config->shards > 1)
+		{
+			setReusePort(fds[shard]);
+		}
+		/* Bind socket to server address - binding order is shard order */
+		if (bind(fds[shard], 
+			(struct sockaddr *) &addrTbl[FIRST_SERVADDR + port*NEXTADDR], 
+			sizeof(struct sockaddr_in)) == -1)
+		{
+			perror("bind failed");
+			for (int s = 0; s <= shard; s++)
+			{
+				close(fds[s]);
+			}
+			return -1;
+		}
+		/* Event loop reads until the socket would block */
+		setNonBlocking(fds[shard]);
+		/* Kernel drops are reported with each datagram */
+		enableKernelDrops(fds[shard]);
+		if (config->rcvBuf > 0)
+		{
+			int size = setReceiveBuffer(fds[shard], config->rcvBuf);
+			LOG(LOG_INFO, "Port %d shard %d: receive buffer %d bytes\n", 
+				config->firstPort + port, shard, size);
+		}
 	}
-	/* Int to store return from pthread_create */
-	int createret;
-	/* Int to store index in address table */
-	int tblIndex = FIRST_CLIENTADDR;
-	/* Create socket reading threads */
-	for (int i = 0; i < NUMSOCK; i++)
+	/* Keep each client flow on one shard once the group is complete */
+	if (config->shards > 1 && config->flowAffinity)
 	{
-		/* pthread_create() returns 0 on success - check for error */
-		if ((createret = pthread_create(&threads[i].tid, NULL, 
-			*readSocket, NULL)) != 0)
+		attachFlowFilter(fds[0], config->shards);
+	}
+	for (int w = 0; w < contexts; w++)
+	{
+		if (workers[w].stats[port] == NULL)
 		{
-			perror("thread failed");
-			exit(EXIT_FAILURE);
+			workers[w].stats[port] = statsSlot(stats, "processor", w, port);
 		}
-		printf("Created new thread.\n");
-		/* Assign data to global thread data */
-		threads[i].threadnum 	= i;
-		threads[i].fd 			= fds[i];
-		threads[i].buffer 		= buffers[i];
-		threads[i].clientAddr 	= addrTbl[i+tblIndex];
-		/* Init semaphore to keep track of filling buffer */
-		sem_init(&buffers_sem[i], 0, MAXBUFFER);
-		/* Move to next client address in the address table */
-		tblIndex += NEXTADDR;
-	}
-	/* Packet for processing data from buffer queue */
-	DATA_stdPacket packet;
-	/* Tally of packets processed */
-	int packetsProcessed = 0;
-	/* Do work with incoming packets at 500 mHz */
-	while(1)
+	}
+	for (int shard = 0; shard < config->shards; shard++)
+	{
+		startReader(config, slots[shard], port, shard, fds[shard], capacity, 
+			policy, -1);
+		readers[(*count)++] = slots[shard];
+	}
+	LOG(LOG_INFO, "Port %d: open, queues of %u, %s\n", 
+		config->firstPort + port, capacity, policyNames[policy]);
+	return 0;
+}
+
+/*
+** Asks a reader to stop after its current batch and joins it, leaving
+** everything it received in its queues. Gives up once the router stops -
+** a reader blocked on a full queue only moves while the main thread 
+** drains - and leaves the reader to the exit path.
+*/
+int retireReader(int i)
+{
+	DATA_pthread *thread = &threads[i];
+	struct timespec deadline;
+	uint64_t one = 1;
+	atomic_store(&thread->state, READER_RETIRING);
+	write(thread->retirefd, &one, sizeof(one));
+	while (running)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += RELOAD_POLLMSEC*1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec 	+= 1;
+			deadline.tv_nsec 	-= 1000000000L;
+		}
+		if (pthread_timedjoin_np(thread->tid, NULL, &deadline) == 0)
+		{
+			/* The queues only shrink from here - see updateReaders() */
+			atomic_store(&thread->state, READER_STOPPED);
+			wakeConsumer();
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Drained and in no table - its socket was passed on or closed already */
+void freeReader(int i)
+{
+	DATA_pthread *thread = &threads[i];
+	close(thread->epfd);
+	close(thread->retirefd);
+	for (int cls = 0; cls < NUMCLASSES; cls++)
+	{
+		freeQueue(thread->buffers[cls]);
+	}
+	freePool(thread->pool);
+	freeBatch(thread->batch);
+	free(thread->rxSlots);
+	if (thread->flows != NULL)
+	{
+		freeFlows(thread->flows);
+	}
+	atomic_store(&thread->state, READER_FREE);
+}
+
+/*
+** Publishes a table of readers, routes and weights with one pointer 
+** store, then frees the table it replaced - with its routes unless they
+** are shared - once no processing thread can still hold it. Returns -1
+** without freeing anything when the router stops first.
+*/
+int publishTable(int *readers, int count, DATA_routeTable *routes, 
+	const int weights[])
+{
+	DATA_portTable *table = malloc(sizeof(DATA_portTable));
+	if (table == NULL || (table->readers = malloc(((count > 0) ? count : 1)*
+		sizeof(int))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(table->readers, readers, count*sizeof(int));
+	table->count 	= count;
+	table->routes 	= routes;
+	memcpy(table->weights, weights, sizeof(table->weights));
+	DATA_portTable *old = atomic_exchange(&portTable, table);
+	uint64_t epoch = atomic_fetch_add(&tableEpoch, 1) + 1;
+	if (old == NULL)
+	{
+		return 0;
+	}
+	if (waitForEpoch(epoch) == -1)
+	{
+		return -1;
+	}
+	if (old->routes != routes)
+	{
+		freeRoutes(old->routes);
+	}
+	free(old->readers);
+	free(old);
+	return 0;
+}
+
+/*
+** Waits until the main thread and every worker have reported epoch, 
+** which each does only while it holds no table.
+*/
+int waitForEpoch(uint64_t epoch)
+{
+	struct timespec backoff = {0, RELOAD_POLLMSEC*1000000L};
+	while (running)
+	{
+		bool seen = (atomic_load(&mainEpoch) >= epoch);
+		for (int w = 0; w < numWorkers && seen; w++)
+		{
+			seen = (atomic_load(&workers[w].epoch) >= epoch);
+		}
+		if (seen)
+		{
+			return 0;
+		}
+		/* The main thread reports at the top of its loop - it may sleep */
+		wakeConsumer();
+		nanosleep(&backoff, NULL);
+	}
+	return -1;
+}
+
+/*
+** Main thread, once per loop. A stopped reader with empty queues is 
+** marked drained for the reloader to free, then the readers that took a
+** drained one's socket over are served. Both happen in the same pass, so
+** a slot is never freed while a reader still waits on it.
+*/
+void updateReaders(void)
+{
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		DATA_pthread *thread = &threads[mainTable->readers[k]];
+		bool empty = true;
+		if (thread->waiting || 
+			atomic_load(&thread->state) != READER_STOPPED)
+		{
+			continue;
+		}
+		for (int cls = 0; cls < NUMCLASSES; cls++)
+		{
+			empty = empty && isEmpty(thread->buffers[cls]);
+		}
+		if (empty)
+		{
+			atomic_store(&thread->state, READER_DRAINED);
+		}
+	}
+	for (int k = 0; k < mainTable->count; k++)
+	{
+		DATA_pthread *thread = &threads[mainTable->readers[k]];
+		if (thread->waiting && 
+			atomic_load(&threads[thread->prev].state) == READER_DRAINED)
+		{
+			thread->waiting = false;
+		}
+	}
+}
+
+/*==========================================================================
+** RELOADER THREAD ENTRY
+**==========================================================================*/
+void *runReloader(void *args)
+{
+	DATA_routerConfig *config = (DATA_routerConfig *) args;
+	struct pollfd reload = {reloadfd, POLLIN, 0};
+	uint64_t count;
+	bool pending = false;
+	while (running)
+	{
+		/* Poll while retired readers wait to be freed, sleep otherwise */
+		if (poll(&reload, 1, pending ? RELOAD_POLLMSEC : -1) > 0)
+		{
+			read(reloadfd, &count, sizeof(count));
+			if (running)
+			{
+				LOG(LOG_INFO, "Reloading %s\n", (config->configFile != NULL) ?
+					config->configFile : "the command line");
+				reloadConfig(config);
+			}
+		}
+		pending = collectReaders();
+	}
+	pthread_exit(0);
+}
+
+/*
+** Re-reads the config file and applies it. Routes, weights and the log
+** level change with the next table. A removed port's readers are retired
+** and its sockets closed; a port whose queue size or policy changed moves
+** to new readers that take its sockets over, so datagrams wait in the 
+** socket buffer meanwhile instead of being lost. A file or route error 
+** leaves everything as it is.
+*/
+void reloadConfig(DATA_routerConfig *config)
+{
+	DATA_fileConfig next;
+	DATA_routeTable *routes;
+	if (readConfigFile(config, &next) == -1)
+	{
+		LOG(LOG_ERROR, "Reload failed - configuration unchanged\n");
+		return;
+	}
+	if ((routes = readRoutes(next.routeFile)) == NULL)
+	{
+		freeConfigFile(&next);
+		LOG(LOG_ERROR, "Reload failed - configuration unchanged\n");
+		return;
+	}
+	if (next.logLevel != -1)
+	{
+		atomic_store(&logLevel, next.logLevel);
+	}
+	DATA_portTable *old = atomic_load(&portTable);
+	int *readers = malloc(numThreads*sizeof(int)), count = 0;
+	int opened = 0, closed = 0, moved = 0;
+	if (readers == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int k = 0; k < old->count && running; k++)
 	{
-		/* Loop through each buffer queue */
-		for (int i = 0; i < NUMSOCK; i++)
+		int i = old->readers[k], j = -1;
+		DATA_pthread *thread = &threads[i];
+		int port = thread->port;
+		/* Retired readers stay in the table until they are drained */
+		readers[count++] = i;
+		if (atomic_load(&thread->state) != READER_RUNNING ||
+			(next.queues[port] == thread->capacity && 
+			next.policies[port] == thread->policy))
+		{
+			continue;
+		}
+		if (next.queues[port] > 0)
 		{
-			/* Attain lock before accessing shared buffer */
-			pthread_mutex_lock(&buffers_mutex[i]);
-			/* If the buffer is empty, no data to process */
-			if (isEmpty(threads[i].buffer))
+			for (j = 0; j < numThreads && 
+				atomic_load(&threads[j].state) != READER_FREE; j++)
+			{
+			}
+			if (j == numThreads)
 			{
-				/* Release lock */
-				pthread_mutex_unlock(&buffers_mutex[i]);
+				LOG(LOG_ERROR, "Port %d: no reader slot free, unchanged\n", 
+					config->firstPort + port);
 				continue;
 			}
-			else
+		}
+		if (retireReader(i) == -1)
+		{
+			break;
+		}
+		if (j == -1)
+		{
+			/* Undrained spooled packets wait on disk for the port to return */
+			close(thread->fd);
+			if (thread->spool != NULL)
 			{
-				/* Take a packet from the buffer queue */
-				packet = dequeue(threads[i].buffer);
-				printf("Packet dequeued from thread %d\n", i);
-				/* Signal that a packet can be enqueued */
-				sem_post(&buffers_sem[i]);
-				/* Release lock */
-				pthread_mutex_unlock(&buffers_mutex[i]);
-				/* Do something with the packet - print data */
-				processPacket(&packet);
-				packetsProcessed += 1;
-				printf("%d Packets processed.\n", packetsProcessed);
+				closeSpool(thread->spool, statsClock());
+				thread->spool = NULL;
 			}
+			closed += 1;
+			continue;
 		}
-		/* Simulate main thread working slower than reading threads */
-		sleep(2);
+		startReader(config, j, port, thread->shard, thread->fd, 
+			next.queues[port], next.policies[port], i);
+		readers[count++] = j;
+		moved += 1;
 	}
-	/* Join threads when finished */
-	for (int i = 0; i < NUMSOCK; i++)
+	for (int port = 0; port < MAXSOCK && running; port++)
 	{
-		pthread_join(threads[i].tid, NULL);
+		if (next.queues[port] > 0 && portConfig.queues[port] == 0)
+		{
+			if (openPort(config, port, next.queues[port], 
+				next.policies[port], readers, &count) == -1)
+			{
+				/* Still closed - the next reload tries again */
+				next.queues[port] = 0;
+				continue;
+			}
+			opened += 1;
+		}
 	}
-	exit(EXIT_SUCCESS);
+	freeConfigFile(&portConfig);
+	portConfig = next;
+	publishTable(readers, count, routes, next.weights);
+	free(readers);
+	LOG(LOG_INFO, "Reloaded: %d ports opened, %d readers closed, %d moved, "
+		"%u message IDs routed\n", opened, closed, moved, routes->numRoutes);
+}
+
+/*
+** Takes the drained readers no worker holds a slot of out of the table
+** and frees them once no processing thread can see them. Returns true
+** while retired readers are left to free.
+*/
+bool collectReaders(void)
+{
+	DATA_portTable *old = atomic_load(&portTable);
+	/* One element at least, so an empty table still allocates */
+	int size = (old->count > 0) ? old->count : 1;
+	int *readers = calloc(size, sizeof(int)), count = 0;
+	int *freed = calloc(size, sizeof(int)), numFreed = 0;
+	bool pending = false;
+	if (readers == NULL || freed == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int k = 0; k < old->count; k++)
+	{
+		int i = old->readers[k], state = atomic_load(&threads[i].state);
+		if (state == READER_DRAINED && atomic_load(&threads[i].inflight) == 0)
+		{
+			freed[numFreed++] = i;
+			continue;
+		}
+		readers[count++] = i;
+		pending = pending || state == READER_STOPPED || 
+			state == READER_DRAINED;
+	}
+	if (numFreed > 0 && 
+		publishTable(readers, count, old->routes, old->weights) == 0)
+	{
+		for (int f = 0; f < numFreed; f++)
+		{
+			freeReader(freed[f]);
+		}
+		LOG(LOG_DEBUG, "Freed %d retired readers\n", numFreed);
+	}
+	free(readers);
+	free(freed);
+	return pending;
 }
 
 /*==========================================================================
-** FUNCTION DEFINITIONS
+** PROCESSING WORKER THREAD ENTRY
 **==========================================================================*/
-void initServAddrs(struct sockaddr_in addrTbl[])
+void *runWorker(void *args)
+{
+	DATA_worker *self = (DATA_worker *) args;
+	/* Yield while work may show up soon, then sleep in short steps */
+	struct timespec backoff = {0, 50000};
+	int idle = 0;
+	while (1)
+	{
+		/* Between buckets no table is held - an older one may be freed */
+		atomic_store(&self->epoch, atomic_load(&tableEpoch));
+		uint32_t b = takeBucket(self);
+		if (b == DEQUE_EMPTY)
+		{
+			if (atomic_load(&workersStop))
+			{
+				break;
+			}
+			if (++idle < WORK_SPINS)
+			{
+				sched_yield();
+			}
+			else
+			{
+				nanosleep(&backoff, NULL);
+			}
+			continue;
+		}
+		idle = 0;
+		serveBucket(self, b);
+	}
+	pthread_exit(0);
+}
+
+void processSlots(DATA_worker *self, int i, uint32_t *slots, unsigned n)
+{
+	uint64_t start = statsClock();
+	DATA_statsSlot *counters = self->stats[threads[i].port];
+	/* Held until the next bucket, see runWorker() */
+	DATA_routeTable *routes = atomic_load(&portTable)->routes;
+	for (unsigned p = 0; p < n; p++)
+	{
+		DATA_poolSlot *slot = poolSlot(threads[i].pool, slots[p]);
+		const DATA_packetHeader *packet = (const DATA_packetHeader *) slot->data;
+		/* Time from the reader's receive to now is the queueing delay */
+		recordHistogram(&self->delay[packetClass(packet)], 
+			start - slot->rxNsec);
+		/* A segment waits for the rest of its space packet, and the last
+		   one routes the whole packet */
+		if (packetIsSpace(packet) && 
+			spaceSeqFlags(packetSpace(packet)) != CCSDS_UNSEGMENTED)
+		{
+			packet = reassembleSpace(reasm, packet, &slot->src, 
+				threads[i].port, start, self->assembled, counters);
+		}
+		/* Route the packet in place by port, APID or message ID */
+		if (packet != NULL)
+		{
+			routePacket(routes, self->forward, packet, 
+				stats->firstPort + threads[i].port, counters);
+		}
+		/* Model a slower processor without sleeping */
+		simulateWork(self->workNsec);
+	}
+	/* Forwards and handler batches point into the slots - deliver them 
+	   before freeing */
+	flushForward(self->forward);
+	/* Space packets finished in this run are held until then too */
+	releaseAssembled(reasm, self->assembled);
+	statAdd(counters, STAT_PROC_NSEC, statsClock() - start);
+	statAdd(counters, STAT_PROCESSED, n);
+	self->packets += n;
+	/* Return the whole run to the reader's pool at once */
+	poolFreeN(threads[i].pool, slots, n);
+}
+
+/*
+** Appends slots to the bucket of their flow - source address and port on
+** the reader's port - and schedules every bucket that was idle on its home
+** worker. Packets of one flow stay in arrival order because a bucket is 
+** only ever processed by the one worker that holds it.
+*/
+void dispatchSlots(int i, uint32_t *slots, unsigned n)
+{
+	struct timespec backoff = {0, 20000};
+	uint32_t touched[DRAINBATCH];
+	unsigned numTouched = 0;
+	/* Keep the reader's pool from running dry under the workers */
+	while (atomic_load_explicit(&threads[i].inflight, memory_order_relaxed) + 
+		n > WORK_INFLIGHT)
+	{
+		nanosleep(&backoff, NULL);
+	}
+	atomic_fetch_add_explicit(&threads[i].inflight, n, memory_order_relaxed);
+	for (unsigned p = 0; p < n; p++)
+	{
+		DATA_poolSlot *slot = poolSlot(threads[i].pool, slots[p]);
+		uint32_t b = ((ntohl(slot->src.sin_addr.s_addr)*31 + 
+			ntohs(slot->src.sin_port))*31 + threads[i].port)*0x9E3779B1U;
+		b = (b >> 16) & (WORK_BUCKETS - 1);
+		uint32_t entry = ((uint32_t) i << WORK_SLOTBITS) | slots[p];
+		/* A full bucket means its flow is ahead of the workers - wait */
+		while (enqueue_n(buckets[b].ring, &entry, 1) == 0)
+		{
+			scheduleBucket(b);
+			nanosleep(&backoff, NULL);
+		}
+		if (numTouched == 0 || touched[numTouched - 1] != b)
+		{
+			touched[numTouched++] = b;
+		}
+	}
+	for (unsigned t = 0; t < numTouched; t++)
+	{
+		scheduleBucket(touched[t]);
+	}
+}
+
+/* Posts a bucket with packets to its home worker unless one holds it */
+void scheduleBucket(uint32_t b)
+{
+	/* Pairs with the fence in serveBucket() - no bucket is left unserved */
+	atomic_thread_fence(memory_order_seq_cst);
+	int idle = 0;
+	if (atomic_load_explicit(&buckets[b].scheduled, memory_order_relaxed) == 0 
+		&& atomic_compare_exchange_strong(&buckets[b].scheduled, &idle, 1))
+	{
+		enqueue_n(workers[b % numWorkers].inbox, &b, 1);
+	}
+}
+
+/*
+** Moves newly scheduled buckets into the own deque and pops the newest.
+** An idle worker steals the oldest bucket of another worker, taking every
+** flow of that bucket with it.
+*/
+uint32_t takeBucket(DATA_worker *self)
+{
+	uint32_t posted[DRAINBATCH];
+	unsigned n;
+	while ((n = dequeue_n(self->inbox, posted, DRAINBATCH)) > 0)
+	{
+		for (unsigned k = 0; k < n; k++)
+		{
+			dequePush(self->deque, posted[k]);
+		}
+	}
+	uint32_t b = dequePop(self->deque);
+	if (b != DEQUE_EMPTY)
+	{
+		return b;
+	}
+	for (int k = 1; k < numWorkers; k++)
+	{
+		DATA_worker *victim = &workers[(self->id + k) % numWorkers];
+		if ((b = dequeSteal(victim->deque)) != DEQUE_EMPTY)
+		{
+			self->steals += 1;
+			return b;
+		}
+	}
+	return DEQUE_EMPTY;
+}
+
+void serveBucket(DATA_worker *self, uint32_t b)
+{
+	uint32_t entries[DRAINBATCH], slots[DRAINBATCH];
+	DATA_flowBucket *bucket = &buckets[b];
+	unsigned n = dequeue_n(bucket->ring, entries, DRAINBATCH);
+	self->turns += 1;
+	/* Process runs of one reader's slots - they share a pool */
+	for (unsigned start = 0; start < n; )
+	{
+		int i = entries[start] >> WORK_SLOTBITS;
+		unsigned run = 0;
+		while (start + run < n && (int) (entries[start + run] >> 
+			WORK_SLOTBITS) == i)
+		{
+			slots[run] = entries[start + run] & WORK_SLOTMASK;
+			run += 1;
+		}
+		processSlots(self, i, slots, run);
+		atomic_fetch_sub_explicit(&threads[i].inflight, run, 
+			memory_order_relaxed);
+		start += run;
+	}
+	/* Still backlogged - keep it, behind whatever else is queued here */
+	if (!isEmpty(bucket->ring))
+	{
+		dequePush(self->deque, b);
+		return;
+	}
+	/* Let go, then re-check for packets added before the release */
+	atomic_store(&bucket->scheduled, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+	int idle = 0;
+	if (!isEmpty(bucket->ring) &&
+		atomic_compare_exchange_strong(&bucket->scheduled, &idle, 1))
+	{
+		dequePush(self->deque, b);
+	}
+}
+
+void printWorkerStats(void)
+{
+	for (int w = 0; w < numWorkers; w++)
+	{
+		printf("Worker %d: %lu packets in %lu bucket turns, %lu steals\n", 
+			w, workers[w].packets, workers[w].turns, workers[w].steals);
+	}
+	for (int w = 0; w < ((numWorkers > 0) ? numWorkers : 1); w++)
+	{
+		printForwardStats(workers[w].forward);
+	}
+}
+
+void simulateWork(long nsec)
+{
+	if (nsec <= 0)
+	{
+		return;
+	}
+	/* Busy-wait so the knob costs CPU time like real processing would */
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec)*1000000000L + 
+		(now.tv_nsec - start.tv_nsec) < nsec);
+}
+
+void initServAddrs(struct sockaddr_in addrTbl[], int firstPort, int numSock)
 {
 	/*
 	** Init socket addresses - two for each two-way communication 
@@ -206,16 +2112,16 @@ void initServAddrs(struct sockaddr_in addrTbl[])
 	**		4. Client Address 2
 	*/
 	/* Init memory for all addresses */
-	memset(addrTbl, 0, NUMADDR*sizeof(struct sockaddr_in));
+	memset(addrTbl, 0, SERVMODE*numSock*sizeof(struct sockaddr_in));
 	/*
-	** Provide data for each address
+	** Provide data for each server address - ports are consecutive
 	*/
-	/* Address 1 */
-	addrTbl[0].sin_port = htons(PORT1);
-	addrTbl[0].sin_addr.s_addr = HOST;
-	/* Address 2 */
-	addrTbl[2].sin_port = htons(PORT2);
-	addrTbl[2].sin_addr.s_addr = HOST;
+	for (int i = 0; i < numSock; i++)
+	{
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_family = AF_INET;
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_port = htons(firstPort + i);
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_addr.s_addr = HOST;
+	}
 }
 
 int createSocket()
@@ -230,7 +2136,7 @@ int createSocket()
 	}
 	else
 	{
-		printf("New Socket: %d\n", fd);
+		LOG(LOG_INFO, "New Socket: %d\n", fd);
 		return fd;
 	}
 }
@@ -247,19 +2153,25 @@ void bindSocket(int fd, int servAddr, struct sockaddr_in addrTbl[])
 
 void processPacket(DATA_stdPacket *packet)
 {
-	printf("Client says:\n\t\t%c\n\t\t%c\n\t\t%hhu\n\t\t%hhu\n",
+	LOG(LOG_DEBUG, "Client says:\n\t\t%c\n\t\t%c\n\t\t%hhu\n\t\t%hhu\n",
 			packet->firstChar,
 			packet->secondChar,
 			packet->firstNum,
 			packet->secondNum);
 }
 
-int getMax(int array[])
+void processSpacePacket(const DATA_spaceHeader *space)
+{
+	LOG(LOG_DEBUG, "Space packet APID %u, sequence count %u, %u bytes\n",
+			spaceApid(space),
+			spaceSeqCount(space),
+			spaceLength(space));
+}
+
+int getMax(int array[], int nums)
 {
 	/* Init max it to store result */
 	int max = 0;
-	/* Get total numbers in array */
-	int nums = sizeof(&array)/sizeof(array[0]);
 	/* Loop through each num and compare to max */
 	for (int i = 0; i < nums; i++)
 	{
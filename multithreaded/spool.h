@@ -0,0 +1,340 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <dirent.h>
+#include "../data_types.h"
+#include "../checksum.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Directory of the segment files unless changed with -D */
+#define SPOOL_DIR			"spool"
+/* Size of one segment file, and segments per reader before it drops */
+#define SPOOL_SEGSIZE		(16UL*1024*1024)
+#define SPOOL_MAXSEGS		64
+/* First record offset - the header is padded to a cache line */
+#define SPOOL_HDRSIZE		64
+#define SPOOL_MAGIC			0x53504455U
+#define SPOOL_VERSION		2
+/* Written data is flushed once this much is pending or this old */
+#define SPOOL_SYNCBYTES		(1UL*1024*1024)
+#define SPOOL_SYNCNSEC		10000000ULL
+/* Reader poll interval while its spool holds packets or unsynced data */
+#define SPOOL_POLLMSEC		1
+/* Records moved back to the queues per drain */
+#define SPOOL_DRAIN			256
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+void spoolPath(DATA_spool *spool, uint64_t seq, char *path, size_t size)
+{
+	snprintf(path, size, "%s/spool-%d-%d-%06lu.seg", spool->dir, spool->port,
+		spool->shard, (unsigned long) seq);
+}
+
+/*
+** CRC32C of a record's length, offset, header fields and data. Dirty
+** pages reach the disk in no fixed order, so after a crash a record can
+** have its length on disk and not its data - only a check over the whole
+** record tells the two apart.
+*/
+uint32_t spoolCheck(const DATA_spoolRecord *record, uint32_t len,
+	size_t offset)
+{
+	uint64_t seed[2] = {(uint64_t) len << 32 | SPOOL_MAGIC, offset};
+	uint32_t crc = crc32c(0, (const char *) seed, sizeof(seed));
+	return crc32c(crc, (const char *) &record->rxNsec,
+		sizeof(DATA_spoolRecord) - offsetof(DATA_spoolRecord, rxNsec) + len);
+}
+
+size_t spoolRecordSize(uint32_t len)
+{
+	return (sizeof(DATA_spoolRecord) + len + 7) & ~7UL;
+}
+
+DATA_spoolSegment *spoolOldest(DATA_spool *spool)
+{
+	return &spool->segs[spool->first];
+}
+
+DATA_spoolSegment *spoolNewest(DATA_spool *spool)
+{
+	return &spool->segs[(spool->first + spool->count - 1) % SPOOL_MAXSEGS];
+}
+
+/* Maps a segment file, creating it at full size when create is set */
+bool spoolMap(DATA_spool *spool, uint64_t seq, bool create)
+{
+	char path[PATH_MAX];
+	spoolPath(spool, seq, path, sizeof(path));
+	DATA_spoolSegment *seg = &spool->segs[(spool->first + spool->count) %
+		SPOOL_MAXSEGS];
+	struct stat st;
+	seg->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+	if (seg->fd == -1 || (create && ftruncate(seg->fd, SPOOL_SEGSIZE) == -1) ||
+		fstat(seg->fd, &st) == -1 || st.st_size != (off_t) SPOOL_SEGSIZE ||
+		(seg->map = mmap(NULL, SPOOL_SEGSIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+	{
+		perror(path);
+		if (seg->fd != -1)
+		{
+			close(seg->fd);
+		}
+		return false;
+	}
+	DATA_spoolHeader *header = (DATA_spoolHeader *) seg->map;
+	if (create)
+	{
+		header->magic 		= SPOOL_MAGIC;
+		header->version 	= SPOOL_VERSION;
+		header->seq 		= seq;
+		header->readOffset 	= SPOOL_HDRSIZE;
+	}
+	else if (header->magic != SPOOL_MAGIC || header->version != SPOOL_VERSION ||
+		header->readOffset < SPOOL_HDRSIZE ||
+		header->readOffset > SPOOL_SEGSIZE)
+	{
+		fprintf(stderr, "%s: not a spool segment\n", path);
+		munmap(seg->map, SPOOL_SEGSIZE);
+		close(seg->fd);
+		return false;
+	}
+	seg->seq 			= seq;
+	seg->readOffset 	= header->readOffset;
+	/* The data ends at the first record that was never completely written */
+	seg->writeOffset 	= seg->readOffset;
+	for (DATA_spoolRecord *record = (DATA_spoolRecord *) (seg->map +
+		seg->writeOffset); seg->writeOffset + sizeof(DATA_spoolRecord) <=
+		SPOOL_SEGSIZE && record->len > 0 && record->len <= PKT_MAXSIZE &&
+		seg->writeOffset + spoolRecordSize(record->len) <= SPOOL_SEGSIZE &&
+		record->check == spoolCheck(record, record->len, seg->writeOffset);
+		record = (DATA_spoolRecord *) (seg->map + seg->writeOffset))
+	{
+		seg->writeOffset += spoolRecordSize(record->len);
+		spool->records += 1;
+		spool->recovered += 1;
+	}
+	spool->count += 1;
+	spool->nextSeq = (seq + 1 > spool->nextSeq) ? seq + 1 : spool->nextSeq;
+	spool->synced = seg->writeOffset;
+	return true;
+}
+
+/* Deletes drained segments from the front, always keeping the newest */
+void spoolRelease(DATA_spool *spool)
+{
+	char path[PATH_MAX];
+	for (DATA_spoolSegment *seg = spoolOldest(spool); spool->count > 1 &&
+		seg->readOffset == seg->writeOffset; seg = spoolOldest(spool))
+	{
+		spoolPath(spool, seg->seq, path, sizeof(path));
+		munmap(seg->map, SPOOL_SEGSIZE);
+		close(seg->fd);
+		unlink(path);
+		spool->first = (spool->first + 1) % SPOOL_MAXSEGS;
+		spool->count -= 1;
+	}
+}
+
+int compareSeq(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+** Opens the spool of one reader. Segments left by an earlier run of the
+** same port and shard are mapped again in order, and their undrained
+** records are queued ahead of any new packet.
+*/
+DATA_spool *createSpool(const char *dir, int port, int shard)
+{
+	DATA_spool *spool = calloc(1, sizeof(DATA_spool));
+	if (spool == NULL || (spool->dir = strdup(dir)) == NULL ||
+		(spool->segs = calloc(SPOOL_MAXSEGS, sizeof(DATA_spoolSegment)))
+		== NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	spool->port 	= port;
+	spool->shard 	= shard;
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		perror("spool directory");
+		exit(EXIT_FAILURE);
+	}
+	/* Collect the sequence numbers of this reader's segments */
+	DIR *listing = opendir(dir);
+	if (listing == NULL)
+	{
+		perror("spool directory");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t seqs[SPOOL_MAXSEGS];
+	unsigned found = 0;
+	struct dirent *entry;
+	while ((entry = readdir(listing)) != NULL)
+	{
+		int p, s, used = 0;
+		unsigned long seq;
+		if (sscanf(entry->d_name, "spool-%d-%d-%lu.seg%n", &p, &s, &seq,
+			&used) == 3 && entry->d_name[used] == '\0' && p == port &&
+			s == shard)
+		{
+			if (found == SPOOL_MAXSEGS)
+			{
+				fprintf(stderr, "Too many spool segments for port %d\n", port);
+				exit(EXIT_FAILURE);
+			}
+			seqs[found++] = seq;
+		}
+	}
+	closedir(listing);
+	qsort(seqs, found, sizeof(uint64_t), compareSeq);
+	for (unsigned i = 0; i < found; i++)
+	{
+		if (!spoolMap(spool, seqs[i], false))
+		{
+			exit(EXIT_FAILURE);
+		}
+	}
+	spoolRelease(spool);
+	if (spool->count == 0 && !spoolMap(spool, spool->nextSeq, true))
+	{
+		exit(EXIT_FAILURE);
+	}
+	return spool;
+}
+
+/* Flushes what was written or drained since the last flush */
+void spoolFlush(DATA_spool *spool, uint64_t now)
+{
+	DATA_spoolSegment *seg = spoolNewest(spool);
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = spool->synced & ~(page - 1);
+	if (seg->writeOffset > start &&
+		msync(seg->map + start, seg->writeOffset - start, MS_SYNC) == -1)
+	{
+		perror("spool msync");
+	}
+	/* Drain progress lives in the header of the oldest segment */
+	if (msync(spoolOldest(spool)->map, page, MS_SYNC) == -1)
+	{
+		perror("spool msync");
+	}
+	spool->synced 	= seg->writeOffset;
+	spool->dirty 	= false;
+	spool->lastSync = now;
+	spool->syncs 	+= 1;
+}
+
+/* Flushes once enough data is pending or the oldest of it is too old */
+void spoolSync(DATA_spool *spool, uint64_t now)
+{
+	if (spool->dirty && (now - spool->lastSync >= SPOOL_SYNCNSEC ||
+		spoolNewest(spool)->writeOffset - spool->synced >= SPOOL_SYNCBYTES))
+	{
+		spoolFlush(spool, now);
+	}
+}
+
+/*
+** Appends one packet to the newest segment, starting a new one when it
+** is full. Returns false when all SPOOL_MAXSEGS segments are in use.
+*/
+bool spoolAppend(DATA_spool *spool, uint64_t rxNsec,
+	const struct sockaddr_in *src, const char *data, uint32_t len)
+{
+	DATA_spoolSegment *seg = spoolNewest(spool);
+	size_t size = spoolRecordSize(len);
+	if (seg->writeOffset + size > SPOOL_SEGSIZE)
+	{
+		spoolRelease(spool);
+		if (spool->count == SPOOL_MAXSEGS)
+		{
+			spool->full += 1;
+			return false;
+		}
+		/* The segment left behind is complete - flush it before moving on */
+		spoolFlush(spool, rxNsec);
+		if (!spoolMap(spool, spool->nextSeq, true))
+		{
+			spool->full += 1;
+			return false;
+		}
+		seg = spoolNewest(spool);
+	}
+	DATA_spoolRecord *record = (DATA_spoolRecord *) (seg->map +
+		seg->writeOffset);
+	record->rxNsec = rxNsec;
+	record->src = *src;
+	memcpy(record->data, data, len);
+	/* Length and check last - recovery takes the record only if the check
+	   matches everything that reached the disk */
+	record->check = spoolCheck(record, len, seg->writeOffset);
+	record->len = len;
+	seg->writeOffset += size;
+	spool->records += 1;
+	spool->dirty = true;
+	return true;
+}
+
+/* Oldest undrained record, NULL when the spool is empty */
+const DATA_spoolRecord *spoolPeek(DATA_spool *spool)
+{
+	if (spool->records == 0)
+	{
+		return NULL;
+	}
+	DATA_spoolSegment *seg = spoolOldest(spool);
+	if (seg->readOffset == seg->writeOffset)
+	{
+		spoolRelease(spool);
+		seg = spoolOldest(spool);
+	}
+	return (const DATA_spoolRecord *) (seg->map + seg->readOffset);
+}
+
+/* Drops the record returned by spoolPeek() */
+void spoolPop(DATA_spool *spool)
+{
+	DATA_spoolSegment *seg = spoolOldest(spool);
+	const DATA_spoolRecord *record = (const DATA_spoolRecord *) (seg->map +
+		seg->readOffset);
+	seg->readOffset += spoolRecordSize(record->len);
+	((DATA_spoolHeader *) seg->map)->readOffset = seg->readOffset;
+	spool->records -= 1;
+	spool->dirty = true;
+}
+
+/* Flushes the spool for the next run, reports what it holds and frees it */
+void closeSpool(DATA_spool *spool, uint64_t now)
+{
+	spoolFlush(spool, now);
+	printf("Spool port %d shard %d: %lu recovered, %lu left in %u "
+		"segments, %lu msyncs, %lu dropped full\n", spool->port, spool->shard,
+		spool->recovered, (unsigned long) spool->records, spool->count,
+		spool->syncs, spool->full);
+	for (unsigned i = 0; i < spool->count; i++)
+	{
+		DATA_spoolSegment *seg = &spool->segs[(spool->first + i) %
+			SPOOL_MAXSEGS];
+		munmap(seg->map, SPOOL_SEGSIZE);
+		close(seg->fd);
+	}
+	free(spool->segs);
+	free(spool->dir);
+	free(spool);
+}
+
+#endif
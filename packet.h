@@ -0,0 +1,186 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <endian.h>
+#include <arpa/inet.h>
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Header version written by this build and the only one accepted */
+#define PKT_VERSION			1
+/* Smallest header - a packet with no payload */
+#define PKT_HDRSIZE			((unsigned) sizeof(DATA_packetHeader))
+/* Message ID sent by the load generator unless -m is given */
+#define PKT_DEFAULT_MSGID	0x0800
+/* Message ID of the acknowledgements routers send back to senders */
+#define PKT_ACK_MSGID		0xFFFF
+/* Low bits of flags - the priority class, 0 = critical */
+#define PKT_CLASSMASK		(NUMCLASSES - 1)
+/* Flags bit - the datagram ends in a CRC32C of everything before it */
+#define PKT_FLAG_CRC		0x0004
+#define PKT_TRAILERSIZE		4
+/* Flags bit - the payload is one CCSDS space packet or segment of one */
+#define PKT_FLAG_CCSDS		0x0008
+/* CCSDS primary header size, and the APIDs its 11 bits can name */
+#define CCSDS_HDRSIZE		6
+#define CCSDS_APIDS			2048
+/* Sequence flags of a segment */
+#define CCSDS_SEG_CONT		0
+#define CCSDS_SEG_FIRST		1
+#define CCSDS_SEG_LAST		2
+#define CCSDS_UNSEGMENTED	3
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+bool checkSpace(const DATA_packetHeader *packet);
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Validates a received datagram in place and returns it as a header, or
+** NULL if it is not a packet of this version. Nothing is copied; receive
+** buffers are 8-byte aligned so the header can be read directly.
+*/
+const DATA_packetHeader *checkPacket(const char *data, unsigned len)
+{
+	const DATA_packetHeader *packet = (const DATA_packetHeader *) data;
+	if (len < PKT_HDRSIZE || packet->version != PKT_VERSION ||
+		packet->hdrLen < PKT_HDRSIZE || (packet->hdrLen & 3) != 0 ||
+		packet->hdrLen > len || ntohs(packet->length) != len ||
+		((ntohs(packet->flags) & PKT_FLAG_CRC) && 
+		packet->hdrLen + PKT_TRAILERSIZE > len) ||
+		((ntohs(packet->flags) & PKT_FLAG_CCSDS) && !checkSpace(packet)))
+	{
+		return NULL;
+	}
+	return packet;
+}
+
+bool packetHasTrailer(const DATA_packetHeader *packet)
+{
+	return (ntohs(packet->flags) & PKT_FLAG_CRC) != 0;
+}
+
+/* CRC32C carried in the last four bytes, see checksum.h */
+uint32_t packetTrailer(const DATA_packetHeader *packet)
+{
+	uint32_t crc;
+	memcpy(&crc, (const char *) packet + ntohs(packet->length) - 
+		PKT_TRAILERSIZE, PKT_TRAILERSIZE);
+	return ntohl(crc);
+}
+
+unsigned packetMsgId(const DATA_packetHeader *packet)
+{
+	return ntohs(packet->msgId);
+}
+
+unsigned packetLength(const DATA_packetHeader *packet)
+{
+	return ntohs(packet->length);
+}
+
+uint32_t packetSeq(const DATA_packetHeader *packet)
+{
+	return ntohl(packet->seq);
+}
+
+uint64_t packetSendNsec(const DATA_packetHeader *packet)
+{
+	return be64toh(packet->sendNsec);
+}
+
+unsigned packetClass(const DATA_packetHeader *packet)
+{
+	return ntohs(packet->flags) & PKT_CLASSMASK;
+}
+
+const char *packetPayload(const DATA_packetHeader *packet)
+{
+	return (const char *) packet + packet->hdrLen;
+}
+
+/* Excludes the trailer, if the packet has one */
+unsigned packetPayloadLen(const DATA_packetHeader *packet)
+{
+	return ntohs(packet->length) - packet->hdrLen - 
+		(packetHasTrailer(packet) ? PKT_TRAILERSIZE : 0);
+}
+
+bool packetIsSpace(const DATA_packetHeader *packet)
+{
+	return (ntohs(packet->flags) & PKT_FLAG_CCSDS) != 0;
+}
+
+/* Primary header of the space packet in the payload, read in place */
+const DATA_spaceHeader *packetSpace(const DATA_packetHeader *packet)
+{
+	return (const DATA_spaceHeader *) packetPayload(packet);
+}
+
+unsigned spaceApid(const DATA_spaceHeader *space)
+{
+	return ntohs(space->streamId) & (CCSDS_APIDS - 1);
+}
+
+unsigned spaceSeqFlags(const DATA_spaceHeader *space)
+{
+	return ntohs(space->sequence) >> 14;
+}
+
+unsigned spaceSeqCount(const DATA_spaceHeader *space)
+{
+	return ntohs(space->sequence) & 0x3FFF;
+}
+
+/* Whole space packet, primary header included */
+unsigned spaceLength(const DATA_spaceHeader *space)
+{
+	return ntohs(space->length) + CCSDS_HDRSIZE + 1;
+}
+
+/* A version 1 space packet (version bits 0) that fills the payload */
+bool checkSpace(const DATA_packetHeader *packet)
+{
+	return packetPayloadLen(packet) >= CCSDS_HDRSIZE &&
+		(ntohs(packetSpace(packet)->streamId) >> 13) == 0 &&
+		spaceLength(packetSpace(packet)) == packetPayloadLen(packet);
+}
+
+/* Writes the fixed fields of a len-byte packet */
+void initHeader(DATA_packetHeader *packet, unsigned msgId, unsigned len)
+{
+	memset(packet, 0, PKT_HDRSIZE);
+	packet->version 	= PKT_VERSION;
+	packet->hdrLen 		= PKT_HDRSIZE;
+	packet->msgId 		= htons(msgId);
+	packet->length 		= htons(len);
+}
+
+void setPacketClass(DATA_packetHeader *packet, unsigned priority)
+{
+	packet->flags = htons((ntohs(packet->flags) & ~PKT_CLASSMASK) | 
+		(priority & PKT_CLASSMASK));
+}
+
+/* Marks the packet as ending in a trailer - sealPacket() writes it */
+void setPacketTrailer(DATA_packetHeader *packet)
+{
+	packet->flags |= htons(PKT_FLAG_CRC);
+}
+
+/* Writes the per-send fields just before the packet leaves */
+void stampHeader(DATA_packetHeader *packet, uint32_t seq, uint64_t sendNsec)
+{
+	packet->seq 		= htonl(seq);
+	packet->sendNsec 	= htobe64(sendNsec);
+}
+
+#endif
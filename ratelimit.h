@@ -0,0 +1,100 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "data_types.h"
+#include "stats.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Packets a limited sender or port may send at once if no burst is given */
+#define RATE_BURST			64
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Parses a comma separated list of "rate[:burst]" in packets/s, one per 
+** port, the last one applying to the remaining ports. A rate of 0 means
+** no limit. Returns the number of limits given.
+*/
+int parseRateList(const char *list, DATA_rateLimit **limits)
+{
+	char *copy = strdup(list), *save, *word, *end;
+	int count = 0;
+	*limits = NULL;
+	for (word = strtok_r(copy, ",", &save); word != NULL; 
+		word = strtok_r(NULL, ",", &save))
+	{
+		double rate = strtod(word, &end);
+		long burst = RATE_BURST;
+		if (*end == ':')
+		{
+			burst = strtol(end + 1, &end, 10);
+		}
+		if (*end != '\0' || rate < 0 || burst < 1 || 
+			(*limits = realloc(*limits, (count + 1)*sizeof(DATA_rateLimit)))
+			== NULL)
+		{
+			fprintf(stderr, "Bad rate limit %s\n", word);
+			exit(EXIT_FAILURE);
+		}
+		DATA_rateLimit *limit = &(*limits)[count++];
+		limit->interval = (rate > 0) ? (uint64_t) (1e9/rate) : 0;
+		limit->window 	= limit->interval*burst;
+		limit->tat 		= 0;
+	}
+	free(copy);
+	return count;
+}
+
+/* Limit of port index port from a parsed list - all zero for no limit */
+DATA_rateLimit rateLimitFor(const DATA_rateLimit *limits, int count, int port)
+{
+	DATA_rateLimit none = {0, 0, 0};
+	return (count == 0) ? none : limits[(port < count) ? port : count - 1];
+}
+
+/*
+** Token bucket in its virtual scheduling form (GCRA): instead of a token
+** count, tat holds the time the next packet is due. A packet is admitted
+** while that schedule is at most burst packets ahead of now, which is the
+** same as a bucket of burst tokens refilled at the rate. One compare and
+** one store per packet.
+*/
+bool rateAllow(const DATA_rateLimit *limit, uint64_t *tat, uint64_t now)
+{
+	if (limit->interval == 0)
+	{
+		return true;
+	}
+	uint64_t next = ((*tat > now) ? *tat : now) + limit->interval;
+	if (next - now > limit->window)
+	{
+		return false;
+	}
+	*tat = next;
+	return true;
+}
+
+/*
+** Checks a valid packet against its sender's limit, then its port's. A 
+** sender over its limit does not use up the port's rate. flow is NULL for
+** a sender the table could not track, which only the port limit applies to.
+*/
+bool rateCheck(const DATA_rateLimit *srcLimit, DATA_flowEntry *flow,
+	DATA_rateLimit *portLimit, uint64_t now, DATA_statsSlot *counters)
+{
+	if ((flow != NULL && !rateAllow(srcLimit, &flow->tat, now)) ||
+		!rateAllow(portLimit, &portLimit->tat, now))
+	{
+		statAdd(counters, STAT_RATE_DROPS, 1);
+		return false;
+	}
+	return true;
+}
+
+#endif
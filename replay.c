@@ -0,0 +1,441 @@
+/*==========================================================================
+** File Name:  	replay.c
+**
+** Title:  	UDP Capture Replay Application
+**
+** $Author:    	Stephen Scott
+** $Revision: 	1.0 $
+** $Date:      	2020-07-11
+**
+** Purpose:  	This application replays a pcap file, such as one written by
+** the router's -d option, against a router. Every datagram goes to the
+** same router port it was captured on, or to the same offset from the -p
+** port, and every original sender gets a socket of its own so flows stay
+** apart. The capture's timing is kept, scaled by -x, unless -F replays
+** the file as fast as possible with sendmmsg() batches.
+**
+** Functions Defined:
+**    parseReplayConfig	- Reads file, host, first port, speed, batch and loops
+**    loadCapture		- Maps the capture and indexes its UDP datagrams
+**    senderSocket		- Maps a captured source address to a socket
+**    replayOnce		- Sends every datagram of the capture once
+**    createSocket 		- Calls to socket() to create a new socket
+**    nowNsec			- Monotonic clock in nanoseconds
+**
+** Modification History:
+**   Date | Author | Description
+**   ---------------------------
+**   2020-07-11 | Stephen Scott | Build #: Code Started
+**
+**==========================================================================*/
+
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include "router.h"
+#include "batch.h"
+#include "capture.h"
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Sockets standing in for captured senders - more senders share them */
+#define REPLAY_SOCKETS		1024
+/* Ethernet header skipped in front of IPv4 with LINKTYPE_ETHERNET */
+#define ETHER_HDRSIZE		14
+#define ETHERTYPE_IPV4		0x0800
+/* Waits longer than this sleep, shorter ones spin */
+#define REPLAY_SPINNSEC		100000
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Cleared by SIGINT/SIGTERM to stop replaying early */
+volatile sig_atomic_t running = 1;
+/* Captured source address of each socket, 0 while unused */
+uint64_t senderKeys[REPLAY_SOCKETS];
+int senderFds[REPLAY_SOCKETS];
+int numSenders = 0;
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+void parseReplayConfig(int argc, char *argv[], DATA_replayConfig *config);
+DATA_replayRecord *loadCapture(const char *path, const char **map,
+	size_t *count, int *lowPort);
+uint32_t senderSocket(uint32_t addr, uint16_t port);
+uint64_t replayOnce(DATA_replayConfig *config, const char *map,
+	DATA_replayRecord *records, size_t count, struct sockaddr_in *ports,
+	uint64_t *bytes);
+uint64_t nowNsec(void);
+
+/*==========================================================================
+** MAIN PROCESS
+**==========================================================================*/
+int main(int argc, char *argv[])
+{
+	/* Read the file and the replay options from the command line */
+	DATA_replayConfig config;
+	parseReplayConfig(argc, argv, &config);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	/* Index the whole file first - nothing is parsed while sending */
+	const char *map;
+	size_t count;
+	int lowPort;
+	DATA_replayRecord *records = loadCapture(config.path, &map, &count,
+		&lowPort);
+	if (count == 0)
+	{
+		fprintf(stderr, "No UDP datagrams in %s\n", config.path);
+		exit(EXIT_FAILURE);
+	}
+	/* Captured ports keep their offset from the lowest one */
+	int firstPort = (config.firstPort > 0) ? config.firstPort : lowPort;
+	struct sockaddr_in *ports = calloc(65536, sizeof(struct sockaddr_in));
+	if (ports == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i + firstPort < 65536; i++)
+	{
+		ports[i].sin_family 	= AF_INET;
+		ports[i].sin_port 		= htons(firstPort + i);
+		if (inet_pton(AF_INET, config.host, &ports[i].sin_addr) != 1)
+		{
+			fprintf(stderr, "Invalid host: %s\n", config.host);
+			exit(EXIT_FAILURE);
+		}
+	}
+	uint64_t sent = 0, bytes = 0;
+	uint64_t start = nowNsec();
+	for (int loop = 0; running && (config.loops == 0 || loop < config.loops);
+		loop++)
+	{
+		sent += replayOnce(&config, map, records, count, ports, &bytes);
+	}
+	double seconds = (nowNsec() - start)/1e9;
+	printf("Replayed %lu datagrams, %lu bytes from %d senders in %.3f s "
+		"(%.0f packets/s)\n", sent, bytes, numSenders, seconds,
+		(seconds > 0) ? sent/seconds : 0);
+	for (int i = 0; i < REPLAY_SOCKETS; i++)
+	{
+		if (senderKeys[i] != 0)
+		{
+			close(senderFds[i]);
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+void handleSignal(int sig)
+{
+	running = 0;
+}
+
+void parseReplayConfig(int argc, char *argv[], DATA_replayConfig *config)
+{
+	/* Defaults replay the file once, to the captured ports, in real time */
+	config->path 		= NULL;
+	config->host 		= "127.0.0.1";
+	config->firstPort 	= 0;
+	config->speed 		= 1.0;
+	config->fast 		= false;
+	config->batchSize 	= BATCHSIZE;
+	config->loops 		= 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:h:p:x:Fb:l:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'f':
+				config->path = optarg;
+				break;
+			case 'h':
+				config->host = optarg;
+				break;
+			case 'p':
+				config->firstPort = atoi(optarg);
+				break;
+			case 'x':
+				config->speed = atof(optarg);
+				break;
+			case 'F':
+				config->fast = true;
+				break;
+			case 'b':
+				config->batchSize = atoi(optarg);
+				break;
+			case 'l':
+				config->loops = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s -f capture file [-h host] "
+					"[-p first port] [-x speed factor] [-F as fast as "
+					"possible] [-b batch size] [-l loops, 0 = forever]\n",
+					argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (config->path == NULL || config->speed <= 0 || config->loops < 0 ||
+		config->firstPort < 0 || config->firstPort > 65535 ||
+		config->batchSize < 1 || config->batchSize > MAXBATCH)
+	{
+		fprintf(stderr, "Invalid replay options\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+** Maps the capture and indexes every IPv4/UDP datagram in it. Nanosecond
+** and microsecond pcap files are read, with raw IPv4 or Ethernet framing;
+** other records are skipped. Returns the index and the lowest UDP
+** destination port seen.
+*/
+DATA_replayRecord *loadCapture(const char *path, const char **map,
+	size_t *count, int *lowPort)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		perror("capture file");
+		exit(EXIT_FAILURE);
+	}
+	size_t size = st.st_size;
+	if (size < PCAP_HDRSIZE || (*map = mmap(NULL, size, PROT_READ,
+		MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "Not a pcap file: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	const uint8_t *base = (const uint8_t *) *map;
+	uint32_t magic, link;
+	memcpy(&magic, base, 4);
+	memcpy(&link, base + 20, 4);
+	if ((magic != PCAP_MAGIC_NSEC && magic != PCAP_MAGIC_USEC) ||
+		(link != LINKTYPE_IPV4 && link != LINKTYPE_RAW &&
+		link != LINKTYPE_ETHERNET))
+	{
+		fprintf(stderr, "Unsupported pcap file: magic %08x link type %u\n",
+			magic, link);
+		exit(EXIT_FAILURE);
+	}
+	uint64_t unit = (magic == PCAP_MAGIC_NSEC) ? 1 : 1000;
+	/* Sized for the worst case of minimum-size records, trimmed after */
+	size_t capacity = size/(PCAP_RECHDRSIZE + CAPTURE_IPHDR +
+		CAPTURE_UDPHDR) + 1;
+	DATA_replayRecord *records = malloc(capacity*sizeof(DATA_replayRecord));
+	if (records == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	size_t n = 0, at = PCAP_HDRSIZE;
+	uint64_t first = 0;
+	*lowPort = 65536;
+	while (at + PCAP_RECHDRSIZE <= size)
+	{
+		uint32_t header[4];
+		memcpy(header, base + at, sizeof(header));
+		size_t caplen = header[2];
+		const uint8_t *ip = base + at + PCAP_RECHDRSIZE;
+		at += PCAP_RECHDRSIZE + caplen;
+		if (at > size)
+		{
+			/* Cut short, as when the writer was killed mid-record */
+			break;
+		}
+		if (link == LINKTYPE_ETHERNET)
+		{
+			if (caplen < ETHER_HDRSIZE ||
+				(ip[12] << 8 | ip[13]) != ETHERTYPE_IPV4)
+			{
+				continue;
+			}
+			ip += ETHER_HDRSIZE;
+			caplen -= ETHER_HDRSIZE;
+		}
+		unsigned ihl = (caplen > 0) ? (ip[0] & 0x0F)*4 : 0;
+		if (caplen < CAPTURE_IPHDR || (ip[0] >> 4) != 4 ||
+			ihl < CAPTURE_IPHDR || ip[9] != IPPROTO_UDP ||
+			caplen < ihl + CAPTURE_UDPHDR)
+		{
+			continue;
+		}
+		const uint8_t *udp = ip + ihl;
+		unsigned len = (udp[4] << 8 | udp[5]);
+		/* Never past what was captured, nor bigger than the router takes */
+		if (len < CAPTURE_UDPHDR || len - CAPTURE_UDPHDR > PKT_MAXSIZE)
+		{
+			continue;
+		}
+		len -= CAPTURE_UDPHDR;
+		if (len > caplen - ihl - CAPTURE_UDPHDR)
+		{
+			len = caplen - ihl - CAPTURE_UDPHDR;
+		}
+		uint64_t nsec = ((uint64_t) header[0]*1000000000ULL) +
+			header[1]*unit;
+		if (n == 0)
+		{
+			first = nsec;
+		}
+		uint32_t srcAddr;
+		memcpy(&srcAddr, ip + 12, 4);
+		int dport = udp[2] << 8 | udp[3];
+		records[n].nsec 	= (nsec > first) ? nsec - first : 0;
+		records[n].offset 	= (const char *) udp + CAPTURE_UDPHDR - *map;
+		records[n].len 		= len;
+		records[n].port 	= dport;
+		records[n].sock 	= senderSocket(srcAddr, udp[0] << 8 | udp[1]);
+		*lowPort = (dport < *lowPort) ? dport : *lowPort;
+		n += 1;
+	}
+	/* Ports are stored relative to the lowest one */
+	for (size_t i = 0; i < n; i++)
+	{
+		records[i].port -= *lowPort;
+	}
+	*count = n;
+	return records;
+}
+
+/*
+** Returns the socket that stands in for a captured sender, creating it on
+** first use. Senders are hashed into REPLAY_SOCKETS slots with linear
+** probing; once every slot is taken, further senders share by hash.
+*/
+uint32_t senderSocket(uint32_t addr, uint16_t port)
+{
+	/* Never 0, which marks an unused slot */
+	uint64_t key = ((uint64_t) addr << 16 | port) | (1ULL << 48);
+	uint32_t home = (uint32_t) ((key*0x9E3779B97F4A7C15ULL) >> 32) &
+		(REPLAY_SOCKETS - 1);
+	for (uint32_t i = 0; i < REPLAY_SOCKETS; i++)
+	{
+		uint32_t slot = (home + i) & (REPLAY_SOCKETS - 1);
+		if (senderKeys[slot] == key)
+		{
+			return slot;
+		}
+		if (senderKeys[slot] == 0)
+		{
+			senderKeys[slot] 	= key;
+			senderFds[slot] 	= createSocket();
+			numSenders += 1;
+			return slot;
+		}
+	}
+	return home;
+}
+
+/*
+** Sends the capture once and returns the datagrams sent, adding their
+** payload bytes to bytes. Datagrams are
+** sent when their scaled capture time is reached; runs of consecutive
+** datagrams from one sender that are due together go in one sendmmsg().
+*/
+uint64_t replayOnce(DATA_replayConfig *config, const char *map,
+	DATA_replayRecord *records, size_t count, struct sockaddr_in *ports,
+	uint64_t *bytes)
+{
+	struct mmsghdr msgs[MAXBATCH];
+	struct iovec iovs[MAXBATCH];
+	memset(msgs, 0, sizeof(msgs));
+	uint64_t sent = 0, start = nowNsec();
+	size_t i = 0;
+	while (running && i < count)
+	{
+		uint64_t now = nowNsec();
+		if (!config->fast)
+		{
+			uint64_t due = start + (uint64_t) (records[i].nsec/config->speed);
+			if (due > now)
+			{
+				/* Sleep for long gaps, spin for short ones */
+				if (due - now > REPLAY_SPINNSEC)
+				{
+					struct timespec ts = {0, (long) (due - now -
+						REPLAY_SPINNSEC/2)};
+					ts.tv_sec 	= ts.tv_nsec/1000000000L;
+					ts.tv_nsec 	%= 1000000000L;
+					nanosleep(&ts, NULL);
+				}
+				continue;
+			}
+		}
+		uint32_t sock = records[i].sock;
+		int n = 0;
+		while (i + n < count && n < config->batchSize &&
+			records[i + n].sock == sock && (config->fast ||
+			start + (uint64_t) (records[i + n].nsec/config->speed) <= now))
+		{
+			DATA_replayRecord *record = &records[i + n];
+			iovs[n].iov_base 				= (void *) (map + record->offset);
+			iovs[n].iov_len 				= record->len;
+			msgs[n].msg_hdr.msg_iov 		= &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen 		= 1;
+			msgs[n].msg_hdr.msg_name 		= &ports[record->port];
+			msgs[n].msg_hdr.msg_namelen 	= sizeof(struct sockaddr_in);
+			n += 1;
+		}
+		/* Keep order within the run - retry what the kernel did not take */
+		int done = 0;
+		while (done < n)
+		{
+			int ret = sendmmsg(senderFds[sock], &msgs[done], n - done, 0);
+			if (ret == -1)
+			{
+				if (errno != EINTR)
+				{
+					/* The first message failed - skip it, send the rest */
+					done += 1;
+				}
+				continue;
+			}
+			for (int k = done; k < done + ret; k++)
+			{
+				*bytes += iovs[k].iov_len;
+			}
+			sent += ret;
+			done += ret;
+		}
+		i += n;
+	}
+	return sent;
+}
+
+uint64_t nowNsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+int createSocket()
+{
+	/* Init fd to store output from socket() */
+	int fd;
+	/* Call socket() and handle errors */
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	else
+	{
+		return fd;
+	}
+}
@@ -0,0 +1,520 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <arpa/inet.h>
+#include "data_types.h"
+#include "stats.h"
+#include "packet.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Message IDs are 16 bits - one table entry each */
+#define ROUTE_IDS			65536
+/* Route entry layout: first destination << ROUTE_COUNTBITS | fan-out */
+#define ROUTE_COUNTBITS		12
+#define ROUTE_COUNTMASK		((1U << ROUTE_COUNTBITS) - 1)
+#define ROUTE_MAXDESTS		(1U << (32 - ROUTE_COUNTBITS))
+/* Destination kinds */
+#define ROUTE_UDP			0
+#define ROUTE_LOCAL			1
+/* msgId of the default route, written as * in the route file */
+#define ROUTE_DEFAULT		-1
+/* Buckets of the table build: message IDs, the default route, ports and
+   APIDs */
+#define ROUTE_PORTKEYS		(ROUTE_IDS + 1)
+#define ROUTE_APIDKEYS		(2*ROUTE_IDS + 1)
+#define ROUTE_KEYS			(ROUTE_APIDKEYS + CCSDS_APIDS)
+/* Datagrams per forwarding sendmmsg() */
+#define FORWARDBATCH		64
+
+/*==========================================================================
+** FUNCTION PROTOTYPES
+**==========================================================================*/
+void routePrint(const DATA_packetHeader **packets, unsigned count);
+void routeDiscard(const DATA_packetHeader **packets, unsigned count);
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/*
+** Handlers a route file may name as local:<name>, indexed by the id the
+** route table stores. More are added with registerHandler().
+*/
+routeHandler routeHandlers[ROUTE_MAXHANDLERS] = {routePrint, routeDiscard};
+const char *routeHandlerNames[ROUTE_MAXHANDLERS] = {"print", "discard"};
+int numRouteHandlers = 2;
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/* Prints the space packet or the demo payload of every packet */
+void routePrint(const DATA_packetHeader **packets, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (packetIsSpace(packets[i]))
+		{
+			processSpacePacket(packetSpace(packets[i]));
+		}
+		else if (packetPayloadLen(packets[i]) >= sizeof(DATA_stdPacket))
+		{
+			processPacket((DATA_stdPacket *) packetPayload(packets[i]));
+		}
+	}
+}
+
+void routeDiscard(const DATA_packetHeader **packets, unsigned count)
+{
+	(void) packets;
+	(void) count;
+}
+
+/*
+** Makes a handler available to route files as local:<name> and returns
+** its id. Startup only, before the routes are read.
+*/
+int registerHandler(const char *name, routeHandler handler)
+{
+	if (numRouteHandlers == ROUTE_MAXHANDLERS)
+	{
+		fprintf(stderr, "More than %d route handlers\n", ROUTE_MAXHANDLERS);
+		exit(EXIT_FAILURE);
+	}
+	routeHandlerNames[numRouteHandlers] = name;
+	routeHandlers[numRouteHandlers] 	= handler;
+	return numRouteHandlers++;
+}
+
+/* Parses "host:port" or "local:handler" into a destination */
+int parseRouteDest(const char *text, DATA_routeDest *dest)
+{
+	char host[64];
+	int port;
+	memset(dest, 0, sizeof(DATA_routeDest));
+	if (strncmp(text, "local:", 6) == 0)
+	{
+		for (int i = 0; i < numRouteHandlers; i++)
+		{
+			if (strcmp(text + 6, routeHandlerNames[i]) == 0)
+			{
+				dest->kind 		= ROUTE_LOCAL;
+				dest->handler 	= i;
+				return 0;
+			}
+		}
+		return -1;
+	}
+	if (sscanf(text, "%63[^:]:%d", host, &port) != 2 || port < 1 ||
+		port > 65535)
+	{
+		return -1;
+	}
+	dest->kind 					= ROUTE_UDP;
+	dest->addr.sin_family 		= AF_INET;
+	dest->addr.sin_port 		= htons(port);
+	return (inet_pton(AF_INET, host, &dest->addr.sin_addr) == 1) ? 0 : -1;
+}
+
+/*
+** Appends the destinations of one route line - "<msgId|*|port:N|apid:N>
+** <dest>..." - to a growing list. Blank lines and # comments add nothing.
+** Returns -1 after printing the error for a bad line.
+*/
+int parseRouteLine(char *line, int lineNo, DATA_routeDest **list,
+	unsigned *count, unsigned *capacity)
+{
+	char *save, *word = strtok_r(line, " \t\r\n", &save);
+	if (word == NULL || word[0] == '#')
+	{
+		return 0;
+	}
+	char *end;
+	long msgId = ROUTE_DEFAULT, port = 0, apid = -1;
+	if (strncmp(word, "apid:", 5) == 0)
+	{
+		/* Space packets of the APID, whatever their message ID */
+		apid = strtol(word + 5, &end, 0);
+		if (*end != '\0' || apid < 0 || apid >= CCSDS_APIDS)
+		{
+			fprintf(stderr, "Route line %d: bad APID %s\n", lineNo, word);
+			return -1;
+		}
+	}
+	else if (strncmp(word, "port:", 5) == 0)
+	{
+		/* Every packet of the router port, whatever its message ID */
+		port = strtol(word + 5, &end, 10);
+		if (*end != '\0' || port < 1 || port >= ROUTE_IDS)
+		{
+			fprintf(stderr, "Route line %d: bad port %s\n", lineNo, word);
+			return -1;
+		}
+	}
+	else if (strcmp(word, "*") != 0)
+	{
+		msgId = strtol(word, &end, 0);
+		if (*end != '\0' || msgId < 0 || msgId >= ROUTE_IDS)
+		{
+			fprintf(stderr, "Route line %d: bad message ID %s\n", lineNo,
+				word);
+			return -1;
+		}
+	}
+	while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL &&
+		word[0] != '#')
+	{
+		if (*count == *capacity)
+		{
+			*capacity = *capacity ? 2*(*capacity) : 64;
+			if ((*list = realloc(*list, *capacity*sizeof(DATA_routeDest)))
+				== NULL)
+			{
+				perror("malloc failed");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (parseRouteDest(word, &(*list)[*count]) == -1)
+		{
+			fprintf(stderr, "Route line %d: bad destination %s\n", lineNo,
+				word);
+			return -1;
+		}
+		(*list)[*count].msgId 	= msgId;
+		(*list)[*count].port 	= port;
+		(*list)[*count].apid 	= apid;
+		*count += 1;
+	}
+	return 0;
+}
+
+/* Build bucket of a route line - the message ID, default, port or APID */
+unsigned routeKey(const DATA_routeDest *dest)
+{
+	if (dest->apid >= 0)
+	{
+		return ROUTE_APIDKEYS + dest->apid;
+	}
+	if (dest->port > 0)
+	{
+		return ROUTE_PORTKEYS + dest->port;
+	}
+	return (dest->msgId == ROUTE_DEFAULT) ? ROUTE_IDS : dest->msgId;
+}
+
+/*
+** Builds the table from route lines. Destinations are grouped by message
+** ID, port or APID with a counting sort, keeping file order within a
+** group; IDs without a route of their own share the default route's
+** destinations, if any, and ports and APIDs without one are routed by
+** message ID.
+*/
+DATA_routeTable *buildRouteTable(DATA_routeDest *list, unsigned count)
+{
+	DATA_routeTable *table = calloc(1, sizeof(DATA_routeTable));
+	/* Bucket ROUTE_IDS holds the default route, the ports and APIDs follow */
+	unsigned *start = calloc(ROUTE_KEYS + 1, sizeof(unsigned));
+	if (table == NULL || start == NULL ||
+		(table->entries = calloc(ROUTE_IDS, sizeof(uint32_t))) == NULL ||
+		(table->dests = malloc((count + 1)*sizeof(DATA_routeDest))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	if (count > ROUTE_MAXDESTS)
+	{
+		fprintf(stderr, "Too many route destinations: %u\n", count);
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned i = 0; i < count; i++)
+	{
+		start[routeKey(&list[i]) + 1] += 1;
+	}
+	for (unsigned id = 0; id < ROUTE_KEYS; id++)
+	{
+		unsigned fanOut = start[id + 1];
+		if (fanOut > ROUTE_COUNTMASK)
+		{
+			fprintf(stderr, "Too many destinations for route %u\n", id);
+			exit(EXIT_FAILURE);
+		}
+		table->numRoutes += (fanOut > 0 && id < ROUTE_IDS);
+		table->numPorts += (fanOut > 0 && id > ROUTE_IDS &&
+			id < ROUTE_APIDKEYS);
+		table->numApids += (fanOut > 0 && id >= ROUTE_APIDKEYS);
+		start[id + 1] += start[id];
+	}
+	/* start[id] is now the first slot of id - fill in file order */
+	unsigned *next = malloc(ROUTE_KEYS*sizeof(unsigned));
+	if (next == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(next, start, ROUTE_KEYS*sizeof(unsigned));
+	for (unsigned i = 0; i < count; i++)
+	{
+		table->dests[next[routeKey(&list[i])]++] = list[i];
+	}
+	uint32_t fallback = (start[ROUTE_IDS] << ROUTE_COUNTBITS) |
+		(start[ROUTE_IDS + 1] - start[ROUTE_IDS]);
+	for (unsigned id = 0; id < ROUTE_IDS; id++)
+	{
+		unsigned fanOut = start[id + 1] - start[id];
+		table->entries[id] = (fanOut > 0) ?
+			(start[id] << ROUTE_COUNTBITS) | fanOut : fallback;
+	}
+	/* An empty port entry falls through to the message ID lookup */
+	if (table->numPorts > 0)
+	{
+		if ((table->ports = calloc(ROUTE_IDS, sizeof(uint32_t))) == NULL)
+		{
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+		for (unsigned port = 1; port < ROUTE_IDS; port++)
+		{
+			unsigned id = ROUTE_PORTKEYS + port;
+			unsigned fanOut = start[id + 1] - start[id];
+			table->ports[port] = (fanOut > 0) ?
+				(start[id] << ROUTE_COUNTBITS) | fanOut : 0;
+		}
+	}
+	if (table->numApids > 0)
+	{
+		if ((table->apids = calloc(CCSDS_APIDS, sizeof(uint32_t))) == NULL)
+		{
+			perror("malloc failed");
+			exit(EXIT_FAILURE);
+		}
+		for (unsigned apid = 0; apid < CCSDS_APIDS; apid++)
+		{
+			unsigned id = ROUTE_APIDKEYS + apid;
+			unsigned fanOut = start[id + 1] - start[id];
+			table->apids[apid] = (fanOut > 0) ?
+				(start[id] << ROUTE_COUNTBITS) | fanOut : 0;
+		}
+	}
+	table->numDests = count;
+	free(start);
+	free(next);
+	return table;
+}
+
+/*
+** Reads a route file, or routes everything to local:print when no file is
+** given, which is what the router did before routing. Returns NULL after
+** printing the error when the file cannot be read or has a bad line.
+*/
+DATA_routeTable *readRoutes(const char *path)
+{
+	DATA_routeDest *list = NULL;
+	unsigned count = 0, capacity = 0;
+	char *line = NULL;
+	size_t size = 0;
+	int lineNo = 0, ret = 0;
+	if (path == NULL)
+	{
+		char fallback[] = "* local:print";
+		ret = parseRouteLine(fallback, 0, &list, &count, &capacity);
+	}
+	else
+	{
+		FILE *file = fopen(path, "r");
+		if (file == NULL)
+		{
+			perror("route file");
+			return NULL;
+		}
+		while (ret == 0 && getline(&line, &size, file) != -1)
+		{
+			ret = parseRouteLine(line, ++lineNo, &list, &count, &capacity);
+		}
+		free(line);
+		fclose(file);
+	}
+	DATA_routeTable *table = (ret == 0) ? buildRouteTable(list, count) : NULL;
+	free(list);
+	return table;
+}
+
+/* Reads the route file at startup - any error is fatal */
+DATA_routeTable *loadRoutes(const char *path)
+{
+	DATA_routeTable *table = readRoutes(path);
+	if (table == NULL)
+	{
+		exit(EXIT_FAILURE);
+	}
+	return table;
+}
+
+void freeRoutes(DATA_routeTable *table)
+{
+	free(table->entries);
+	free(table->ports);
+	free(table->apids);
+	free(table->dests);
+	free(table);
+}
+
+DATA_forward *createForward(unsigned size)
+{
+	DATA_forward *fwd = calloc(1, sizeof(DATA_forward));
+	if (fwd == NULL ||
+		(fwd->msgs = calloc(size, sizeof(struct mmsghdr))) == NULL ||
+		(fwd->iovs = calloc(size, sizeof(struct iovec))) == NULL ||
+		(fwd->local = malloc(ROUTE_MAXHANDLERS*size*
+		sizeof(DATA_packetHeader *))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	fwd->size 	= size;
+	/* Unbound - the kernel picks the source port on the first send */
+	fwd->fd 	= createSocket();
+	for (unsigned i = 0; i < size; i++)
+	{
+		fwd->msgs[i].msg_hdr.msg_iov 		= &fwd->iovs[i];
+		fwd->msgs[i].msg_hdr.msg_iovlen 	= 1;
+		fwd->msgs[i].msg_hdr.msg_namelen 	= sizeof(struct sockaddr_in);
+	}
+	return fwd;
+}
+
+/*
+** Runs every handler with packets waiting, once each, lowest id first.
+** The packet table of each handler is contiguous, so the handler walks
+** a plain array and stays hot in the cache for the whole batch.
+*/
+void flushLocal(DATA_forward *fwd)
+{
+	while (fwd->localPending != 0)
+	{
+		int handler = __builtin_ctz(fwd->localPending);
+		routeHandlers[handler](&fwd->local[handler*fwd->size],
+			fwd->localCount[handler]);
+		fwd->localCalls 	+= 1;
+		fwd->localPackets 	+= fwd->localCount[handler];
+		fwd->localCount[handler] = 0;
+		fwd->localPending &= fwd->localPending - 1;
+	}
+}
+
+void queueLocal(DATA_forward *fwd, int handler,
+	const DATA_packetHeader *packet)
+{
+	if (fwd->localCount[handler] == fwd->size)
+	{
+		flushLocal(fwd);
+	}
+	fwd->local[handler*fwd->size + fwd->localCount[handler]++] = packet;
+	fwd->localPending |= 1U << handler;
+}
+
+/*
+** Runs the waiting local handlers and sends every queued datagram. The
+** packets are not copied, so callers flush before they reuse or free the
+** receive buffers.
+*/
+void flushForward(DATA_forward *fwd)
+{
+	unsigned sent = 0;
+	flushLocal(fwd);
+	int ret;
+	while (sent < fwd->count)
+	{
+		ret = sendmmsg(fwd->fd, &fwd->msgs[sent], fwd->count - sent, 0);
+		if (ret == -1)
+		{
+			if (errno != EINTR)
+			{
+				/* The first message failed - skip it, send the rest */
+				fwd->failed += 1;
+				sent += 1;
+			}
+			continue;
+		}
+		fwd->calls += 1;
+		fwd->sent += ret;
+		sent += ret;
+	}
+	fwd->count = 0;
+}
+
+void queueForward(DATA_forward *fwd, const char *data, unsigned len,
+	struct sockaddr_in *addr)
+{
+	if (fwd->count == fwd->size)
+	{
+		flushForward(fwd);
+	}
+	fwd->iovs[fwd->count].iov_base 				= (void *) data;
+	fwd->iovs[fwd->count].iov_len 				= len;
+	fwd->msgs[fwd->count].msg_hdr.msg_name 		= addr;
+	fwd->count += 1;
+}
+
+/*
+** Looks up the router port, then the APID of a space packet, then the
+** message ID of a validated packet and hands it to every destination: both
+** local handlers and UDP endpoints are queued on fwd until it is flushed.
+** Returns the fan-out, 0 for an unrouted packet.
+*/
+unsigned routePacket(DATA_routeTable *table, DATA_forward *fwd,
+	const DATA_packetHeader *packet, int port, DATA_statsSlot *counters)
+{
+	uint32_t entry = (table->ports != NULL) ? table->ports[port] : 0;
+	if (entry == 0 && table->apids != NULL && packetIsSpace(packet))
+	{
+		entry = table->apids[spaceApid(packetSpace(packet))];
+	}
+	if (entry == 0)
+	{
+		entry = table->entries[packetMsgId(packet)];
+	}
+	unsigned fanOut = entry & ROUTE_COUNTMASK, forwarded = 0;
+	if (fanOut == 0)
+	{
+		statAdd(counters, STAT_UNROUTED, 1);
+		return 0;
+	}
+	DATA_routeDest *dest = &table->dests[entry >> ROUTE_COUNTBITS];
+	for (unsigned i = 0; i < fanOut; i++, dest++)
+	{
+		if (dest->kind == ROUTE_LOCAL)
+		{
+			queueLocal(fwd, dest->handler, packet);
+		}
+		else
+		{
+			queueForward(fwd, (const char *) packet, packetLength(packet), 
+				&dest->addr);
+			forwarded += 1;
+		}
+	}
+	if (forwarded > 0)
+	{
+		statAdd(counters, STAT_FORWARDED, forwarded);
+	}
+	return fanOut;
+}
+
+void printForwardStats(DATA_forward *fwd)
+{
+	if (fwd->sent + fwd->failed > 0)
+	{
+		printf("Forward: %lu datagrams in %lu sendmmsg calls, %lu failed\n",
+			fwd->sent, fwd->calls, fwd->failed);
+	}
+	if (fwd->localCalls > 0)
+	{
+		printf("Local: %lu packets in %lu handler calls\n",
+			fwd->localPackets, fwd->localCalls);
+	}
+}
+
+#endif
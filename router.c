@@ -16,7 +16,33 @@
 **    	createSocket 	- 	Calls to socket() to create a new socket
 **   	bindSocket		- 	Calls to bind() to bind a socket to a server
 ** 							address in the address table
+**		setNonBlocking	- 	Sets O_NONBLOCK so engines can drain sockets
+**		raiseFdLimit	- 	Raises RLIMIT_NOFILE to fit every socket
+**		handleSignal	- 	Stops the loop or requests a statistics dump
+**		installSignals	- 	Installs handleSignal for SIGINT/SIGTERM/SIGUSR1
+**		parseConfig		- 	Reads engine, ports, packet limit, batch size, 
+** 							stats port, log level, route file, ack threshold
+** 							flow table size and idle time, rate limits,
+** 							capture file, reassembly contexts and engine
+** 							wait timeout
+**		receivePacket	- 	Reads, rate limits, routes and records one packet
+** 							for its ack and its sender's flow
+**		receiveBatch	- 	Reads a batch with recvmmsg, checks its trailers
+** 							together and routes it
+**		receiveSocket	- 	Reads from a socket in the configured I/O mode
+**		runSelect		- 	select() receive loop over every socket
+**		runEpoll		- 	Edge-triggered epoll receive loop
+**		runUring		- 	io_uring multishot recvmsg receive loop
+**		routeCompletions	- Checks the trailers of a completion pass
+** 							together and routes its packets
+**		routeReceived	- 	Routes a packet, or stores a space packet segment
+** 							until its packet is complete
+**		flushRouted		- 	Flushes the forward batch and frees the space
+** 							packets it held
+**		printCpuUsage	- 	Prints CPU time used per million packets
+**		keepPayload		- 	Copies the demo payload into the socket's entry
 **		processPacket	- 	Prints the data from the received packet
+**		processSpacePacket	- Prints the primary header of a space packet
 **		getMax			- 	Global utility function to get max integer from 
 ** 							array of integers
 **
@@ -32,113 +58,199 @@
 ** INCLUDE FILES
 **==========================================================================*/
 #include "router.h"
+#include "batch.h"
+#include "uring.h"
+#include "stats.h"
+#include "log.h"
+#include "route.h"
+#include "ack.h"
+#include "flow.h"
+#include "ratelimit.h"
+#include "capture.h"
+#include "checksum.h"
+#include "ccsds.h"
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Cleared by SIGINT/SIGTERM to leave the receive loop */
+volatile sig_atomic_t running = 1;
+/* Set by SIGUSR1 to print batch statistics from the loop */
+volatile sig_atomic_t dumpStats = 0;
+/* Shared receive batch - NULL when packets are read one at a time */
+DATA_batch *rxBatch = NULL;
+/* Names accepted by -e, indexed by ENGINE_* */
+const char *engineNames[] = {"select", "epoll", "uring"};
+/* Hot-path counters, one slot per port written by the receive loop */
+DATA_stats *stats;
+DATA_statsSlot **portStats;
+/* Message ID routes and the batch of datagrams being forwarded */
+DATA_routeTable *routes;
+DATA_forward *forward;
+/* Per-sender receive state, acknowledged in batches */
+DATA_acks *acks;
+/* Every sender seen on any port, keyed by source address and port */
+DATA_flowTable *flows;
+/* Space packets being put together from their segments, and those
+   finished and routed through forward until it is flushed */
+DATA_reassembly *reasm;
+DATA_spaceHeld *assembled;
+/* Token bucket of each port, and the limit every sender of a port gets */
+DATA_rateLimit *portLimits;
+DATA_rateLimit *srcLimits;
+/* Whole-datagram receive buffers - one, or one per batch entry */
+char rxBuffer[PKT_MAXSIZE];
+char *rxData;
 
 /*==========================================================================
 ** MAIN PROCESS
 **==========================================================================*/
-int main(void)
+int main(int argc, char *argv[])
 {
+	/* Read engine, port range and packet limit from the command line */
+	DATA_routerConfig config;
+	parseConfig(argc, argv, &config);
+	/* Messages are formatted off the receive path by the logger thread */
+	startLogger(stdout);
+	/* Make sure the process may open one descriptor per port */
+	raiseFdLimit(config.numSock);
 	/* Init array to hold socket file descriptors */
-	int fds[NUMSOCK];
+	int *fds = malloc(config.numSock*sizeof(int));
 	/* Init table which includes data buffer for each client */
-	DATA_stdPacket streamTbl[NUMSOCK];
+	DATA_stdPacket *streamTbl = malloc(config.numSock*sizeof(DATA_stdPacket));
 	/*
 	** Init socket addresses - two for each two-way communication 
 	** 		1. Server Address 1
 	**		2. Client Address 1
 	**		3. Server Address 2
 	**		4. Client Address 2
+	**		...
 	*/
 	/* Init table to hold client and server addresses */
-	struct sockaddr_in addrTbl[NUMADDR];
+	struct sockaddr_in *addrTbl = malloc(SERVMODE*config.numSock*
+		sizeof(struct sockaddr_in));
+	if (fds == NULL || streamTbl == NULL || addrTbl == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
 	/* Init server addresses */
-	initServAddrs(addrTbl);
+	initServAddrs(addrTbl, config.firstPort, config.numSock);
 	/* Start binding the first server address */
 	int servAddr = FIRST_SERVADDR;
 	/* Create and bind socket for each file descriptor */
-	for (int fd = 0; fd < NUMSOCK; fd++)
+	for (int fd = 0; fd < config.numSock; fd++)
 	{
 		/* Create the socket */
 		fds[fd] = createSocket();
 		/* Bind socket to server address */
 		bindSocket(fds[fd], servAddr, addrTbl);
+		/* Engines read until the socket would block */
+		setNonBlocking(fds[fd]);
 		/* Move to next server address in address table */
 		servAddr += NEXTADDR;
 	}
-	/* Various constants in loop */
-	int len, n, selectret, check = 0;
-	/* Stores length of client address for recvfrom/sendto() */
-	len = sizeof(struct sockaddr_in);
-	/* Init set of file descriptors for select() to monitor */
-	fd_set readfds;
-	/* Init timeout struct for select() */
-	struct timeval timeout;
-	/* Continue to wait for packets */
-	while(1)
+	/* Counters are always kept, the stats port is opened only with -S */
+	stats = createStats(config.numSock, config.firstPort);
+	portStats = malloc(config.numSock*sizeof(DATA_statsSlot *));
+	if (portStats == NULL)
 	{
-		/* Reset bits for select() monitoring */
-		FD_ZERO(&readfds);
-		/* Set each file descriptor to be monitored by select() */
-		for (int fd = 0; fd < NUMSOCK; fd++)
-		{
-			FD_SET(fds[fd], &readfds);
-		}
-		/* Reset timeout in case values were altered by select () */
-		timeout.tv_sec 	= 5;
-		timeout.tv_usec = 0;
-		/* Calls select() for blocking-wait on sockets until timeout*/
-		selectret = select(getMax(fds) + 1, &readfds, NULL, NULL, &timeout);
-		if (selectret == -1)
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int port = 0; port < config.numSock; port++)
+	{
+		portStats[port] = statsSlot(stats, "main", 0, port);
+	}
+	if (config.statsPort > 0)
+	{
+		startStatsServer(stats, config.statsPort);
+	}
+	flows = createFlows(config.flowCapacity, config.flowIdle);
+	acks = createAcks(flows, config.ackEvery, portStats);
+	reasm = createReassembly(config.spaceContexts, config.spaceTimeout, 
+		false);
+	assembled = createSpaceHeld(reasm);
+	portLimits 	= malloc(config.numSock*sizeof(DATA_rateLimit));
+	srcLimits 	= malloc(config.numSock*sizeof(DATA_rateLimit));
+	if (portLimits == NULL || srcLimits == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (int port = 0; port < config.numSock; port++)
+	{
+		portLimits[port] = rateLimitFor(config.portLimits, 
+			config.numPortLimits, port);
+		srcLimits[port] = rateLimitFor(config.srcLimits, 
+			config.numSrcLimits, port);
+	}
+	/* Routes are fixed once loaded - no file routes everything to print */
+	routes 	= loadRoutes(config.routeFile);
+	forward = createForward(FORWARDBATCH);
+	LOG(LOG_INFO, "Routes: %u message IDs, %u destinations\n", 
+		routes->numRoutes, routes->numDests);
+	/* Trailers are checked with the fastest CRC32C kernel of this CPU */
+	initChecksum();
+	LOG(LOG_INFO, "Checksum: CRC32C %s\n", checksumEngine);
+	/* Drain several datagrams per syscall if batching was requested */
+	if (config.batchSize > 1)
+	{
+		rxBatch = createBatch(config.batchSize, MSG_RECVD);
+		/* Receive whole datagrams so they can be forwarded unchanged */
+		if ((rxData = malloc((size_t) config.batchSize*PKT_MAXSIZE)) == NULL)
 		{
-			perror("select failed.");
+			perror("malloc failed");
 			exit(EXIT_FAILURE);
 		}
-		/* Zero if select times out when no sockets are ready for read */
-		else if (selectret == 0)
+		for (int i = 0; i < config.batchSize; i++)
 		{
-			printf("Timeout. Continue.\n");
-			continue;
-		}
-		else
-		{
-			/* Init index for client addresses */
-			int clientAddr = FIRST_CLIENTADDR;
-			/* Check which sockets are ready for reading, and read */
-			for (int fd = 0; fd < NUMSOCK; fd++)
-			{
-				/* If curr sock is ready to read, receive packet,  confirm */
-				if (FD_ISSET(fds[fd], &readfds))
-				{
-					/* Receive a data packet from the current socket */
-					n = recvfrom(fds[fd], &streamTbl[fd], 
-						sizeof(DATA_stdPacket), MSG_WAITALL, 
-						(struct sockaddr *) &addrTbl[clientAddr], &len);
-					/* Do something with the new packet */
-					processPacket(&streamTbl[fd]);
-					/* Send confirmation message if server is two-way */
-					if (SERVMODE == 2)
-					{
-						sendto(fds[fd], MSG_RECVD, strlen(MSG_RECVD), 
-							MSG_CONFIRM, 
-							(struct sockaddr *) &addrTbl[clientAddr], len);
-						printf("\nServer: Confirmation sent.\n\n");
-					}
-					check += 1;
-				}
-				/* Move to next client address in the table */
-				clientAddr += NEXTADDR;
-			}
-			/* Check if all messages have been received */
-			if (check == 2){
-				break;
-			}
+			attachBatchSlot(rxBatch, i, rxData + (size_t) i*PKT_MAXSIZE, 
+				PKT_MAXSIZE, &rxBatch->addrs[i]);
 		}
 	}
+	/* Stop cleanly on SIGINT/SIGTERM, dump stats on SIGUSR1 */
+	installSignals();
+	/* Every received datagram is copied to the capture writer with -d */
+	if (config.captureFile != NULL)
+	{
+		startCapture(config.captureFile, config.firstPort);
+	}
+	/* Wait for packets with the engine chosen at startup */
+	long packets;
+	if (config.engine == ENGINE_SELECT)
+	{
+		packets = runSelect(&config, fds, streamTbl);
+	}
+	else if (config.engine == ENGINE_URING)
+	{
+		packets = runUring(&config, fds, streamTbl);
+	}
+	else
+	{
+		packets = runEpoll(&config, fds, streamTbl);
+	}
+	/* Flush queued messages before the exit reports */
+	stopLogger();
+	stopCapture();
+	/* CPU time per packet is the figure to compare engines by */
+	printCpuUsage(engineNames[config.engine], packets);
+	printStats(stats);
+	if (rxBatch != NULL)
+	{
+		printBatchStats(rxBatch, "Router");
+	}
+	printForwardStats(forward);
+	printFlowStats(flows, "Router");
+	printReassemblyStats(reasm);
 	/* Close each open socket */
-	for (int fd = 0; fd < NUMSOCK; fd++)
+	for (int fd = 0; fd < config.numSock; fd++)
 	{
 		close(fds[fd]);
 	}
+	free(fds);
+	free(streamTbl);
+	free(addrTbl);
 
 	exit(EXIT_SUCCESS);
 }
@@ -146,19 +258,19 @@ int main(void)
 /*==========================================================================
 ** FUNCTION DEFINITIONS
 **==========================================================================*/
-void initServAddrs(struct sockaddr_in addrTbl[])
+void initServAddrs(struct sockaddr_in addrTbl[], int firstPort, int numSock)
 {
 	/* Init memory for all addresses */
-	memset(addrTbl, 0, NUMADDR*sizeof(struct sockaddr_in));
+	memset(addrTbl, 0, SERVMODE*numSock*sizeof(struct sockaddr_in));
 	/*
-	** Provide data for each address
+	** Provide data for each server address - ports are consecutive
 	*/
-	/* Address 1 */
-	addrTbl[0].sin_port = htons(PORT1);
-	addrTbl[0].sin_addr.s_addr = HOST;
-	/* Address 2 */
-	addrTbl[2].sin_port = htons(PORT2);
-	addrTbl[2].sin_addr.s_addr = HOST;
+	for (int i = 0; i < numSock; i++)
+	{
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_family = AF_INET;
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_port = htons(firstPort + i);
+		addrTbl[FIRST_SERVADDR + i*NEXTADDR].sin_addr.s_addr = HOST;
+	}
 }
 
 int createSocket()
@@ -173,7 +285,7 @@ int createSocket()
 	}
 	else
 	{
-		printf("New Socket: %d\n", fd);
+		LOG(LOG_INFO, "New Socket: %d\n", fd);
 		return fd;
 	}
 }
@@ -188,21 +300,707 @@ void bindSocket(int fd, int servAddr, struct sockaddr_in addrTbl[])
 	}
 }
 
+void setNonBlocking(int fd)
+{
+	/* Keep existing flags and add O_NONBLOCK */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		perror("fcntl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void raiseFdLimit(int numSock)
+{
+	struct rlimit limit;
+	/* Leave room for stdio and the epoll descriptor */
+	rlim_t needed = numSock + 16;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed)
+	{
+		return;
+	}
+	/* Soft limit can only be raised as far as the hard limit */
+	limit.rlim_cur = (needed < limit.rlim_max) ? needed : limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+	{
+		perror("setrlimit failed");
+	}
+}
+
+void handleSignal(int sig)
+{
+	if (sig == SIGUSR1)
+	{
+		dumpStats = 1;
+	}
+	else
+	{
+		running = 0;
+	}
+}
+
+void installSignals(void)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	/* No SA_RESTART so select()/epoll_wait() return EINTR */
+	action.sa_handler = handleSignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+}
+
+void parseConfig(int argc, char *argv[], DATA_routerConfig *config)
+{
+	/* Defaults match the original two-client build */
+	config->engine 		= ENGINE_EPOLL;
+	config->firstPort 	= PORT1;
+	config->numSock 	= NUMSOCK;
+	config->maxPackets 	= -1;
+	config->batchSize 	= 1;
+	config->workNsec 	= 0;
+	config->statsPort 	= 0;
+	config->routeFile 	= NULL;
+	config->ackEvery 	= ACK_EVERY;
+	config->flowCapacity = FLOW_CAPACITY;
+	config->flowIdle 	= FLOW_IDLE;
+	config->spaceContexts = CCSDS_CONTEXTS;
+	config->spaceTimeout = CCSDS_TIMEOUT;
+	config->timeoutSec 	= TIMEOUT_SEC;
+	config->numPortLimits = 0;
+	config->numSrcLimits = 0;
+	config->captureFile = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:p:n:c:b:S:L:r:a:f:i:l:s:d:A:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'e':
+				if (strcmp(optarg, "select") == 0)
+				{
+					config->engine = ENGINE_SELECT;
+				}
+				else if (strcmp(optarg, "epoll") == 0)
+				{
+					config->engine = ENGINE_EPOLL;
+				}
+				else if (strcmp(optarg, "uring") == 0)
+				{
+					config->engine = ENGINE_URING;
+				}
+				else
+				{
+					fprintf(stderr, "Unknown engine: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				config->firstPort = atoi(optarg);
+				break;
+			case 'n':
+				config->numSock = atoi(optarg);
+				break;
+			case 'c':
+				config->maxPackets = atol(optarg);
+				break;
+			case 'b':
+				config->batchSize = atoi(optarg);
+				break;
+			case 'S':
+				config->statsPort = atoi(optarg);
+				break;
+			case 'L':
+				logLevel = parseLogLevel(optarg);
+				break;
+			case 'r':
+				config->routeFile = optarg;
+				break;
+			case 'a':
+				config->ackEvery = atoi(optarg);
+				break;
+			case 'f':
+				config->flowCapacity = atoi(optarg);
+				break;
+			case 'i':
+				config->flowIdle = atoi(optarg);
+				break;
+			case 'l':
+				config->numPortLimits = parseRateList(optarg, 
+					&config->portLimits);
+				break;
+			case 's':
+				config->numSrcLimits = parseRateList(optarg, 
+					&config->srcLimits);
+				break;
+			case 'd':
+				config->captureFile = optarg;
+				break;
+			case 'A':
+				parseContexts(optarg, config);
+				break;
+			case 't':
+				config->timeoutSec = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-e select|epoll|uring] [-p first port] "
+					"[-n sockets] [-c packets, 0 = forever] "
+					"[-b batch size] [-S stats port] "
+					"[-L error|warn|info|debug] [-r route file] "
+					"[-a packets per ack] [-f flow table slots] "
+					"[-i flow idle seconds] [-l port rate[:burst],...] "
+					"[-s sender rate[:burst],...] [-d capture file] "
+					"[-A reassembly contexts[:timeout ms]] "
+					"[-t engine timeout seconds]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (config->numSock < 1 || config->numSock > MAXSOCK ||
+		config->firstPort < 1 || config->firstPort + config->numSock > 65536)
+	{
+		fprintf(stderr, "Invalid port range: %d sockets from port %d\n",
+			config->numSock, config->firstPort);
+		exit(EXIT_FAILURE);
+	}
+	if (config->batchSize < 1 || config->batchSize > MAXBATCH || 
+		config->ackEvery < 1)
+	{
+		fprintf(stderr, "Batch size must be 1 to %d, packets per ack >= 1\n", 
+			MAXBATCH);
+		exit(EXIT_FAILURE);
+	}
+	if (config->flowCapacity > FLOW_MAXCAPACITY || config->flowIdle < 1)
+	{
+		fprintf(stderr, "Flow table slots must be up to %u, idle time >= 1\n",
+			FLOW_MAXCAPACITY);
+		exit(EXIT_FAILURE);
+	}
+	if (config->spaceContexts < 1 || 
+		config->spaceContexts > CCSDS_MAXCONTEXTS || config->spaceTimeout < 1)
+	{
+		fprintf(stderr, "Reassembly contexts must be 1 to %d, timeout >= 1\n",
+			CCSDS_MAXCONTEXTS);
+		exit(EXIT_FAILURE);
+	}
+	if (config->timeoutSec < 1 || config->timeoutSec > TIMEOUT_MAXSEC)
+	{
+		fprintf(stderr, "Engine timeout must be 1 to %d seconds\n",
+			TIMEOUT_MAXSEC);
+		exit(EXIT_FAILURE);
+	}
+	/* By default stop once every client has sent one packet */
+	if (config->maxPackets < 0)
+	{
+		config->maxPackets = config->numSock;
+	}
+}
+
+int receivePacket(int sock, int fds[], DATA_stdPacket streamTbl[])
+{
+	/* Sender of this packet - kept per flow, not per socket */
+	struct sockaddr_in src;
+	/* Stores length of client address for recvfrom/sendto() */
+	socklen_t len = sizeof(struct sockaddr_in);
+	/* Receive a data packet from the current socket */
+	ssize_t n = recvfrom(fds[sock], rxBuffer, PKT_MAXSIZE, MSG_WAITALL, 
+		(struct sockaddr *) &src, &len);
+	if (n == -1)
+	{
+		/* Socket has been drained */
+		return 0;
+	}
+	statAdd(portStats[sock], STAT_RX_PACKETS, 1);
+	statAdd(portStats[sock], STAT_RX_BYTES, n);
+	if (capturing)
+	{
+		capturePost(sock, &src, rxBuffer, n, statsClock());
+	}
+	/* Validate the header in place, then route by message ID */
+	const DATA_packetHeader *packet = checkPacket(rxBuffer, n);
+	if (packet == NULL)
+	{
+		statAdd(portStats[sock], STAT_INVALID, 1);
+	}
+	else if (verifyTrailers(&packet, 1) > 0)
+	{
+		/* Its CRC32C trailer does not match - damaged on the way */
+		statAdd(portStats[sock], STAT_CORRUPT, 1);
+	}
+	else
+	{
+		uint64_t start = statsClock();
+		DATA_flowEntry *flow = flowTouch(flows, &src, sock, packet, n, 
+			start, portStats[sock]);
+		/* Over the sender's or the port's rate - counted, not routed */
+		if (!rateCheck(&srcLimits[sock], flow, &portLimits[sock], start, 
+			portStats[sock]))
+		{
+			return 1;
+		}
+		keepPayload(&streamTbl[sock], packet);
+		routeReceived(sock, &src, packet, start, portStats[sock]);
+		flushRouted();
+		statAdd(portStats[sock], STAT_PROC_NSEC, statsClock() - start);
+		statAdd(portStats[sock], STAT_PROCESSED, 1);
+		/* Acknowledged with the sender's other packets if server is two-way */
+		if (SERVMODE == 2)
+		{
+			recordAck(acks, fds, sock, flow, packet);
+		}
+	}
+	return 1;
+}
+
+int receiveBatch(int sock, int fds[], DATA_stdPacket streamTbl[])
+{
+	/* Drain up to one batch of datagrams with a single syscall */
+	int n = recvBatch(fds[sock], rxBatch);
+	if (n == 0)
+	{
+		return 0;
+	}
+	DATA_statsSlot *counters = portStats[sock];
+	statAdd(counters, STAT_RX_PACKETS, n);
+	for (int i = 0; i < n; i++)
+	{
+		statAdd(counters, STAT_RX_BYTES, rxBatch->msgs[i].msg_len);
+	}
+	/* Validate the headers, then the trailers of the whole batch at once */
+	uint64_t start = statsClock();
+	const DATA_packetHeader *packets[MAXBATCH];
+	int valid = 0, limited = 0, invalid = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (capturing)
+		{
+			capturePost(sock, &rxBatch->addrs[i], rxBatch->iovs[i].iov_base,
+				rxBatch->msgs[i].msg_len, start);
+		}
+		packets[i] = checkPacket(rxBatch->iovs[i].iov_base, 
+			rxBatch->msgs[i].msg_len);
+		invalid += (packets[i] == NULL);
+	}
+	unsigned corrupt = verifyTrailers(packets, n);
+	/* Route each packet that passed, forward the batch at once */
+	for (int i = 0; i < n; i++)
+	{
+		const DATA_packetHeader *packet = packets[i];
+		if (packet == NULL)
+		{
+			continue;
+		}
+		/* One clock read per batch serves the flow table and the limits */
+		DATA_flowEntry *flow = flowTouch(flows, &rxBatch->addrs[i], sock, 
+			packet, rxBatch->msgs[i].msg_len, start, counters);
+		if (!rateCheck(&srcLimits[sock], flow, &portLimits[sock], start, 
+			counters))
+		{
+			limited += 1;
+			continue;
+		}
+		keepPayload(&streamTbl[sock], packet);
+		routeReceived(sock, &rxBatch->addrs[i], packet, start, counters);
+		if (SERVMODE == 2)
+		{
+			recordAck(acks, fds, sock, flow, packet);
+		}
+		valid += 1;
+	}
+	flushRouted();
+	statAdd(counters, STAT_PROC_NSEC, statsClock() - start);
+	statAdd(counters, STAT_PROCESSED, valid);
+	statAdd(counters, STAT_INVALID, invalid);
+	statAdd(counters, STAT_CORRUPT, corrupt);
+	return n;
+}
+
+int receiveSocket(int sock, int fds[], DATA_stdPacket streamTbl[])
+{
+	if (rxBatch != NULL)
+	{
+		return receiveBatch(sock, fds, streamTbl);
+	}
+	return receivePacket(sock, fds, streamTbl);
+}
+
+long runSelect(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[])
+{
+	/* Highest descriptor only changes when sockets are opened */
+	int maxfd = getMax(fds, config->numSock);
+	if (maxfd >= FD_SETSIZE)
+	{
+		fprintf(stderr, "select engine supports fds below %d, use -e epoll\n",
+			FD_SETSIZE);
+		exit(EXIT_FAILURE);
+	}
+	/* Various constants in loop */
+	int selectret;
+	long check = 0;
+	/* Init set of file descriptors for select() to monitor */
+	fd_set readfds;
+	/* Init timeout struct for select() */
+	struct timeval timeout;
+	/* Continue to wait for packets */
+	while(running && (config->maxPackets == 0 || check < config->maxPackets))
+	{
+		if (dumpStats)
+		{
+			if (rxBatch != NULL)
+			{
+				printBatchStats(rxBatch, "Router");
+			}
+			printStats(stats);
+			dumpStats = 0;
+		}
+		/* Reset bits for select() monitoring */
+		FD_ZERO(&readfds);
+		/* Set each file descriptor to be monitored by select() */
+		for (int fd = 0; fd < config->numSock; fd++)
+		{
+			FD_SET(fds[fd], &readfds);
+		}
+		/* Reset timeout in case values were altered by select () */
+		timeout.tv_sec 	= config->timeoutSec;
+		timeout.tv_usec = 0;
+		/* Calls select() for blocking-wait on sockets until timeout*/
+		selectret = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+		if (selectret == -1 && errno == EINTR)
+		{
+			/* Interrupted by a signal - re-check the loop condition */
+			continue;
+		}
+		else if (selectret == -1)
+		{
+			perror("select failed.");
+			exit(EXIT_FAILURE);
+		}
+		/* Zero if select times out when no sockets are ready for read */
+		else if (selectret == 0)
+		{
+			LOG(LOG_INFO, "Timeout. Continue.\n");
+			continue;
+		}
+		/* Check which sockets are ready for reading, and read */
+		for (int fd = 0; fd < config->numSock; fd++)
+		{
+			/* If curr sock is ready to read, receive packet,  confirm */
+			if (FD_ISSET(fds[fd], &readfds))
+			{
+				check += receiveSocket(fd, fds, streamTbl);
+			}
+		}
+		/* Acknowledge everything read in this pass */
+		flushAcks(acks, fds, 1);
+	}
+	return check;
+}
+
+long runEpoll(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[])
+{
+	/* Create the epoll instance that watches every socket */
+	int epfd = epoll_create1(0);
+	if (epfd == -1)
+	{
+		perror("epoll_create1 failed");
+		exit(EXIT_FAILURE);
+	}
+	/* Register each socket once - edge-triggered, tagged with its index */
+	struct epoll_event event;
+	for (int fd = 0; fd < config->numSock; fd++)
+	{
+		event.events 	= EPOLLIN | EPOLLET;
+		event.data.u32 	= fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[fd], &event) == -1)
+		{
+			perror("epoll_ctl failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	/* Only ready sockets are returned - no scan over all descriptors */
+	struct epoll_event events[MAXEVENTS];
+	int ready, n;
+	long check = 0;
+	/* Continue to wait for packets */
+	while(running && (config->maxPackets == 0 || check < config->maxPackets))
+	{
+		if (dumpStats)
+		{
+			if (rxBatch != NULL)
+			{
+				printBatchStats(rxBatch, "Router");
+			}
+			printStats(stats);
+			dumpStats = 0;
+		}
+		ready = epoll_wait(epfd, events, MAXEVENTS, 
+			config->timeoutSec*1000);
+		if (ready == -1 && errno == EINTR)
+		{
+			/* Interrupted by a signal - re-check the loop condition */
+			continue;
+		}
+		else if (ready == -1)
+		{
+			perror("epoll_wait failed.");
+			exit(EXIT_FAILURE);
+		}
+		/* Zero if epoll_wait times out when no sockets are ready */
+		else if (ready == 0)
+		{
+			LOG(LOG_INFO, "Timeout. Continue.\n");
+			continue;
+		}
+		for (int i = 0; i < ready; i++)
+		{
+			/* Edge-triggered - drain the socket until it would block */
+			/* Long drains still ack every -a packets per sender, see 
+			   recordAck() */
+			while ((n = receiveSocket(events[i].data.u32, fds, streamTbl)) > 0)
+			{
+				check += n;
+			}
+		}
+		/* Acknowledge everything read in this pass */
+		flushAcks(acks, fds, 1);
+	}
+	close(epfd);
+	return check;
+}
+
+long runUring(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[])
+{
+	DATA_uring ring;
+	int ret;
+	if ((ret = uringSetup(&ring, URING_ENTRIES)) < 0 || 
+		(ret = uringSetupBufRing(&ring, URING_BUFCOUNT, URING_BUFSIZE)) < 0)
+	{
+		fprintf(stderr, "io_uring setup failed: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	/* Template for every multishot receive - only the name is returned */
+	struct msghdr recvMsg;
+	memset(&recvMsg, 0, sizeof(recvMsg));
+	recvMsg.msg_namelen = sizeof(struct sockaddr_in);
+	/* One multishot receive per socket, tagged with the socket index */
+	for (int fd = 0; fd < config->numSock; fd++)
+	{
+		uringPrepRecvMultishot(&ring, fds[fd], &recvMsg, fd);
+	}
+	struct io_uring_cqe *cqe;
+	long check = 0;
+	/* Buffers whose packets may still be queued for forwarding, and the
+	   packets, senders and ports of the completions not yet routed */
+	unsigned short held[FORWARDBATCH];
+	const DATA_packetHeader *packets[FORWARDBATCH];
+	struct sockaddr_in *srcs[FORWARDBATCH];
+	int socks[FORWARDBATCH];
+	unsigned sizes[FORWARDBATCH];
+	unsigned numHeld = 0;
+	/* Continue to wait for packets */
+	while(running && (config->maxPackets == 0 || check < config->maxPackets))
+	{
+		/* Submit re-arms, wait for completions */
+		ret = uringEnter(&ring, 1, config->timeoutSec*1000);
+		if (ret == -EINTR)
+		{
+			/* Interrupted by a signal - re-check the loop condition */
+			continue;
+		}
+		else if (ret < 0 && ret != -ETIME)
+		{
+			fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+		if (uringPeekCqe(&ring) == NULL)
+		{
+			LOG(LOG_INFO, "Timeout. Continue.\n");
+			continue;
+		}
+		/* One clock read per pass for the flow table and the limits */
+		uint64_t now = statsClock();
+		while ((cqe = uringPeekCqe(&ring)) != NULL)
+		{
+			int sock = cqe->user_data;
+			if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+			{
+				unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				char *buf = ring.bufBase + (size_t) bid*ring.bufSize;
+				/* Buffer layout: recvmsg_out, source address, payload */
+				struct io_uring_recvmsg_out *out = 
+					(struct io_uring_recvmsg_out *) buf;
+				struct sockaddr_in *src = (struct sockaddr_in *) (out + 1);
+				char *payload = (char *) src + recvMsg.msg_namelen;
+				/* Truncated datagrams report their full length */
+				unsigned room = ring.bufSize - (payload - buf);
+				unsigned size = out->payloadlen < room ? 
+					out->payloadlen : room;
+				statAdd(portStats[sock], STAT_RX_PACKETS, 1);
+				statAdd(portStats[sock], STAT_RX_BYTES, out->payloadlen);
+				if (capturing)
+				{
+					capturePost(sock, src, payload, size, now);
+				}
+				/* Validate the header in place, route with the others */
+				packets[numHeld] = checkPacket(payload, size);
+				if (packets[numHeld] == NULL)
+				{
+					statAdd(portStats[sock], STAT_INVALID, 1);
+				}
+				srcs[numHeld] 	= src;
+				socks[numHeld] 	= sock;
+				sizes[numHeld] 	= size;
+				/* Buffers go back to the kernel once forwards are sent */
+				held[numHeld++] = bid;
+				if (numHeld == FORWARDBATCH)
+				{
+					routeCompletions(fds, streamTbl, packets, srcs, socks, 
+						sizes, numHeld, now);
+					flushRouted();
+					for (unsigned i = 0; i < numHeld; i++)
+					{
+						uringRecycleBuf(&ring, held[i]);
+					}
+					numHeld = 0;
+				}
+				check += 1;
+			}
+			/* Re-arm once the kernel ends the multishot receive */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				uringPrepRecvMultishot(&ring, fds[sock], &recvMsg, sock);
+			}
+			uringCqAdvance(&ring);
+		}
+		/* End of a completion pass - route, forward and release buffers */
+		routeCompletions(fds, streamTbl, packets, srcs, socks, sizes, 
+			numHeld, now);
+		flushRouted();
+		for (unsigned i = 0; i < numHeld; i++)
+		{
+			uringRecycleBuf(&ring, held[i]);
+		}
+		numHeld = 0;
+		/* Acknowledge everything received in this pass */
+		flushAcks(acks, fds, 1);
+	}
+	uringClose(&ring);
+	return check;
+}
+
+/*
+** Routes the valid packets of n io_uring completions, checking the
+** trailers of them all with one verifyTrailers() call first, as
+** receiveBatch() does for a recvmmsg() batch.
+*/
+void routeCompletions(int fds[], DATA_stdPacket streamTbl[], 
+	const DATA_packetHeader *packets[], struct sockaddr_in *srcs[], 
+	const int socks[], const unsigned sizes[], unsigned n, uint64_t now)
+{
+	/* Entries cleared by the check are the corrupt ones */
+	bool valid[FORWARDBATCH];
+	for (unsigned i = 0; i < n; i++)
+	{
+		valid[i] = (packets[i] != NULL);
+	}
+	verifyTrailers(packets, n);
+	for (unsigned i = 0; i < n; i++)
+	{
+		const DATA_packetHeader *packet = packets[i];
+		int sock = socks[i];
+		if (packet == NULL)
+		{
+			if (valid[i])
+			{
+				statAdd(portStats[sock], STAT_CORRUPT, 1);
+			}
+			continue;
+		}
+		DATA_flowEntry *flow = flowTouch(flows, srcs[i], sock, packet, 
+			sizes[i], now, portStats[sock]);
+		if (!rateCheck(&srcLimits[sock], flow, &portLimits[sock], now, 
+			portStats[sock]))
+		{
+			continue;
+		}
+		keepPayload(&streamTbl[sock], packet);
+		uint64_t start = statsClock();
+		routeReceived(sock, srcs[i], packet, start, portStats[sock]);
+		statAdd(portStats[sock], STAT_PROC_NSEC, statsClock() - start);
+		statAdd(portStats[sock], STAT_PROCESSED, 1);
+		if (SERVMODE == 2)
+		{
+			recordAck(acks, fds, sock, flow, packet);
+		}
+	}
+}
+
+/*
+** Routes a validated packet by port, APID or message ID. A segment of a
+** space packet is stored instead, and the segment that completes it routes
+** the whole space packet.
+*/
+void routeReceived(int sock, const struct sockaddr_in *src, 
+	const DATA_packetHeader *packet, uint64_t now, DATA_statsSlot *counters)
+{
+	if (packetIsSpace(packet) && (packet = reassembleSpace(reasm, packet, 
+		src, sock, now, assembled, counters)) == NULL)
+	{
+		return;
+	}
+	routePacket(routes, forward, packet, stats->firstPort + sock, counters);
+}
+
+/* Delivers the routed packets, then frees the space packets among them */
+void flushRouted(void)
+{
+	flushForward(forward);
+	releaseAssembled(reasm, assembled);
+}
+
+void printCpuUsage(const char *engine, long packets)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6;
+	double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+	printf("Engine %s: %ld packets, %.3f s user, %.3f s system, "
+		"%.3f CPU s per million packets\n", engine, packets, user, sys, 
+		packets ? (user + sys)*1e6/packets : 0.0);
+}
+
+void keepPayload(DATA_stdPacket *entry, const DATA_packetHeader *packet)
+{
+	/* Short payloads leave the rest of the entry as it was */
+	unsigned len = packetPayloadLen(packet);
+	memcpy(entry, packetPayload(packet), len < sizeof(DATA_stdPacket) ? 
+		len : sizeof(DATA_stdPacket));
+}
+
 void processPacket(DATA_stdPacket *packet)
 {
-	printf("Client says:\n\t\t%c\n\t\t%c\n\t\t%hhu\n\t\t%hhu\n",
+	LOG(LOG_DEBUG, "Client says:\n\t\t%c\n\t\t%c\n\t\t%hhu\n\t\t%hhu\n",
 			packet->firstChar,
 			packet->secondChar,
 			packet->firstNum,
 			packet->secondNum);
 }
 
-int getMax(int array[])
+void processSpacePacket(const DATA_spaceHeader *space)
+{
+	LOG(LOG_DEBUG, "Space packet APID %u, sequence count %u, %u bytes\n",
+			spaceApid(space),
+			spaceSeqCount(space),
+			spaceLength(space));
+}
+
+int getMax(int array[], int nums)
 {
 	/* Init max it to store result */
 	int max = 0;
-	/* Get total numbers in array */
-	int nums = sizeof(&array)/sizeof(array[0]);
 	/* Loop through each num and compare to max */
 	for (int i = 0; i < nums; i++)
 	{
@@ -4,11 +4,25 @@
 /*==========================================================================
 ** INCLUDE FILES
 **==========================================================================*/
+/* recvmmsg()/sendmmsg() and CPU affinity are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
 #include "data_types.h"
@@ -27,6 +41,8 @@
 #define MAXBUFFER 			1024		
 /* Number of sockets required - one for each client */													
 #define NUMSOCK				2		
+/* Upper bound on sockets selectable at startup with -n */
+#define MAXSOCK				4096
 /* Specifies two-way comms - server sends confirmation */			
 #define SERVMODE 			2				
 /* Number of addresses required - client/server for each socket*/	
@@ -39,23 +55,88 @@
 #define FIRST_SERVADDR 		0			
 /* Skip one address to get to next entry in table */		
 #define NEXTADDR 			2					
+/* Seconds to wait for a packet before doing other work in the loop */
+#define TIMEOUT_SEC			5
+/* Largest -t wait, kept well inside the engines' int milliseconds */
+#define TIMEOUT_MAXSEC		3600
+/* Max ready sockets returned by one epoll_wait() call */
+#define MAXEVENTS			64
+/* Packets taken from one buffer queue per drain by the processor */
+#define DRAINBATCH			64
+/* Bytes of deficit a weight of 1 earns per round-robin turn */
+#define DRR_QUANTUM			PKT_MAXSIZE
+/* Default weights of classes 0..3 - class 0 is strict, changed with -W */
+#define DRR_WEIGHTS			{0, 8, 4, 1}
+/* Flow buckets shared by the processing workers and packets per bucket */
+#define WORK_BUCKETS		1024
+#define WORK_BUCKETDEPTH	256
+/* Bucket ring entries: reader index << WORK_SLOTBITS | pool slot */
+#define WORK_SLOTBITS		16
+#define WORK_SLOTMASK		((1U << WORK_SLOTBITS) - 1)
+/* Slots of one reader the workers may hold beyond its queues */
+#define WORK_INFLIGHT		1024
+/* Upper bound on processing workers selectable with -P */
+#define MAXWORKERS			64
+/* Empty polls a worker yields for before it starts to sleep */
+#define WORK_SPINS			64
+/* Upper bound on SO_REUSEPORT shards per port selectable with -k */
+#define MAXSHARDS			64
+/* Receive engines selectable at startup with -e */
+#define ENGINE_SELECT		0
+#define ENGINE_EPOLL		1
+#define ENGINE_URING		2
+/* What a reader does with packets that do not fit its queue, set with -O */
+#define POLICY_BLOCK		0
+#define POLICY_DROPNEWEST	1
+#define POLICY_DROPOLDEST	2
+#define POLICY_SPOOL		3
 
 /*==========================================================================
 ** FUNCTION PROTOTYPES
 **==========================================================================*/
 /* Address functions */
-void initServAddrs(struct sockaddr_in addrs[]);
+void initServAddrs(struct sockaddr_in addrs[], int firstPort, int numSock);
 
 /* Socket API functions */
 int createSocket();
 void bindSocket(int fd, int servAddr, struct sockaddr_in addrTbl[]);
+void setNonBlocking(int fd);
+void raiseFdLimit(int numSock);
+void handleSignal(int sig);
+void installSignals(void);
+void setReusePort(int fd);
+void attachFlowFilter(int fd, int shards);
+int parseCpuList(const char *list, int **cpus);
+int parseWeights(const char *list, int weights[]);
+int parsePolicyList(const char *list, int **policies);
+
+/* Receive engine functions */
+void parseConfig(int argc, char *argv[], DATA_routerConfig *config);
+int receivePacket(int sock, int fds[], DATA_stdPacket streamTbl[]);
+int receiveBatch(int sock, int fds[], DATA_stdPacket streamTbl[]);
+int receiveSocket(int sock, int fds[], DATA_stdPacket streamTbl[]);
+long runSelect(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[]);
+long runEpoll(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[]);
+long runUring(DATA_routerConfig *config, int fds[], 
+	DATA_stdPacket streamTbl[]);
+void routeCompletions(int fds[], DATA_stdPacket streamTbl[], 
+	const DATA_packetHeader *packets[], struct sockaddr_in *srcs[], 
+	const int socks[], const unsigned sizes[], unsigned n, uint64_t now);
+void printCpuUsage(const char *engine, long packets);
+void keepPayload(DATA_stdPacket *entry, const DATA_packetHeader *packet);
+void routeReceived(int sock, const struct sockaddr_in *src, 
+	const DATA_packetHeader *packet, uint64_t now, DATA_statsSlot *counters);
+void flushRouted(void);
 
 /* Packet processing functions */
 void initPacket(DATA_stdPacket *, char [], UINT8 []);
 void processPacket(DATA_stdPacket *);
+void processSpacePacket(const DATA_spaceHeader *);
 
 /* Global utility functions */
-extern int getMax(int array[]);
+extern int getMax(int array[], int nums);
 extern PID createChild();
 
 #endif
@@ -0,0 +1,250 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Largest snapshot sent back in one datagram */
+#define STATS_MAXREPLY		65000
+
+/*==========================================================================
+** GLOBAL VARIABLES
+**==========================================================================*/
+/* Printed names of the counters, indexed by enum statCounter */
+const char *statNames[STAT_COUNT] = {
+	"rx_packets", "rx_bytes", "queue_hwm", "stalls", "drops", 
+	"confirms", "processed", "proc_nsec", "forwarded", "unrouted",
+	"invalid", "kernel_drops", "new_flows", "expired_flows", "untracked",
+	"rate_drops", "spooled", "unspooled", "corrupt", "reassembled",
+	"reasm_drops"
+};
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+DATA_stats *createStats(unsigned maxSlots, int firstPort)
+{
+	DATA_stats *stats = calloc(1, sizeof(DATA_stats));
+	if (stats == NULL || (stats->slots = aligned_alloc(CACHELINE, 
+		maxSlots*sizeof(DATA_statsSlot))) == NULL)
+	{
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(stats->slots, 0, maxSlots*sizeof(DATA_statsSlot));
+	stats->maxSlots 	= maxSlots;
+	stats->firstPort 	= firstPort;
+	stats->fd 			= -1;
+	atomic_init(&stats->numSlots, 0);
+	return stats;
+}
+
+/* Startup only - claims the slot a thread will write for one port */
+DATA_statsSlot *statsSlot(DATA_stats *stats, const char *role, int thread, 
+	int port)
+{
+	unsigned index = atomic_load(&stats->numSlots);
+	if (index == stats->maxSlots)
+	{
+		fprintf(stderr, "Out of statistics slots\n");
+		exit(EXIT_FAILURE);
+	}
+	DATA_statsSlot *slot = &stats->slots[index];
+	slot->role 		= role;
+	slot->thread 	= thread;
+	slot->port 		= port;
+	/* Publish the filled-in slot to the snapshot reader */
+	atomic_store_explicit(&stats->numSlots, index + 1, memory_order_release);
+	return slot;
+}
+
+/* Owner only - single writer, so a relaxed load and store suffice */
+void statAdd(DATA_statsSlot *slot, int counter, uint64_t n)
+{
+	atomic_store_explicit(&slot->counters[counter], 
+		atomic_load_explicit(&slot->counters[counter], memory_order_relaxed) 
+		+ n, memory_order_relaxed);
+}
+
+/* Owner only - raises a high-water mark */
+void statMax(DATA_statsSlot *slot, int counter, uint64_t value)
+{
+	if (value > atomic_load_explicit(&slot->counters[counter], 
+		memory_order_relaxed))
+	{
+		atomic_store_explicit(&slot->counters[counter], value, 
+			memory_order_relaxed);
+	}
+}
+
+/* Monotonic nanoseconds for timing the processing stage */
+uint64_t statsClock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+uint64_t statRead(DATA_statsSlot *slot, int counter)
+{
+	return atomic_load_explicit(&slot->counters[counter], 
+		memory_order_relaxed);
+}
+
+/*
+** Appends formatted text at buf + used and returns the new length of the
+** text, which stays at len once the buffer is full - truncated text never
+** moves the next append past the end of the buffer.
+*/
+__attribute__((format(printf, 4, 5)))
+size_t appendStats(char *buf, size_t len, size_t used, const char *fmt, ...)
+{
+	if (used >= len)
+	{
+		return len;
+	}
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf + used, len - used, fmt, args);
+	va_end(args);
+	return (n < 0 || (size_t) n >= len - used) ? len : used + n;
+}
+
+/* Appends "name=value" pairs for one set of counters */
+size_t formatCounters(char *buf, size_t len, size_t used, 
+	const uint64_t values[])
+{
+	for (int c = 0; c < STAT_COUNT && used < len; c++)
+	{
+		used = appendStats(buf, len, used, " %s=%lu", statNames[c], 
+			values[c]);
+	}
+	return appendStats(buf, len, used, "\n");
+}
+
+/*
+** Writes a text snapshot - totals, then one line per port, then one line
+** per slot - while writers keep running. Counters are summed, except high
+** water marks, which take the maximum.
+*/
+size_t formatStats(DATA_stats *stats, char *buf, size_t len)
+{
+	unsigned numSlots = atomic_load_explicit(&stats->numSlots, 
+		memory_order_acquire);
+	uint64_t total[STAT_COUNT] = {0}, values[STAT_COUNT];
+	int maxPort = -1;
+	size_t used = 0;
+	for (unsigned s = 0; s < numSlots; s++)
+	{
+		if (stats->slots[s].port > maxPort)
+		{
+			maxPort = stats->slots[s].port;
+		}
+		for (int c = 0; c < STAT_COUNT; c++)
+		{
+			uint64_t v = statRead(&stats->slots[s], c);
+			total[c] = (c == STAT_QUEUE_HWM) ? 
+				(v > total[c] ? v : total[c]) : total[c] + v;
+		}
+	}
+	used = appendStats(buf, len, used, "total");
+	used = formatCounters(buf, len, used, total);
+	for (int port = 0; port <= maxPort && used < len; port++)
+	{
+		memset(values, 0, sizeof(values));
+		for (unsigned s = 0; s < numSlots; s++)
+		{
+			if (stats->slots[s].port != port)
+			{
+				continue;
+			}
+			for (int c = 0; c < STAT_COUNT; c++)
+			{
+				uint64_t v = statRead(&stats->slots[s], c);
+				values[c] = (c == STAT_QUEUE_HWM) ? 
+					(v > values[c] ? v : values[c]) : values[c] + v;
+			}
+		}
+		used = appendStats(buf, len, used, "port %d", 
+			stats->firstPort + port);
+		used = formatCounters(buf, len, used, values);
+	}
+	for (unsigned s = 0; s < numSlots && used < len; s++)
+	{
+		for (int c = 0; c < STAT_COUNT; c++)
+		{
+			values[c] = statRead(&stats->slots[s], c);
+		}
+		used = appendStats(buf, len, used, "thread %s.%d port %d", 
+			stats->slots[s].role, stats->slots[s].thread, 
+			stats->firstPort + stats->slots[s].port);
+		used = formatCounters(buf, len, used, values);
+	}
+	/* A full buffer holds the truncated text and its terminator */
+	return (used < len) ? used : strlen(buf);
+}
+
+/* Prints a snapshot to stdout - SIGUSR1 and exit reports */
+void printStats(DATA_stats *stats)
+{
+	char *text = malloc(STATS_MAXREPLY);
+	if (text != NULL)
+	{
+		formatStats(stats, text, STATS_MAXREPLY);
+		fputs(text, stdout);
+		free(text);
+	}
+}
+
+/* Stats thread - answers every datagram with a fresh snapshot */
+void *serveStats(void *args)
+{
+	DATA_stats *stats = (DATA_stats *) args;
+	char *reply = malloc(STATS_MAXREPLY);
+	char request[64];
+	struct sockaddr_in from;
+	socklen_t len;
+	while (reply != NULL)
+	{
+		len = sizeof(from);
+		if (recvfrom(stats->fd, request, sizeof(request), 0, 
+			(struct sockaddr *) &from, &len) == -1)
+		{
+			continue;
+		}
+		size_t n = formatStats(stats, reply, STATS_MAXREPLY);
+		sendto(stats->fd, reply, n, 0, (struct sockaddr *) &from, len);
+	}
+	return NULL;
+}
+
+/* Binds the stats port on loopback and starts the stats thread */
+void startStatsServer(DATA_stats *stats, int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family 		= AF_INET;
+	addr.sin_port 			= htons(port);
+	addr.sin_addr.s_addr 	= htonl(INADDR_LOOPBACK);
+	if ((stats->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+		bind(stats->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		perror("stats socket failed");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&stats->tid, NULL, serveStats, stats) != 0)
+	{
+		perror("stats thread failed");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(stats->tid);
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef URING_H
+#define URING_H
+
+/*==========================================================================
+** INCLUDE FILES
+**==========================================================================*/
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "data_types.h"
+
+/*==========================================================================
+** MACRO DEFINITIONS
+**==========================================================================*/
+/* Submission queue entries - completion queue is sized URING_CQ_FACTOR x */
+#define URING_ENTRIES		1024
+#define URING_CQ_FACTOR		8
+/* Receive buffers in the provided buffer ring - must be a power of two */
+#define URING_BUFCOUNT		4096
+/* Each buffer holds the recvmsg_out header, source address and payload */
+#define URING_BUFSIZE		2048
+/* Buffer group id of the receive buffer ring */
+#define URING_BGID			0
+/* Marks completions of confirmation sends in user_data */
+#define URING_SEND_TAG		(1ULL << 63)
+
+/*==========================================================================
+** FUNCTION DEFINITIONS
+**==========================================================================*/
+/*
+** Thin wrappers around the io_uring system calls - liburing is not
+** required. The SQ tail and CQ head are published with release stores and
+** the kernel's CQ tail is read with an acquire load.
+*/
+int uringSetup(DATA_uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(DATA_uring));
+	memset(&params, 0, sizeof(params));
+	/* Only the router thread submits; defer completion work to it */
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | 
+		IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = entries*URING_CQ_FACTOR;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd == -1 && errno == EINVAL)
+	{
+		/* Kernels before 6.1 lack the single issuer flags */
+		params.flags = IORING_SETUP_CQSIZE;
+		ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	}
+	if (ring->fd == -1)
+	{
+		return -errno;
+	}
+	/* Map the submission ring, completion ring and SQE array */
+	ring->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + 
+		params.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, 
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || 
+		ring->sqes == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -ENOMEM;
+	}
+	ring->sqHead 	= (unsigned *) ((char *) ring->sqRing + params.sq_off.head);
+	ring->sqTail 	= (unsigned *) ((char *) ring->sqRing + params.sq_off.tail);
+	ring->sqMask 	= (unsigned *) ((char *) ring->sqRing + 
+		params.sq_off.ring_mask);
+	ring->sqArray 	= (unsigned *) ((char *) ring->sqRing + 
+		params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->sqLocalTail = *ring->sqTail;
+	ring->cqHead 	= (unsigned *) ((char *) ring->cqRing + params.cq_off.head);
+	ring->cqTail 	= (unsigned *) ((char *) ring->cqRing + params.cq_off.tail);
+	ring->cqMask 	= (unsigned *) ((char *) ring->cqRing + 
+		params.cq_off.ring_mask);
+	ring->cqes 		= (struct io_uring_cqe *) ((char *) ring->cqRing + 
+		params.cq_off.cqes);
+	return 0;
+}
+
+/* Submits queued SQEs and waits for at least waitNr completions */
+int uringEnter(DATA_uring *ring, unsigned waitNr, int timeoutMs)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned flags = IORING_ENTER_GETEVENTS;
+	memset(&arg, 0, sizeof(arg));
+	if (timeoutMs >= 0)
+	{
+		ts.tv_sec 	= timeoutMs/1000;
+		ts.tv_nsec 	= (timeoutMs % 1000)*1000000L;
+		arg.ts 		= (uint64_t) (uintptr_t) &ts;
+		flags 		|= IORING_ENTER_EXT_ARG;
+	}
+	/* Publish the SQEs queued since the last call to the kernel */
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->sqPending, waitNr, 
+		flags, (timeoutMs >= 0) ? (void *) &arg : NULL, 
+		(timeoutMs >= 0) ? sizeof(arg) : 0);
+	if (ret >= 0)
+	{
+		ring->sqPending -= (ret < (int) ring->sqPending) ? 
+			ret : ring->sqPending;
+		return ret;
+	}
+	return -errno;
+}
+
+/* Returns a zeroed SQE, submitting queued ones first if the ring is full */
+struct io_uring_sqe *uringGetSqe(DATA_uring *ring)
+{
+	while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, 
+		__ATOMIC_ACQUIRE) >= ring->sqEntries)
+	{
+		uringEnter(ring, 0, -1);
+	}
+	unsigned index = ring->sqLocalTail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqArray[index] = index;
+	/* Published to the kernel by the next uringEnter() */
+	ring->sqLocalTail += 1;
+	ring->sqPending += 1;
+	return sqe;
+}
+
+/* Next unconsumed completion or NULL */
+struct io_uring_cqe *uringPeekCqe(DATA_uring *ring)
+{
+	unsigned head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+/* Hands the slot of the completion just read back to the kernel */
+void uringCqAdvance(DATA_uring *ring)
+{
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns a receive buffer to the provided buffer ring */
+void uringRecycleBuf(DATA_uring *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & 
+		(ring->bufCount - 1)];
+	buf->addr 	= (uint64_t) (uintptr_t) (ring->bufBase + 
+		(size_t) bid*ring->bufSize);
+	buf->len 	= ring->bufSize;
+	buf->bid 	= bid;
+	ring->bufTail += 1;
+	__atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+/*
+** Registers a provided buffer ring of count buffers of size bytes. The
+** kernel picks a buffer from it for every datagram a multishot receive
+** completes, so packets land directly in router-owned memory.
+*/
+int uringSetupBufRing(DATA_uring *ring, unsigned count, unsigned size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ringSize = count*sizeof(struct io_uring_buf);
+	ring->bufRing = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	ring->bufBase = mmap(NULL, (size_t) count*size, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring->bufRing == MAP_FAILED || ring->bufBase == MAP_FAILED)
+	{
+		return -ENOMEM;
+	}
+	ring->bufCount 	= count;
+	ring->bufSize 	= size;
+	ring->bufGroup 	= URING_BGID;
+	ring->bufTail 	= 0;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr 		= (uint64_t) (uintptr_t) ring->bufRing;
+	reg.ring_entries 	= count;
+	reg.bgid 			= ring->bufGroup;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, 
+		&reg, 1) == -1)
+	{
+		return -errno;
+	}
+	for (unsigned bid = 0; bid < count; bid++)
+	{
+		uringRecycleBuf(ring, bid);
+	}
+	return 0;
+}
+
+/* Queues a multishot recvmsg that keeps completing until it runs dry */
+void uringPrepRecvMultishot(DATA_uring *ring, int fd, struct msghdr *msg, 
+	uint64_t userData)
+{
+	struct io_uring_sqe *sqe = uringGetSqe(ring);
+	sqe->opcode 	= IORING_OP_RECVMSG;
+	sqe->fd 		= fd;
+	sqe->addr 		= (uint64_t) (uintptr_t) msg;
+	sqe->len 		= 1;
+	sqe->ioprio 	= IORING_RECV_MULTISHOT;
+	sqe->flags 		= IOSQE_BUFFER_SELECT;
+	sqe->buf_group 	= ring->bufGroup;
+	sqe->user_data 	= userData;
+}
+
+/* Queues a sendmsg - msg must stay valid until its completion arrives */
+void uringPrepSendmsg(DATA_uring *ring, int fd, struct msghdr *msg, 
+	uint64_t userData)
+{
+	struct io_uring_sqe *sqe = uringGetSqe(ring);
+	sqe->opcode 	= IORING_OP_SENDMSG;
+	sqe->fd 		= fd;
+	sqe->addr 		= (uint64_t) (uintptr_t) msg;
+	sqe->len 		= 1;
+	sqe->user_data 	= userData;
+}
+
+void uringClose(DATA_uring *ring)
+{
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	if (ring->bufRing != NULL)
+	{
+		munmap(ring->bufRing, ring->bufCount*sizeof(struct io_uring_buf));
+		munmap(ring->bufBase, (size_t) ring->bufCount*ring->bufSize);
+	}
+}
+
+#endif